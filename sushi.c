@@ -32,6 +32,7 @@
  */
 
 /* #define ENABLE_PLEDGE */  /* enable usage of OpenBSD's pledge(2). */
+/* #define ENABLE_LOADABLE */ /* enable loading builtins with enable -f. */
 /* #define REPORT_SIGINT */  /* report if a process was killed by SIGINT. */
 /* #define REPORT_SIGPIPE */ /* report if a process was killed by SIGPIPE. */
 
@@ -63,6 +64,69 @@
  */
 #define ARGV_ALLOC_SIZE 256
 
+/*
+ * exit status of a command run by the timeout builtin that had to be
+ * stopped, the same as timeout(1)'s. and how long it gets to exit after
+ * SIGTERM before it's sent SIGKILL, in milliseconds, unless -k is given.
+ */
+#define TIMEOUT_EXITSTATUS 124
+#define TIMEOUT_KILL_DELAY 5000
+
+/*
+ * maximum length of the value of a %(command) prompt segment. only the
+ * first line of the command's output is used, and anything past this
+ * length is cut off.
+ */
+#define PROMPT_SEGMENT_MAX 256
+
+/*
+ * how many %(command) prompt segment values are cached, each for one
+ * command in one directory. the least recently used is forgotten first.
+ */
+#define PROMPT_SEGMENTS_MAX 32
+
+/*
+ * how deep function calls can be nested before the shell gives up,
+ * to stop runaway recursion before it runs out of stack.
+ */
+#define FUNCTION_DEPTH_MAX 1000
+
+/*
+ * how many compiled arithmetic expressions are kept around so that
+ * they aren't parsed again every time they are evaluated, e.g in a
+ * function called in a loop.
+ */
+#define ARITH_CACHE_SIZE 256
+
+/*
+ * same as above, but for [[ ]] conditional expressions and the
+ * regular expressions used with =~ in them.
+ */
+#define COND_CACHE_SIZE 256
+#define REGEX_CACHE_SIZE 64
+
+/*
+ * how much the read builtin reads at a time from a file it can seek
+ * back in. whatever is past the end of the line is given back with
+ * lseek(), so this is two system calls per line instead of one per
+ * byte. pipes and terminals are still read one byte at a time.
+ */
+#define READ_CHUNK_SIZE 4096
+
+/*
+ * the lowest fd the shell moves the files it keeps open for itself to,
+ * e.g the script it's running or the terminal, and where it saves the
+ * fds a builtin's redirection replaces, so that they don't get in the
+ * way of 'exec 3>file' and the like.
+ */
+#define SHELL_FD_BASE 10
+
+/*
+ * how many threads of a program using the library can wait for their
+ * children with poll() at once, e.g in a for -j loop
+ */
+#define SIGCHLD_PIPES 16
+
 /*
  * ===========================================================================
  * compatibility stuff with some platforms
@@ -79,6 +143,11 @@ typedef uint64_t __u64;
 
 #endif /* __dietlibc__ */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* glibc and musl need _GNU_SOURCE for pipe2() and F_SETPIPE_SZ */
+#define _GNU_SOURCE
+#endif /* __linux__ && !_GNU_SOURCE */
+
 #if defined(ENABLE_PLEDGE)
 /* OpenBSD needs _BSD_SOURCE for pledge() */
 #define _BSD_SOURCE
@@ -89,24 +158,66 @@ typedef uint64_t __u64;
  * includes
  */
 #define _POSIX_C_SOURCE 200809L
+#include <sys/mman.h>
 #include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif /* __linux__ */
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <ctype.h>
 #include <errno.h>
-#include <glob.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(ENABLE_LOADABLE)
+#include <dlfcn.h>
+#endif /* ENABLE_LOADABLE */
+#if defined(SUSHI_LIBRARY)
+#include <pthread.h>
+#endif /* SUSHI_LIBRARY */
+
+#if defined(ENABLE_LOADABLE) || defined(SUSHI_LIBRARY)
+#include "sushi.h"
+#endif /* ENABLE_LOADABLE || SUSHI_LIBRARY */
+
+/*
+ * ===========================================================================
+ * macros
+ */
+#define LEN(a) (sizeof(a) / sizeof(*(a)))
+
+/*
+ * the state of the shell that isn't the process's. the library keeps it
+ * per thread, so that contexts run at once on different threads.
+ */
+#if defined(SUSHI_LIBRARY)
+#define PERTHREAD __thread
+#else
+#define PERTHREAD
+#endif /* SUSHI_LIBRARY */
+
+/* if exit was run in the library, where the shell can't exit */
+#if defined(SUSHI_LIBRARY)
+#define EXITING exiting
+#else
+#define EXITING 0
+#endif /* SUSHI_LIBRARY */
+
 /*
  * ===========================================================================
  * types
@@ -119,7 +230,9 @@ enum opt {
 	OPT_IGNOREEOF = 1 << 4,
 	OPT_PIPEFAIL  = 1 << 5,
 	OPT_STDIN     = 1 << 6,
-	OPT_VERBOSE   = 1 << 7
+	OPT_VERBOSE   = 1 << 7,
+	OPT_XTRACE    = 1 << 8,
+	OPT_AUTOBATCH = 1 << 9
 };
 
 struct command {
@@ -129,11 +242,49 @@ struct command {
 	int *dynallocinfo;
 };
 
+struct redir {
+	int fd; /* what target becomes, -1 to close it */
+	int target;
+	int opened; /* fd was opened for the command, close it after */
+};
+
+struct sink {
+	int fd;             /* where the output goes, -1 if it's closed */
+	int failed;         /* a write failed, the rest is dropped */
+	size_t len;
+	char buf[BUFSIZ];
+};
+
+struct redirsave {
+	int target;
+	int saved; /* -1 if target wasn't open */
+	int out;   /* evalout before, see stdoutfd() */
+};
+
 struct cmdinfo {
 	char **vars;
 	char **vals;
 	int canexpandpath;
-	int redirfds[3];
+	struct redir *redirs; /* applied in order */
+	size_t nredirs;
+	int *outfds; /* more places for the output to outtarget to go */
+	size_t noutfds;
+	int outtarget;
+	size_t globstart, globend; /* arguments of the biggest glob */
+	const char *words;  /* the buffer cmdbuild() put argv in */
+	const char *plain;  /* see struct cmdwords, NULL for parsecmd() */
+};
+
+struct coproc {
+	char *name;
+	pid_t pid;
+	int status; /* -1 while it's running */
+	int fds[2]; /* the shell's ends of its pipes, -1 once closed */
+};
+
+struct subst {
+	pid_t pid;
+	int fd; /* the end of the pipe that /dev/fd/N refers to */
 };
 
 struct builtin {
@@ -141,6 +292,286 @@ struct builtin {
 	const char *name;
 };
 
+#if defined(ENABLE_LOADABLE)
+struct loaded {
+	char *name;
+	char *path;         /* the library it was loaded from */
+	sushi_builtin *fn;
+};
+#endif /* ENABLE_LOADABLE */
+
+enum partkind {
+	PART_LIT,      /* text that's taken as it is, in lits */
+	PART_QUOTE,    /* the word had quotes, it's kept even if it's empty */
+	PART_PARAM,    /* a parameter, its name is in the command's text */
+	PART_SUBST,    /* a <(cmd) or >(cmd), cmd is in the command's text */
+	PART_WORD,     /* the end of a word */
+	PART_PIPE      /* the end of a command in a pipeline */
+};
+
+struct cmdpart {
+	enum partkind kind;
+	size_t off, len;    /* where the literal, name or command is */
+	size_t closelen;    /* of a parameter, see scanparam() */
+	char quote;         /* how a literal or parameter was quoted, or
+			       which way a substitution goes */
+};
+
+struct cmdcode {
+	/*
+	 * a pipeline split into words once, with the quotes removed and
+	 * the parameters left to expand each time it's run
+	 */
+	struct cmdpart *parts;
+	size_t nparts;
+	size_t ncmds;
+	char *lits;
+};
+
+struct cmdwords {
+	/* the words cmdbuild() expands a struct cmdcode into */
+	char *buf;          /* each word ends with a NUL */
+	size_t size, len;
+	size_t start;       /* where the word being added starts */
+	char *plain;        /* whether each character of buf was unquoted */
+	size_t plainsize;   /* literal text, see parseredir() */
+	int quoted;         /* it had quotes, so it's kept even if empty */
+	char *pat;          /* it as a pattern, with quoted * ? [ escaped */
+	size_t patsize, patlen;
+	int glob;           /* it has an unquoted * ? or [ */
+	size_t *counts;     /* how many words each command got */
+	size_t count;
+	struct cmdinfo *infos;
+	size_t cmd;
+	size_t nassign;     /* leading assignments of the command */
+};
+
+enum nodetype {
+	NODE_CMD,      /* a pipeline, run by cmdrun() or as text by exec() */
+	NODE_COND,     /* a [[ ]] command, text is what's inside */
+	NODE_AND,      /* cond && body */
+	NODE_OR,       /* cond || body */
+	NODE_IF,       /* if cond; then body; else alt; fi */
+	NODE_GROUP,    /* { body; }, text is its redirection */
+	NODE_WHILE,    /* while cond; do body; done, same as above */
+	NODE_UNTIL,    /* until cond; do body; done, same as above */
+	NODE_FOR,      /* for ...; do body; done, cond is a NODE_CMD of ... */
+	NODE_SUBSHELL, /* ( body ), same as above */
+	NODE_FUNC,     /* a function definition, text is the name */
+	NODE_PIPE      /* cond | body where one is a compound command */
+};
+
+struct node {
+	enum nodetype type;
+	char *text;
+	struct cmdcode *code; /* a NODE_CMD split by cmdcompile() or NULL */
+	struct node *body;  /* the commands inside a compound command */
+	struct node *cond;  /* the condition of an if, left side of && */
+	struct node *alt;   /* the else part of an if, or an elif */
+	struct node *next;  /* the next command in the list */
+};
+
+struct function {
+	char *name;
+	struct node *body;
+	int refs;           /* how many calls of the function are running */
+	int stale;          /* the function was redefined while running */
+	struct function *next;
+};
+
+struct var {
+	char *name;
+	char *val;
+	char **items;       /* the set elements if it's an array, val is NULL */
+	size_t *index;      /* the index of each of them, in increasing order */
+	size_t nitems, itemsize;
+	struct var *next;
+};
+
+enum arithop {
+	ARITH_NUM,     /* a constant */
+	ARITH_VAR,     /* a variable */
+	ARITH_PARAM,   /* num is the index of a positional parameter, or
+	                  name is one of #, ? and $ */
+	ARITH_NEG,
+	ARITH_NOT,
+	ARITH_COMPL,
+	ARITH_PREINC,
+	ARITH_PREDEC,
+	ARITH_POSTINC,
+	ARITH_POSTDEC,
+	ARITH_MUL,
+	ARITH_DIV,
+	ARITH_MOD,
+	ARITH_ADD,
+	ARITH_SUB,
+	ARITH_SHL,
+	ARITH_SHR,
+	ARITH_LT,
+	ARITH_LE,
+	ARITH_GT,
+	ARITH_GE,
+	ARITH_EQ,
+	ARITH_NE,
+	ARITH_BAND,
+	ARITH_BXOR,
+	ARITH_BOR,
+	ARITH_AND,
+	ARITH_OR,
+	ARITH_COND,
+	ARITH_ASSIGN,  /* binop is the operator of a compound assignment */
+	ARITH_COMMA
+};
+
+struct arith {
+	enum arithop op;
+	enum arithop binop;
+	int64_t num;
+	char *name;
+	struct arith *a, *b, *c;
+};
+
+struct arithinfix {
+	const char *str;
+	int prec;
+	enum arithop op;
+	enum arithop binop;
+};
+
+struct arithexpr {
+	char *text;
+	size_t len;
+	struct arith *tree;
+};
+
+enum condop {
+	COND_OR,
+	COND_AND,
+	COND_NOT,
+	COND_NONEMPTY, /* -n, or a word on its own */
+	COND_EMPTY,    /* -z */
+	COND_FILE,     /* file tests, flag is the letter of the test */
+	COND_TTY,      /* -t */
+	COND_MATCH,    /* == or =, with a pattern on the right */
+	COND_NOMATCH,  /* != */
+	COND_LT,       /* < and > compare strings */
+	COND_GT,
+	COND_REGEX,    /* =~ */
+	COND_EQ,       /* -eq, -ne, etc. compare integers */
+	COND_NE,
+	COND_ILT,
+	COND_ILE,
+	COND_IGT,
+	COND_IGE,
+	COND_NT,       /* -nt, -ot and -ef compare files */
+	COND_OT,
+	COND_EF
+};
+
+struct cond {
+	enum condop op;
+	char flag;
+	char *l, *r;        /* the operands as written, expanded when run */
+	struct cond *a, *b;
+};
+
+struct condtok {
+	char *s;
+	int op;             /* an unquoted operator like ( or && */
+};
+
+struct condexpr {
+	char *text;
+	struct cond *tree;
+};
+
+struct condstat {
+	/*
+	 * the result of the last stat() and lstat() of a file while
+	 * evaluating an expression, so that testing the same file more
+	 * than once doesn't stat it again
+	 */
+	char *path[2];
+	int err[2];
+	struct stat st[2];
+};
+
+struct regexcache {
+	char *pattern;
+	regex_t re;
+};
+
+struct snapbuf {
+	char *buf;
+	size_t size, len;
+};
+
+struct snapreader {
+	const char *p, *end;
+};
+
+struct frame {
+	char **argv;        /* the positional parameters, $1 is argv[0] */
+	size_t argc;
+	struct frame *prev;
+};
+
+#if defined(SUSHI_LIBRARY)
+/*
+ * the state of the shell that belongs to each context of the library,
+ * it's swapped with the thread's while one runs, see ctxswap()
+ */
+struct sushi {
+	int opts;
+	int laststatus;
+	int lastfail;
+	int lastexit;
+	int *pipestatus;
+	size_t npipestatus;
+	long lastduration;
+	int pipebuf;
+	int batchjobs;
+	char *promptfmt;
+	struct frame topframe;
+	struct function *functions[64];
+	struct var *variables[64];
+	struct sourced *sourcecache;
+	struct coproc *coprocs;
+	size_t ncoprocs;
+	char *tracering;
+	size_t tracesize;
+	size_t tracepos;
+	int tracewrapped;
+	int tracefd;
+	char *tracepath;
+	pthread_mutex_t lock; /* held by the thread running it */
+};
+#endif /* SUSHI_LIBRARY */
+
+struct sourced {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime, ctime;
+	off_t size;
+	int racy;           /* it was read right after it changed */
+	struct node *tree;  /* the parsed contents of the file */
+	int refs;           /* how many times the file is being sourced */
+	int stale;          /* the file changed and this entry was dropped */
+	struct sourced *next;
+};
+
+struct promptseg {
+	char *cmd;          /* the command run to compute the segment */
+	char *dir;          /* directory the command is run in */
+	char *val;          /* cached value, NULL if not computed yet */
+	char buf[PROMPT_SEGMENT_MAX];
+	size_t buflen;
+	pid_t pid;          /* -1 if the command is not running */
+	int fd;             /* read end of the command's output pipe */
+	struct promptseg *next;
+};
+
 
 /*
  * ===========================================================================
@@ -148,61 +579,340 @@ struct builtin {
  */
 
 /* builtins */
+static int builtin_break(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_cache(const struct command *cmd,
+		const struct cmdinfo *info);
 static int builtin_cd(const struct command *cmd,
 		const struct cmdinfo *info);
+static int builtin_colon(const struct command *cmd,
+		const struct cmdinfo *info);
 static int builtin_exit(const struct command *cmd,
 		const struct cmdinfo *info);
+static int builtin_export(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_mapfile(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_read(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_return(const struct command *cmd,
+		const struct cmdinfo *info);
 static int builtin_set(const struct command *cmd,
 		const struct cmdinfo *info);
+static int builtin_shift(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_snapshot(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_source(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_timeout(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_tracedump(const struct command *cmd,
+		const struct cmdinfo *info);
 static int builtin_type(const struct command *cmd,
 		const struct cmdinfo *info);
-static int end_builtin_redir(const struct cmdinfo *info,
-		const int savefds[2]);
-static int start_builtin_redir(const struct cmdinfo *info,
-		int savefds[2]);
+static int builtin_coproc(const struct command *cmd,
+		const struct cmdinfo *info);
+static int builtin_exec(const struct command *cmd,
+		const struct cmdinfo *info);
+#if defined(ENABLE_LOADABLE)
+static int builtin_enable(const struct command *cmd,
+		const struct cmdinfo *info);
+#endif /* ENABLE_LOADABLE */
+static int end_builtin_redir(size_t saved);
+static int isbuiltin(const char *name);
+static int start_builtin_redir(const struct cmdinfo *info, size_t *saved,
+		struct sink *out);
 static int try_exec_builtin(const struct command *cmd,
 		const struct cmdinfo *info);
 
 /* command execution */
+static int applyredirs(const struct cmdinfo *info);
+static void closeredirs(struct cmdinfo *info);
+static int cmdaddword(struct cmdwords *w, const char *s);
+static int cmdappend(struct cmdwords *w, const char *s, size_t n, int plain,
+		int quoted);
+static int cmdbuild(const struct node *n, struct cmdwords *w,
+		struct command *cmds, struct cmdinfo *infos);
+static int cmdendword(struct cmdwords *w);
+static int cmdexpand(struct cmdwords *w, const char *exp, char quote);
+static int cmdplain(const struct cmdwords *w, size_t off, size_t n);
+static int cmdput(struct cmdwords *w, const char *s, size_t n, int plain);
+static int cmdrun(const struct node *n);
+static void cmdwordsfree(struct cmdwords *w);
 static int exec(char *s);
-static pid_t pipechain(char *s, pid_t *pgid, int *rpipe, int *wpipe,
-		int *closethis);
+static int execcmd(struct command *origcmd, struct cmdinfo *info);
+static void fanout(const struct cmdinfo *info, int pipefd);
+static void fanoutclose(struct cmdinfo *info);
+static int fanoutcopy(int in, const int *outs, size_t nouts);
+static int fanoutmove(int from, int to, size_t n, char *buf);
+static int makepipe(int fds[2]);
+static pid_t pipechain(struct command *origcmd, struct cmdinfo *info,
+		size_t stage, pid_t *pgid, int *rpipe, int *wpipe);
 static int pipeline(char *s);
-static void takecmd(char *s);
+static int runpipeline(struct command *cmds, struct cmdinfo *infos,
+		char **labels, size_t n);
+static int runbatches(const struct command *cmd,
+		const struct cmdinfo *info);
+static int spawn(const struct command *cmd, const struct cmdinfo *info,
+		long timeout, long killafter);
+static pid_t spawnchild(const struct command *cmd,
+		const struct cmdinfo *info, int ownpgrp);
+static void substinherit(void);
+static int substart(const char *cmd, size_t len, int out);
+static void substwait(size_t from);
+static void timedwait(pid_t pid, long timeout, long killafter);
+static int groupredir(const char *text, char **s, struct command *cmd,
+		struct cmdinfo *info);
+static int joinpgrp(void);
+static void rungroup(const struct node *n);
+static int forreap(int sigfd, pid_t *pids, int *outs, int *statuses,
+		size_t started, size_t *done, size_t *running);
+static void runfor(const struct node *n);
+static void runloop(const struct node *n);
+static void runpipe(const struct node *n);
+static void runsubshell(const struct node *n);
+static void runtree(const struct node *n);
+static int takecmd(const char *s, int last);
 static void update_laststatus(int status);
 
+#if defined(SUSHI_LIBRARY)
+/* library */
+static void ctxinit(void);
+static void ctxswap(struct sushi *sh);
+static void ctxthreadend(void *p);
+static void swapmem(void *a, void *b, size_t n);
+#endif /* SUSHI_LIBRARY */
+
+/* execution tracing */
+static int64_t traceclock(void);
+static int tracejson(char **buf, size_t *size, size_t *len, const char *s);
+static void tracespan(const char *name, int64_t start, const char *cmd,
+		pid_t pid, pid_t pgid, int stage);
+static void xtrace(const struct command *cmd, const struct cmdinfo *info);
+static void xtracedump(struct sink *out);
+static int xtracequote(char **buf, size_t *size, size_t *len,
+		const char *s);
+
+/* prompt */
+#if !defined(SUSHI_LIBRARY)
+static int promptcollect(struct promptseg *seg);
+#endif /* !SUSHI_LIBRARY */
+static const char *promptcwd(void);
+#if !defined(SUSHI_LIBRARY)
+static struct promptseg *promptlookup(const char *cmd, size_t len,
+		const char *dir);
+static void promptrefresh(void);
+static int promptrender(char **buf, size_t *size);
+#endif /* !SUSHI_LIBRARY */
+static void promptset(const char *fmt);
+#if !defined(SUSHI_LIBRARY)
+static void promptspawn(struct promptseg *seg);
+static void promptwait(FILE *input);
+#endif /* !SUSHI_LIBRARY */
+
 /* command parsing */
+static struct cmdpart *cmdaddpart(struct cmdcode *c, size_t *size,
+		enum partkind kind);
+static struct cmdcode *cmdcompile(const char *s);
 static int parsecmd(char *s, struct command *cmd, struct cmdinfo *info);
+static int parsecommand(const char **pp, struct node **n);
+static int parsecond(const char **pp, struct node **n);
+static int parseandor(const char **pp, struct node **n);
+static int parsecompound(const char **pp, const char *p,
+		enum nodetype type, struct node *cond, struct node *body,
+		struct node **n);
+static int parsegroup(const char **pp, struct node **n);
+static int parsefor(const char **pp, struct node **n);
+static int parseloop(const char **pp, struct node **n);
+static int parseif(const char **pp, struct node **n);
+static int argplain(const struct cmdinfo *info, const char *p, size_t n);
 static int parseenv(struct command *cmd, struct cmdinfo *info);
+static int parsefunc(const char **pp, struct node **n, size_t namelen,
+		const char *p);
+static int parselist(const char **pp, struct node **list);
+static int parsepipe(const char **pp, struct node **n);
 static int parseredir(struct command *cmd, struct cmdinfo *info);
+static int redirclash(const struct cmdinfo *info, int fd, int target);
+static int redirmove(int *fd);
+static int redirresolve(const struct cmdinfo *info, size_t n, int fd);
+static int parsetree(const char *s, struct node **tree);
 
 /* memory allocation for commands */
 static int alloccmd(size_t slots, struct command *cmd);
 static int realloccmd(size_t slots, struct command *cmd);
 static void freecmd(const struct command *cmd);
+static void cmdfree(struct cmdcode *c);
+static int duptree(const struct node *n, struct node **copy);
+static void freetree(struct node *n);
+static struct node *newnode(enum nodetype type, const char *text,
+		size_t len);
+
+/* functions */
+static int funcdefine(const char *name, const struct node *body);
+static struct function *funcfind(const char *name);
+static void funcrelease(struct function *fn);
+static int funcrun(struct function *fn, const struct command *cmd);
+
+/* shell variables */
+static struct var *varfind(const char *name);
+static void varfree(struct var *v);
+static const char *varget(const char *name);
+static const char *varitem(const char *name, size_t i, size_t *n);
+static const char *varnth(const char *name, size_t k, size_t *n);
+static int varset(const char *name, const char *val);
+static int varsetarray(const char *name, char **items, size_t *idx,
+		size_t n);
+static int varsetitem(const char *name, const char *sub, const char *val);
+static char **vartemp(char **vars, char **vals, size_t *n);
+static void vartempend(char **vars, char **saved, size_t n);
+static size_t varslot(const struct var *v, size_t i);
+static void varunset(const char *name);
+
+/* sourced files */
+static char *sourcefind(const char *name);
+static struct sourced *sourceload(const char *path, const struct stat *st);
+static int sourcefile(const char *name, int mustexist);
+static void sourcerelease(struct sourced *src);
+
+/* shell state snapshots */
+static uint64_t snapenvhash(char **env);
+static int snapget(struct snapreader *r, void *p, size_t n);
+static int snapgetstr(struct snapreader *r, char **s);
+static int snapgettree(struct snapreader *r, struct node **tree,
+		int depth);
+static int snapload(const char *path);
+static char *snappath(void);
+static int snapput(struct snapbuf *b, const void *p, size_t n);
+static int snapputfield(struct snapbuf *b, char c, const char *s,
+		size_t len);
+static int snapputstr(struct snapbuf *b, const char *s);
+static int snapputtree(struct snapbuf *b, const struct node *n);
+static int snapsave(const char *path);
+
+/* arithmetic expansion */
+static struct arith *arithcompile(const char *s, size_t len);
+static int aritherr(const char *p);
+static int aritheval(const struct arith *a, int64_t *res);
+static void arithfree(struct arith *a);
+static char *arithfmt(int64_t n, char *buf);
+static int arithnew(enum arithop op, struct arith *a, struct arith *b,
+		struct arith **res);
+static int arithnum(const char *s, int64_t *res, const char **end);
+static int arithparse(const char **pp, int minprec, struct arith **res);
+static int arithprimary(const char **pp, struct arith **res);
+static int arithset(const char *name, int64_t n);
+static int arithunary(const char **pp, struct arith **res);
+static int arithvar(const struct arith *a, int64_t *res);
+
+/* conditional expressions */
+static struct cond *condcompile(const char *s);
+static int condaccess(const struct stat *st, int bits);
+static int conderr(const char *tok);
+static int condeval(const struct cond *c, struct condstat *cs);
+static int condfile(char flag, const char *path, struct condstat *cs);
+static void condfree(struct cond *c);
+static int condnew(enum condop op, struct cond **res);
+static int condparse(struct condtok *toks, size_t *i, int prec,
+		struct cond **res);
+static int condprimary(struct condtok *toks, size_t *i, struct cond **res);
+static regex_t *condregex(const char *pattern);
+static int condrun(const char *s);
+static int condstat(const char *path, int link, struct condstat *cs,
+		struct stat **st);
+static int condtokenize(const char *s, struct condtok **toks);
+static char *condword(const char *raw, int mode);
+
+/* parameter expansion */
+static int expand_array(char **buf, size_t *size, size_t *len,
+		const char *name, int quote);
+static int expand_arith(char **buf, size_t *size, size_t *len,
+		const char *expr, size_t exprlen);
+static int expand_param(char **buf, size_t *size, size_t *len,
+		const char *name, size_t namelen, size_t closelen, char quote);
+static int expand_params(const char *s, char **res);
+static int expand_procsubst(const char *s, char **res);
+static int expand_value(char **buf, size_t *size, size_t *len,
+		const char *val, int quoted);
+static int scanparam(const char *p, const char **name, const char **nameend,
+		size_t *closelen);
 
 /* pathname expansion */
-static int expand_path(const struct command *cmd, struct command *newcmd);
+static int expand_path(const struct command *cmd, struct command *newcmd,
+		struct cmdinfo *info);
 static char *expand_lone_tilde(const char *s);
 static char *expand_tilde(const char *s, int *dynalloc);
 
 /* option parsing */
 static void optcmdlineset(int initialized, const char *arg0, char *arg1,
 		char **cmdline);
-static void optlist(int plus);
+static void optlist(int plus, struct sink *out);
 static int optparse(int initialized, int argc, char *argv[], char **cmdline,
-		FILE **input);
+		FILE **input, struct sink *out);
+static int optpipebuf(const char *size);
+static int optbatchjobs(const char *n);
+static int optsize(const char *s, unsigned long *n);
 static void opttoggle(int enable, int opt);
+static int opttracefile(const char *path);
+static int optxtracebuf(const char *size);
 
 /* functions used by builtins */
+static char *cachedir(void);
+static int cachetee(int out, int err, int outfile, int errfile);
+static void coprocclose(int fd);
+static void coprocreap(void);
 static int executable(int dirfd, const char *name);
-static int which(const char *pathenv, const char *name);
+#if defined(ENABLE_LOADABLE)
+static struct loaded *loadedfind(const char *name);
+static int loadedrun(const struct loaded *lb, const struct command *cmd,
+		const struct cmdinfo *info);
+static int loadedunset(const char *name);
+#endif /* ENABLE_LOADABLE */
+static int readassign(char *line, int raw, char *const *names, size_t n,
+		const char *ifs);
+static int readfd(int fd, int delim, long timeout, char **buf,
+		size_t *size, size_t *len);
+static int readtimeout(const char *s, long *ms);
+static int sinkflush(struct sink *s);
+static void sinkopen(struct sink *s, int fd);
+static void sinkprintf(struct sink *s, const char *fmt, ...);
+static void sinkwrite(struct sink *s, const char *p, size_t n);
+static int which(const char *pathenv, const char *name, struct sink *out);
 
 /* utility functions */
+#if !defined(SUSHI_LIBRARY)
+static int atend(FILE *f);
+#endif /* !SUSHI_LIBRARY */
+static int copyfd(int from, int to);
+static uint64_t hash64(const char *s, size_t len, uint64_t h);
 static char *delimit(char *str, char delim);
+static const char *envget(const char *name);
+static int envset(const char *name, const char *val);
+static int envunset(const char *name);
+static char *findunquoted(char *s, char c);
+static int isclosing(const char *p);
+static int iscompound(const char *p);
+static int iskeyword(const char *p, const char *kw);
 static char *optstrsignal(int sig);
 static void popchar(char *ptr);
+static void proclock(void);
+static void procunlock(void);
 static void report(pid_t pid);
+static void reportstatus(int wstatus);
+static const char *scancmd(const char *p, int stage);
+static void shellexit(int status);
+static pid_t shellfork(void);
+static void sigchld(int sig);
+static void sigchldclose(int fd);
+static int sigchldopen(void);
+static void sigchldreset(void);
+static const char *skipblank(const char *p);
+static int statracy(const struct stat *st);
+static int stdoutfd(void);
+static int strappend(char **buf, size_t *size, size_t *len,
+		const char *s, size_t n);
+static size_t strhash(const char *s, size_t len);
+static int syntaxerr(const char *p);
 static int xstrtoint(int *res, const char *s, int base);
 
 /* error checking */
@@ -215,7 +925,6 @@ static void *werealloc(void *ptr, size_t size);
 static void *wereallocarray(void *ptr, size_t nmemb, size_t size);
 static char *westrdup(const char *s);
 static char *westrndup(const char *s, size_t n);
-static int wexasprintf(char **strp, const char *fmt, ...);
 static int wexstrtoint(int *res, const char *s, int base);
 
 /* error logging */
@@ -226,76 +935,521 @@ static void vlogerr(const char *fmt, va_list ap);
  * ===========================================================================
  * global variables
  */
+#if !defined(_GNU_SOURCE)
+/* POSIX leaves declaring this to the program */
+extern char **environ;
+#endif /* !_GNU_SOURCE */
+
 static const struct builtin builtins[] = {
+	{builtin_source, "."},
+	{builtin_colon, ":"},
+	{builtin_break, "break"},
+	{builtin_cache, "cache"},
 	{builtin_cd, "cd"},
+	{builtin_break, "continue"},
+	{builtin_coproc, "coproc"},
+#if defined(ENABLE_LOADABLE)
+	{builtin_enable, "enable"},
+#endif /* ENABLE_LOADABLE */
+	{builtin_exec, "exec"},
 	{builtin_exit, "exit"},
+	{builtin_export, "export"},
+	{builtin_mapfile, "mapfile"},
+	{builtin_read, "read"},
+	{builtin_mapfile, "readarray"},
+	{builtin_return, "return"},
 	{builtin_set, "set"},
+	{builtin_shift, "shift"},
+	{builtin_snapshot, "snapshot"},
+	{builtin_source, "source"},
+	{builtin_timeout, "timeout"},
+	{builtin_tracedump, "tracedump"},
 	{builtin_type, "type"},
 	{NULL, NULL}
 };
 
-static char defaultprompt[] = "$ ";
-
-static const char *argv0 = NULL;
-static char *prompt = defaultprompt;
-static int opts = OPT_EXEC | OPT_GLOB | OPT_STDIN;
+/*
+ * binary, ternary and assignment operators of arithmetic expressions.
+ * longer operators come first so that the longest match is found.
+ */
+static const struct arithinfix arithinfixes[] = {
+	{"<<=", 2, ARITH_ASSIGN, ARITH_SHL},
+	{">>=", 2, ARITH_ASSIGN, ARITH_SHR},
+	{"*=", 2, ARITH_ASSIGN, ARITH_MUL},
+	{"/=", 2, ARITH_ASSIGN, ARITH_DIV},
+	{"%=", 2, ARITH_ASSIGN, ARITH_MOD},
+	{"+=", 2, ARITH_ASSIGN, ARITH_ADD},
+	{"-=", 2, ARITH_ASSIGN, ARITH_SUB},
+	{"&=", 2, ARITH_ASSIGN, ARITH_BAND},
+	{"^=", 2, ARITH_ASSIGN, ARITH_BXOR},
+	{"|=", 2, ARITH_ASSIGN, ARITH_BOR},
+	{"||", 4, ARITH_OR, ARITH_OR},
+	{"&&", 5, ARITH_AND, ARITH_AND},
+	{"==", 9, ARITH_EQ, ARITH_EQ},
+	{"!=", 9, ARITH_NE, ARITH_NE},
+	{"<=", 10, ARITH_LE, ARITH_LE},
+	{">=", 10, ARITH_GE, ARITH_GE},
+	{"<<", 11, ARITH_SHL, ARITH_SHL},
+	{">>", 11, ARITH_SHR, ARITH_SHR},
+	{",", 1, ARITH_COMMA, ARITH_COMMA},
+	{"=", 2, ARITH_ASSIGN, ARITH_ASSIGN},
+	{"?", 3, ARITH_COND, ARITH_COND},
+	{"|", 6, ARITH_BOR, ARITH_BOR},
+	{"^", 7, ARITH_BXOR, ARITH_BXOR},
+	{"&", 8, ARITH_BAND, ARITH_BAND},
+	{"<", 10, ARITH_LT, ARITH_LT},
+	{">", 10, ARITH_GT, ARITH_GT},
+	{"+", 12, ARITH_ADD, ARITH_ADD},
+	{"-", 12, ARITH_SUB, ARITH_SUB},
+	{"*", 13, ARITH_MUL, ARITH_MUL},
+	{"/", 13, ARITH_DIV, ARITH_DIV},
+	{"%", 13, ARITH_MOD, ARITH_MOD}
+};
 
-static int laststatus = 0;
-static int lastfail = 0; /* used for pipefail */
+/*
+ * binary operators of [[ ]] expressions
+ */
+static const struct {
+	const char *str;
+	enum condop op;
+} condbinops[] = {
+	{"==", COND_MATCH},
+	{"=", COND_MATCH},
+	{"!=", COND_NOMATCH},
+	{"<", COND_LT},
+	{">", COND_GT},
+	{"=~", COND_REGEX},
+	{"-eq", COND_EQ},
+	{"-ne", COND_NE},
+	{"-lt", COND_ILT},
+	{"-le", COND_ILE},
+	{"-gt", COND_IGT},
+	{"-ge", COND_IGE},
+	{"-nt", COND_NT},
+	{"-ot", COND_OT},
+	{"-ef", COND_EF}
+};
 
-static int term = -1;
-static pid_t shell_pgid = -1;
+/*
+ * the prompt format, see promptrender() for the supported sequences.
+ * the default shows the exit status of the last command if it failed.
+ */
+static const char defaultprompt[] = "%e$ ";
+#if !defined(SUSHI_LIBRARY)
+static const char promptplaceholder[] = "...";
+static const char contprompt[] = "> ";
+#endif /* !SUSHI_LIBRARY */
+
+static PERTHREAD const char *argv0 = NULL;
+static PERTHREAD char *promptfmt = NULL;
+#if !defined(SUSHI_LIBRARY)
+static char *prompt = NULL;
+static size_t promptsize = 0;
+static struct promptseg *promptsegs = NULL;
+#endif /* !SUSHI_LIBRARY */
+static PERTHREAD struct sourced *sourcecache = NULL;
+static PERTHREAD struct function *functions[64];
+static PERTHREAD struct var *variables[64];
+static PERTHREAD struct arithexpr arithcache[ARITH_CACHE_SIZE];
+static PERTHREAD struct condexpr condcache[COND_CACHE_SIZE];
+static PERTHREAD struct regexcache regexcache[REGEX_CACHE_SIZE];
+static PERTHREAD struct frame topframe = {NULL, 0, NULL};
+#if defined(SUSHI_LIBRARY)
+/* set to &topframe by sushi_eval() in each thread */
+static PERTHREAD struct frame *curframe = NULL;
+#else
+static struct frame *curframe = &topframe;
+#endif /* SUSHI_LIBRARY */
+static PERTHREAD int funcdepth = 0;
+static PERTHREAD int sourcedepth = 0;
+static PERTHREAD int returning = 0; /* set by the return builtin */
+#if defined(SUSHI_LIBRARY)
+/* exit and exec in the library unwind like return, see shellexit() */
+static PERTHREAD int exiting = 0;
+static PERTHREAD int exitcode = 0;
+/* taken while the process's descriptors and such change, see proclock() */
+static pthread_mutex_t procmutex = PTHREAD_MUTEX_INITIALIZER;
+static PERTHREAD int proclocked = 0;
+static pthread_once_t ctxonce = PTHREAD_ONCE_INIT;
+static pthread_key_t ctxkey; /* frees a thread's caches, see ctxthreadend() */
+static int ctxkeyfailed = 0;
+#endif /* SUSHI_LIBRARY */
+static PERTHREAD int loopdepth = 0;
+/* loops to leave, set by break and continue */
+static PERTHREAD int loopjump = 0;
+static PERTHREAD int loopcontinue = 0; /* start the next iteration after that */
+static PERTHREAD int forked = 0; /* running in a forked copy of the shell */
+/* running the last command the shell runs, 2 in exec */
+static PERTHREAD int tailpos = 0;
+static PERTHREAD int pipebuf = 0; /* size of pipe buffers, 0 for the default */
+/* how many batches set -o autobatch runs at once */
+static PERTHREAD int batchjobs = 1;
+/* SIGCHLD writes to each of them, see sigchldopen() */
+static int sigchldpipes[SIGCHLD_PIPES][2];
+static volatile sig_atomic_t nsigchld = 0;
+static int sigchldbusy[SIGCHLD_PIPES];
+static int sigchldusers = 0;
+static struct sigaction sigchldold;
+/* see start_builtin_redir() */
+static PERTHREAD struct redirsave *redirsaves = NULL;
+static PERTHREAD size_t nredirsaves = 0;
+static PERTHREAD size_t redirsavesize = 0;
+static PERTHREAD int redirlocked = 0; /* they hold proclock() */
+static PERTHREAD int evalout = -1; /* see stdoutfd() */
+static PERTHREAD struct subst *substs = NULL; /* of the command being run */
+static PERTHREAD size_t nsubsts = 0;
+static PERTHREAD size_t substsize = 0;
+static PERTHREAD pid_t substpgid = -1;
+/* started by the coproc builtin */
+static PERTHREAD struct coproc *coprocs = NULL;
+static PERTHREAD size_t ncoprocs = 0;
+#if defined(ENABLE_LOADABLE)
+/* added with enable -f, for every thread */
+static struct loaded **loadedbuiltins = NULL;
+static size_t nloaded = 0;
+#endif /* ENABLE_LOADABLE */
+/* where set -x writes if it's not stderr */
+static PERTHREAD char *tracering = NULL;
+static PERTHREAD size_t tracesize = 0;
+static PERTHREAD size_t tracepos = 0; /* where the next record goes in it */
+static PERTHREAD int tracewrapped = 0;
+static struct timespec shellstart;
+static PERTHREAD int tracefd = -1; /* set -o tracefile=PATH */
+static PERTHREAD char *tracepath = NULL;
+static PERTHREAD uid_t euid;
+static PERTHREAD gid_t egid;
+static PERTHREAD gid_t *groups;
+static PERTHREAD int ngroups = -1; /* -1 until the above are looked up */
+static PERTHREAD int opts = OPT_EXEC | OPT_GLOB | OPT_STDIN;
+static int startopts = 0; /* opts once the arguments were parsed */
+static char **startenv = NULL; /* the environment the shell started with */
+
+static PERTHREAD int laststatus = 0;
+static PERTHREAD int lastfail = 0; /* used for pipefail */
+/* status of the last command, see pipefail */
+static PERTHREAD int lastexit = 0;
+/* status of each command of the last */
+static PERTHREAD int *pipestatus = NULL;
+static PERTHREAD size_t npipestatus = 0; /* pipeline, if it was a pipeline */
+static PERTHREAD long lastduration = -1; /* how long it took in milliseconds */
+
+static PERTHREAD int term = -1;
+static PERTHREAD pid_t shell_pgid = -1;
 
 /*
  * ===========================================================================
  * builtins
  */
 static int
-builtin_cd(const struct command *cmd, const struct cmdinfo *info)
+builtin_break(const struct command *cmd, const struct cmdinfo *info)
 {
+	/* break and continue, which leave n loops */
 	const char *oldargv0 = argv0;
-	int savefds[2];
-	int ret = 0;
+	size_t savefds;
+	int ret = 0, n = 1;
 	size_t arg = 1;
 
-	if (start_builtin_redir(info, savefds) < 0)
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
 		return MISC_FAILURE_STATUS;
 	argv0 = cmd->argv[0];
 
 	if (cmd->argc > 1 && !strcmp(cmd->argv[1], "--"))
 		++arg;
 
-	if (cmd->argc > arg) {
-		if (cmd->argc > arg + 1) {
-			logerr("too many operands specified");
-			ret = 1;
-		} else if (chdir(cmd->argv[arg]) < 0) {
-			logerr("chdir to '%s':", cmd->argv[arg]);
-			ret = 1;
-		}
+	if (!loopdepth) {
+		logerr("can only be used in a loop");
+		ret = 1;
+	} else if (cmd->argc > arg + 1) {
+		logerr("too many operands specified");
+		ret = 1;
+	} else if (cmd->argc > arg && wexstrtoint(&n, cmd->argv[arg], 10)
+			< 0) {
+		ret = 1;
+	} else if (n < 1) {
+		logerr("loop count must be at least 1");
+		ret = 1;
 	} else {
-		const char *home = getenv("HOME");
-		if (home && chdir(home) < 0) {
-			logerr("chdir to '%s':", home);
-			ret = 1;
+		/* leaving more loops than there are leaves all of them */
+		loopjump = (n > loopdepth) ? loopdepth : n;
+		loopcontinue = !strcmp(cmd->argv[0], "continue");
+	}
+
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
+}
+
+static int
+builtin_cache(const struct command *cmd, const struct cmdinfo *info)
+{
+	/*
+	 * cache [--key-files file ...] [--env name ...] [--ttl duration]
+	 *       -- command [argument ...]
+	 *
+	 * run an external command and keep what it writes to stdout and
+	 * stderr and its exit status. when it's run again with the same
+	 * arguments in the same directory, the --env variables have the
+	 * same values and the --key-files haven't changed, those are given
+	 * back instead of running it, e.g for git rev-parse. entries older
+	 * than the --ttl duration are run again. while a key file could
+	 * still change unseen, see statracy(), the cache isn't used.
+	 *
+	 * they're kept in $SUSHI_CACHE_DIR, or sushi in $XDG_CACHE_HOME or
+	 * ~/.cache, named after a hash of all of the above: the output in
+	 * NAME.out and NAME.err, and the status and what was hashed in
+	 * NAME, which is written last and compared on a hit.
+	 */
+	const char *oldargv0 = argv0;
+	struct command sub;
+	struct cmdinfo ci;
+	struct redir r[2];
+	struct stat st;
+	const char *cwd, *val;
+	char *key = NULL, *dir = NULL, *path = NULL, *entry = NULL;
+	char *tmp[3] = {NULL, NULL, NULL};
+	char num[128];
+	size_t keysize = 0, keylen = 0, len = 0;
+	size_t savefds, arg, i;
+	uint64_t h;
+	long ttl = -1;
+	ssize_t n;
+	int fds[3] = {-1, -1, -1}, out[2] = {-1, -1}, err[2] = {-1, -1};
+	int tail = tailpos;
+	int mode = 0; /* 1 after --key-files, 2 after --env */
+	int racy = 0;
+	int ret = MISC_FAILURE_STATUS, status;
+	pid_t chpid;
+
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
+
+	/* relative paths and most commands depend on the directory */
+	if (!(cwd = promptcwd())) {
+		logerr("getcwd:");
+		goto end;
+	}
+	if (strappend(&key, &keysize, &keylen, cwd, strlen(cwd) + 1) < 0)
+		goto end;
+	for (arg = 1; arg < cmd->argc; ++arg) {
+		if (!strcmp(cmd->argv[arg], "--")) {
+			++arg;
+			break;
+		} else if (!strcmp(cmd->argv[arg], "--key-files")) {
+			mode = 1;
+		} else if (!strcmp(cmd->argv[arg], "--env")) {
+			mode = 2;
+		} else if (!strcmp(cmd->argv[arg], "--ttl")) {
+			if (arg + 1 >= cmd->argc) {
+				logerr("option '--ttl' needs an argument");
+				goto end;
+			}
+			if (readtimeout(cmd->argv[++arg], &ttl) < 0)
+				goto end;
+			mode = 0;
+		} else if (mode == 1) {
+			/* anything that changes when the file is written */
+			if (stat(cmd->argv[arg], &st) < 0) {
+				sprintf(num, "-");
+			} else {
+				sprintf(num, "%lu %lu %ld %ld.%09ld %ld.%09ld",
+						(unsigned long)st.st_dev,
+						(unsigned long)st.st_ino,
+						(long)st.st_size,
+						(long)st.st_mtim.tv_sec,
+						st.st_mtim.tv_nsec,
+						(long)st.st_ctim.tv_sec,
+						st.st_ctim.tv_nsec);
+				racy |= statracy(&st);
+			}
+			if (strappend(&key, &keysize, &keylen, "f", 1) < 0
+					|| strappend(&key, &keysize, &keylen,
+						cmd->argv[arg],
+						strlen(cmd->argv[arg]) + 1) < 0
+					|| strappend(&key, &keysize, &keylen,
+						num, strlen(num) + 1) < 0)
+				goto end;
+		} else if (mode == 2) {
+			val = varget(cmd->argv[arg]);
+			if (strappend(&key, &keysize, &keylen, "e", 1) < 0
+					|| strappend(&key, &keysize, &keylen,
+						cmd->argv[arg],
+						strlen(cmd->argv[arg]) + 1) < 0
+					|| strappend(&key, &keysize, &keylen,
+						val ? "=" : "-", 1) < 0
+					|| (val && strappend(&key, &keysize,
+							&keylen, val,
+							strlen(val) + 1) < 0))
+				goto end;
+		} else {
+			logerr("unknown option '%s'", cmd->argv[arg]);
+			goto end;
+		}
+	}
+	if (arg >= cmd->argc) {
+		logerr("usage: cache [--key-files file ...] [--env name ...] "
+				"[--ttl duration] -- command [argument ...]");
+		goto end;
+	}
+	for (i = arg; i < cmd->argc; ++i)
+		if (strappend(&key, &keysize, &keylen, "a", 1) < 0
+				|| strappend(&key, &keysize, &keylen,
+					cmd->argv[i],
+					strlen(cmd->argv[i]) + 1) < 0)
+			goto end;
+
+	h = hash64(key, keylen, 0);
+	if (!(dir = cachedir()))
+		goto end;
+	if (!(path = wemalloc(strlen(dir) + 48)))
+		goto end;
+	len = (size_t)(sprintf(path, "%s/%08lx%08lx", dir,
+				(unsigned long)(h >> 32),
+				(unsigned long)(h & 0xffffffff)));
+
+	/* a hit: the entry has the same key and isn't too old */
+	if (!racy && (fds[2] = open(path, O_RDONLY | O_CLOEXEC)) >= 0
+			&& !fstat(fds[2], &st)
+			&& (ttl < 0 || (long)(time(NULL) - st.st_mtime)
+				< ttl / 1000)
+			&& (entry = wemalloc((size_t)(st.st_size) + 1))) {
+		for (i = 0; i < (size_t)(st.st_size); i += (size_t)(n))
+			if ((n = read(fds[2], entry + i,
+						(size_t)(st.st_size) - i)) <= 0)
+				break;
+		entry[i] = '\0';
+		if (sscanf(entry, "%d", &status) == 1
+				&& (val = strchr(entry, '\n'))
+				&& (size_t)(entry + i - val - 1) == keylen
+				&& !memcmp(val + 1, key, keylen)) {
+			fflush(stdout);
+			strcpy(path + len, ".out");
+			if ((fds[0] = open(path, O_RDONLY | O_CLOEXEC)) >= 0
+					&& copyfd(fds[0], stdoutfd()) == 0) {
+				strcpy(path + len, ".err");
+				if ((fds[1] = open(path, O_RDONLY | O_CLOEXEC))
+						>= 0)
+					copyfd(fds[1], STDERR_FILENO);
+				ret = status;
+				goto end;
+			}
 		}
 	}
 
+	/* a miss: run it with its output going through us */
+	sub.argv = cmd->argv + arg;
+	sub.argc = cmd->argc - arg;
+	sub.orig_argv = NULL;
+	sub.dynallocinfo = NULL;
+	if (funcfind(sub.argv[0])) {
+		logerr("'%s' is a function", sub.argv[0]);
+		goto end;
+	}
+	for (i = 0; builtins[i].name; ++i) {
+		if (!strcmp(sub.argv[0], builtins[i].name)) {
+			logerr("'%s' is a builtin", sub.argv[0]);
+			goto end;
+		}
+	}
+	for (i = 0; i < 3; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		if (!(tmp[i] = wemalloc(len + 32)))
+			goto end;
+		sprintf(tmp[i], "%.*s%s.%ld.tmp", (int)(len), path,
+				(i == 0) ? ".out" : (i == 1) ? ".err" : "",
+				(long)getpid());
+		if ((fds[i] = open(tmp[i], O_WRONLY | O_CREAT | O_TRUNC
+						| O_CLOEXEC, 0600)) < 0) {
+			logerr("open '%s':", tmp[i]);
+			free(tmp[i]);
+			tmp[i] = NULL;
+			goto end;
+		}
+	}
+	if (makepipe(out) < 0 || makepipe(err) < 0)
+		goto end;
+	memset(&ci, 0, sizeof(ci));
+	ci.vars = info->vars;
+	ci.vals = info->vals;
+	ci.outtarget = -1;
+	r[0].fd = out[1];
+	r[0].target = STDOUT_FILENO;
+	r[1].fd = err[1];
+	r[1].target = STDERR_FILENO;
+	r[0].opened = r[1].opened = 0;
+	ci.redirs = r;
+	ci.nredirs = 2;
+
+	/* the shell has to stay around to copy the output */
+	tailpos = 0;
+	chpid = spawnchild(&sub, &ci, 0);
+	tailpos = tail;
+	close(out[1]);
+	close(err[1]);
+	out[1] = err[1] = -1;
+	if (chpid < 0)
+		goto end;
+	status = cachetee(out[0], err[0], fds[0], fds[1]);
+	report(chpid);
+	if (term >= 0 && tcsetpgrp(term, shell_pgid) < 0)
+		logerr("tcsetpgrp:");
+	ret = laststatus;
+
+	/* not if it was killed, e.g with ^C, it may not have finished */
+	if (status < 0 || ret >= SIGNAL_EXITSTATUS || racy)
+		goto end;
+	sprintf(num, "%d\n", ret);
+	if (write(fds[2], num, strlen(num)) < 0
+			|| write(fds[2], key, keylen) < 0) {
+		logerr("write '%s':", tmp[2]);
+		goto end;
+	}
+	for (i = 0; i < 3; ++i) {
+		strcpy(path + len, (i == 0) ? ".out" : (i == 1) ? ".err" : "");
+		if (rename(tmp[i], path) < 0) {
+			logerr("rename '%s':", tmp[i]);
+			goto end;
+		}
+		free(tmp[i]);
+		tmp[i] = NULL;
+	}
+
+end:
+	for (i = 0; i < 3; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		if (tmp[i]) {
+			unlink(tmp[i]);
+			free(tmp[i]);
+		}
+	}
+	for (i = 0; i < 2; ++i) {
+		if (out[i] >= 0)
+			close(out[i]);
+		if (err[i] >= 0)
+			close(err[i]);
+	}
+	free(entry);
+	free(path);
+	free(dir);
+	free(key);
 	argv0 = oldargv0;
-	if (end_builtin_redir(info, savefds) < 0)
+	if (end_builtin_redir(savefds) < 0)
 		return MISC_FAILURE_STATUS;
 	return ret;
 }
 
 static int
-builtin_exit(const struct command *cmd, const struct cmdinfo *info)
+builtin_cd(const struct command *cmd, const struct cmdinfo *info)
 {
 	const char *oldargv0 = argv0;
-	int savefds[2];
+	size_t savefds;
 	int ret = 0;
 	size_t arg = 1;
 
-	if (start_builtin_redir(info, savefds) < 0)
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
 		return MISC_FAILURE_STATUS;
 	argv0 = cmd->argv[0];
 
@@ -303,932 +1457,8165 @@ builtin_exit(const struct command *cmd, const struct cmdinfo *info)
 		++arg;
 
 	if (cmd->argc > arg) {
-		int status;
 		if (cmd->argc > arg + 1) {
 			logerr("too many operands specified");
 			ret = 1;
-		} else if (wexstrtoint(&status, cmd->argv[arg], 10) < 0
-				|| status > 255) {
+		} else if (chdir(cmd->argv[arg]) < 0) {
+			logerr("chdir to '%s':", cmd->argv[arg]);
 			ret = 1;
-		} else {
-			exit(status);
 		}
 	} else {
-		exit(0);
+		const char *home = envget("HOME");
+		if (home && chdir(home) < 0) {
+			logerr("chdir to '%s':", home);
+			ret = 1;
+		}
 	}
 
 	argv0 = oldargv0;
-	if (end_builtin_redir(info, savefds) < 0)
+	if (end_builtin_redir(savefds) < 0)
 		return MISC_FAILURE_STATUS;
 	return ret;
 }
 
 static int
-builtin_set(const struct command *cmd, const struct cmdinfo *info)
+builtin_colon(const struct command *cmd, const struct cmdinfo *info)
 {
-	int savefds[2];
-	int ret = 0;
-
-	if (start_builtin_redir(info, savefds) < 0)
-		return MISC_FAILURE_STATUS;
-
-	if (cmd->argc > 1 && strcmp(cmd->argv[1], "--") != 0)
-		if (optparse(1, (int)(cmd->argc), cmd->argv, NULL, NULL) < 0)
-			ret = 1;
-
-	if (end_builtin_redir(info, savefds) < 0)
-		return MISC_FAILURE_STATUS;
-	return ret;
+	/* does nothing, e.g for running : $((i += 1)) */
+	(void)(cmd);
+	(void)(info);
+	return 0;
 }
 
 static int
-builtin_type(const struct command *cmd, const struct cmdinfo *info)
+builtin_coproc(const struct command *cmd, const struct cmdinfo *info)
 {
+	/*
+	 * coproc [NAME command [argument ...]]
+	 *
+	 * start command with a pipe to its input and one from its output,
+	 * and leave it running next to the shell. NAME[0] is the fd to read
+	 * its output from, NAME[1] the one to write to its input and
+	 * NAME_PID its pid, e.g:
+	 *
+	 * coproc BC bc -l
+	 * echo 'scale=2; 1/3' >&${BC[1]}
+	 * read -u ${BC[0]} third
+	 *
+	 * asks the same bc for as many answers as needed instead of
+	 * starting one for each. it sees the end of its input once NAME[1]
+	 * is closed with exec N>&-. without arguments, list the ones that
+	 * were started and whether they're still running.
+	 */
 	const char *oldargv0 = argv0;
-	const char *pathenv;
-	size_t i, j;
-	int savefds[2];
-	int found, ret = 0;
+	struct command sub;
+	struct coproc *co = NULL, *newcoprocs;
+	struct function *fn;
+	const char *name;
+	char *newname = NULL;
+	char **items = NULL;
+	char *pidname = NULL;
+	char num[32];
+	struct sink list;
+	int in[2] = {-1, -1}, out[2] = {-1, -1};
+	int ret;
+	size_t savefds, i;
+	size_t var;
+	pid_t pid;
+
+	coprocreap();
+	if (cmd->argc == 1) {
+		if (start_builtin_redir(info, &savefds, &list) < 0)
+			return MISC_FAILURE_STATUS;
+		for (i = 0; i < ncoprocs; ++i) {
+			if (coprocs[i].status < 0)
+				sinkprintf(&list, "%s %ld running\n",
+						coprocs[i].name,
+						(long)coprocs[i].pid);
+			else
+				sinkprintf(&list, "%s %ld done %d\n",
+						coprocs[i].name,
+						(long)coprocs[i].pid,
+						coprocs[i].status);
+		}
+		ret = (sinkflush(&list) < 0);
+		if (end_builtin_redir(savefds) < 0)
+			return MISC_FAILURE_STATUS;
+		return ret;
+	}
 
-	if (start_builtin_redir(info, savefds) < 0)
-		return MISC_FAILURE_STATUS;
 	argv0 = cmd->argv[0];
-
-	pathenv = getenv("PATH");
-	if (!pathenv)
-		logerr("$PATH is not set");
-
-	for (i = 1; i < cmd->argc; ++i) {
-		found = 0;
-		if (!strcmp(cmd->argv[i], "--"))
+	name = cmd->argv[1];
+	if (cmd->argc < 3) {
+		logerr("usage: coproc [NAME command [argument ...]]");
+		goto fail;
+	}
+	if (isdigit((unsigned char)*name) || name[strspn(name,
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				"abcdefghijklmnopqrstuvwxyz0123456789_")]) {
+		logerr("invalid name '%s'", name);
+		goto fail;
+	}
+	for (i = 0; i < ncoprocs; ++i) {
+		if (strcmp(coprocs[i].name, name) != 0)
 			continue;
-		for (j = 0; builtins[j].name; ++j) {
-			if (!strcmp(cmd->argv[i], builtins[j].name)) {
-				printf("%s: a builtin\n", cmd->argv[i]);
-				found = 1;
-				break;
+		if (coprocs[i].status < 0) {
+			logerr("'%s' is still running", name);
+			goto fail;
+		}
+		co = &coprocs[i];
+		/* whatever of its pipes the shell still has */
+		for (i = 0; i < 2; ++i) {
+			if (co->fds[i] >= 0)
+				close(co->fds[i]);
+			co->fds[i] = -1;
+		}
+		break;
+	}
+	if (!co) {
+		/* it's only added once it has started */
+		if (!(newcoprocs = wereallocarray(coprocs, ncoprocs + 1,
+						sizeof(*newcoprocs))))
+			goto fail;
+		coprocs = newcoprocs;
+		if (!(newname = westrdup(name)))
+			goto fail;
+	}
+	if (!(items = wemallocarray(2, sizeof(char *)))
+			|| !(pidname = wemalloc(strlen(name) + 5)))
+		goto fail;
+	items[0] = items[1] = NULL;
+	sprintf(pidname, "%s_PID", name);
+
+	/* the shell's ends stay out of the way of the fds scripts use */
+	if (makepipe(in) < 0 || makepipe(out) < 0
+			|| redirmove(&in[1]) < 0 || redirmove(&out[0]) < 0)
+		goto fail;
+
+	sub.argv = cmd->argv + 2;
+	sub.argc = cmd->argc - 2;
+	sub.orig_argv = NULL;
+	sub.dynallocinfo = NULL;
+	fn = funcfind(sub.argv[0]);
+	fflush(stdout);
+	switch ((pid = shellfork())) {
+	case -1:
+		logerr("fork:");
+		goto fail;
+	case 0:
+		forked = 1;
+		tailpos = 0;
+		if (term >= 0) {
+			/* in the background, like a pipeline with & would be */
+			if (setpgid(0, 0) < 0)
+				logerr("setpgid:");
+			term = -1;
+		}
+		if (dup2(in[0], STDIN_FILENO) < 0
+				|| dup2(out[1], STDOUT_FILENO) < 0) {
+			logerr("dup2:");
+			_exit(MISC_FAILURE_STATUS);
+		}
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		/* a function would keep the others from seeing their EOF */
+		coprocclose(-1);
+		if (applyredirs(info) < 0)
+			_exit(MISC_FAILURE_STATUS);
+		if (info->noutfds)
+			fanout(info, -1);
+		if (info->vars) {
+			for (var = 0; info->vars[var]; ++var) {
+				if (setenv(info->vars[var], info->vals[var],
+							1) < 0) {
+					logerr("setenv:");
+					_exit(MISC_FAILURE_STATUS);
+				}
 			}
 		}
-		if (!found && !which(pathenv, cmd->argv[i])) {
-			logerr("no such command '%s'", cmd->argv[i]);
-			ret = 1;
+		if (fn) {
+			funcrun(fn, &sub);
+			fflush(stdout);
+			_exit(lastexit);
 		}
+		substinherit();
+		execvp(sub.argv[0], sub.argv);
+		logerr("execvp '%s':", sub.argv[0]);
+		_exit((errno == ENOENT) ? 127 :
+			((errno == ENOEXEC) ? 126 : MISC_FAILURE_STATUS));
 	}
 
+	/* the child might not have gotten there yet */
+	if (term >= 0)
+		setpgid(pid, pid);
+	close(in[0]);
+	close(out[1]);
+	in[0] = out[1] = -1;
+	if (!co) {
+		co = &coprocs[ncoprocs++];
+		co->name = newname;
+		newname = NULL;
+	}
+	co->pid = pid;
+	co->status = -1;
+	co->fds[0] = co->fds[1] = -1;
+	sprintf(num, "%d", out[0]);
+	if (!(items[0] = westrdup(num)))
+		goto fail;
+	sprintf(num, "%d", in[1]);
+	if (!(items[1] = westrdup(num)))
+		goto fail;
+	if (varsetarray(name, items, NULL, 2) < 0) {
+		/* varsetarray() frees them */
+		items = NULL;
+		goto fail;
+	}
+	items = NULL;
+	sprintf(num, "%ld", (long)pid);
+	if (varset(pidname, num) < 0)
+		goto fail;
+	co->fds[0] = out[0];
+	co->fds[1] = in[1];
+	free(pidname);
 	argv0 = oldargv0;
-	if (end_builtin_redir(info, savefds) < 0)
+	return 0;
+
+fail:
+	/* if it was started, its fds are no use without the variables */
+	free(newname);
+	if (items) {
+		free(items[0]);
+		free(items[1]);
+		free(items);
+	}
+	free(pidname);
+	for (i = 0; i < 2; ++i) {
+		if (in[i] >= 0)
+			close(in[i]);
+		if (out[i] >= 0)
+			close(out[i]);
+	}
+	argv0 = oldargv0;
+	return MISC_FAILURE_STATUS;
+}
+
+#if defined(ENABLE_LOADABLE)
+static int
+builtin_enable(const struct command *cmd, const struct cmdinfo *info)
+{
+	/*
+	 * enable [-f library name ...]
+	 *
+	 * add the builtins called name from a shared library, see sushi.h
+	 * for how to write one. they run in the shell like the others
+	 * instead of as a process of their own each time. a name that was
+	 * added before is replaced. without arguments, list the builtins
+	 * that were added.
+	 */
+	const char *oldargv0 = argv0;
+	struct loaded *lb, **newloaded;
+	struct sink out;
+	const int *abi;
+	sushi_builtin *fn;
+	void *lib, *sym;
+	char *sname = NULL, *path;
+	size_t savefds, arg = 1, i;
+	int ret = 0;
+
+	if (start_builtin_redir(info, &savefds, &out) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
+	/* other threads of the library see the builtins too */
+	proclock();
+
+	if (cmd->argc == 1) {
+		for (i = 0; i < nloaded; ++i)
+			sinkprintf(&out, "enable -f %s %s\n",
+					loadedbuiltins[i]->path,
+					loadedbuiltins[i]->name);
+		goto end;
+	}
+	if (!strcmp(cmd->argv[arg], "-f"))
+		++arg;
+	if (arg == 1 || cmd->argc < arg + 2) {
+		logerr("usage: enable [-f library name ...]");
+		ret = 1;
+		goto end;
+	}
+
+	/* it stays loaded, the builtins may be running right now */
+	if (!(lib = dlopen(cmd->argv[arg], RTLD_NOW | RTLD_LOCAL))) {
+		logerr("%s", dlerror());
+		ret = 1;
+		goto end;
+	}
+	if (!(abi = dlsym(lib, "sushi_abi")) || *abi != SUSHI_ABI_VERSION) {
+		logerr("'%s' isn't built for this shell's SUSHI_ABI_VERSION",
+				cmd->argv[arg]);
+		dlclose(lib);
+		ret = 1;
+		goto end;
+	}
+	for (i = arg + 1; i < cmd->argc; ++i) {
+		free(sname);
+		if (!(sname = wemalloc(sizeof("sushi_builtin_")
+				+ strlen(cmd->argv[i])))) {
+			ret = 1;
+			break;
+		}
+		sprintf(sname, "sushi_builtin_%s", cmd->argv[i]);
+		if (!(sym = dlsym(lib, sname))) {
+			logerr("no %s in '%s'", sname, cmd->argv[arg]);
+			ret = 1;
+			continue;
+		}
+		/* POSIX guarantees this works for what dlsym() returns */
+		memcpy(&fn, &sym, sizeof(fn));
+		if (!(path = westrdup(cmd->argv[arg]))) {
+			ret = 1;
+			break;
+		}
+
+		if ((lb = loadedfind(cmd->argv[i]))) {
+			free(lb->path);
+		} else {
+			/* they don't move, another thread may be running one */
+			if (!(newloaded = wereallocarray(loadedbuiltins,
+							nloaded + 1,
+							sizeof(*newloaded)))) {
+				free(path);
+				ret = 1;
+				break;
+			}
+			loadedbuiltins = newloaded;
+			if (!(lb = wemalloc(sizeof(*lb)))
+					|| !(lb->name = westrdup(
+							cmd->argv[i]))) {
+				free(lb);
+				free(path);
+				ret = 1;
+				break;
+			}
+			loadedbuiltins[nloaded++] = lb;
+		}
+		lb->fn = fn;
+		lb->path = path;
+	}
+
+end:
+	procunlock();
+	free(sname);
+	if (sinkflush(&out) < 0)
+		ret = 1;
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
 		return MISC_FAILURE_STATUS;
 	return ret;
 }
+#endif /* ENABLE_LOADABLE */
 
 static int
-end_builtin_redir(const struct cmdinfo *info, const int savefds[2])
+builtin_exec(const struct command *cmd, const struct cmdinfo *info)
 {
-	if (info->redirfds[0] >= 0 && info->redirfds[1] >= 0) {
-		if (dup2(savefds[0], info->redirfds[1]) < 0) {
-			logerr("dup2:");
-			return -1;
-		}
-		if (weclose(savefds[0]) < 0)
-			return -1;
+	/*
+	 * exec [command [argument ...]]
+	 *
+	 * with a command, replace the shell with it. without one, keep the
+	 * redirections for the rest of the shell's life, e.g 'exec 3>>log'
+	 * and then 'echo ... >&3' writes to the log without opening it
+	 * each time, and 'exec 3>&-' closes it.
+	 */
+	const char *oldargv0 = argv0;
+	struct command sub;
+	const struct redir *r;
+	size_t arg = 1, i;
+
+	if (cmd->argc > arg && !strcmp(cmd->argv[arg], "--"))
+		++arg;
+	argv0 = cmd->argv[0];
+	if (cmd->argc > arg) {
+		sub.argv = cmd->argv + arg;
+		sub.argc = cmd->argc - arg;
+		sub.orig_argv = NULL;
+		sub.dynallocinfo = NULL;
+		argv0 = oldargv0;
+#if !defined(SUSHI_LIBRARY)
+		/* a program using the library mustn't be replaced */
+		tailpos = 2;
+#endif /* !SUSHI_LIBRARY */
+		if (spawn(&sub, info, -1, -1) < 0)
+			shellexit(MISC_FAILURE_STATUS);
+		else
+			/* if it wasn't run in place of the shell */
+			shellexit(laststatus);
+		return laststatus;
 	}
-	if (info->redirfds[2] >= 0) {
-		if (dup2(savefds[1], info->redirfds[2]) < 0) {
+
+	if (info->noutfds)
+		logerr("only the first output redirection is used");
+	proclock();
+	for (i = 0; i < info->nredirs; ++i) {
+		r = &info->redirs[i];
+		if (r->target == STDOUT_FILENO)
+			fflush(stdout);
+		if (r->fd < 0) {
+			close(r->target);
+		} else if (dup2((r->fd == STDOUT_FILENO && !r->opened)
+					? stdoutfd() : r->fd, r->target) < 0) {
 			logerr("dup2:");
-			return -1;
+			procunlock();
+			argv0 = oldargv0;
+			return MISC_FAILURE_STATUS;
 		}
+		if (r->target == STDOUT_FILENO)
+			evalout = -1;
+		/* it's no longer a coprocess's pipe if it was one */
+		coprocclose(r->target);
 	}
+	procunlock();
+	argv0 = oldargv0;
 	return 0;
 }
 
 static int
-start_builtin_redir(const struct cmdinfo *info, int savefds[2])
+builtin_exit(const struct command *cmd, const struct cmdinfo *info)
 {
-	if (info->redirfds[0] >= 0 && info->redirfds[1] >= 0) {
-		savefds[0] = dup(info->redirfds[1]);
-		if (savefds[0] < 0) {
-			logerr("dup:");
-			return -1;
-		}
-		if (dup2(info->redirfds[0], info->redirfds[1]) < 0) {
-			logerr("dup2:");
-			return -1;
-		}
-	}
-	if (info->redirfds[2] >= 0) {
-		errno = 0;
-		savefds[1] = dup(info->redirfds[2]);
-		if (savefds[1] < 0 && errno != EBADF) {
-			logerr("dup:");
-			return -1;
-		} else if (savefds[1] >= 0) {
-			close(info->redirfds[2]);
+	const char *oldargv0 = argv0;
+	size_t savefds;
+	int ret = 0;
+	size_t arg = 1;
+
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
+
+	if (cmd->argc > 1 && !strcmp(cmd->argv[1], "--"))
+		++arg;
+
+	if (cmd->argc > arg) {
+		int status;
+		if (cmd->argc > arg + 1) {
+			logerr("too many operands specified");
+			ret = 1;
+		} else if (wexstrtoint(&status, cmd->argv[arg], 10) < 0
+				|| status > 255) {
+			ret = 1;
+		} else {
+			shellexit(status);
 		}
+	} else {
+		shellexit(0);
 	}
-	return 0;
+
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
 }
 
 static int
-try_exec_builtin(const struct command *cmd, const struct cmdinfo *info)
+builtin_export(const struct command *cmd, const struct cmdinfo *info)
 {
-	if (!cmd->argv[0]) {
-		return 127;
-	} else {
-		size_t i;
-		int ret;
-		for (i = 0; builtins[i].name; ++i) {
-			if (!strcmp(cmd->argv[0], builtins[i].name)) {
-				ret = builtins[i].fn(cmd, info);
-				laststatus = ret;
-				if (ret > 0)
-					lastfail = ret;
-				return ret;
+	const char *oldargv0 = argv0;
+	struct var *v;
+	char *eq;
+	size_t savefds;
+	int ret = 0;
+	size_t i;
+
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
+
+	for (i = 1; i < cmd->argc; ++i) {
+		if (!strcmp(cmd->argv[i], "--"))
+			continue;
+		if ((eq = strchr(cmd->argv[i], '='))) {
+			*eq = '\0';
+			varunset(cmd->argv[i]);
+			if (envset(cmd->argv[i], eq + 1) < 0) {
+				logerr("setenv '%s':", cmd->argv[i]);
+				ret = 1;
+			}
+			*eq = '=';
+		} else if ((v = varfind(cmd->argv[i]))) {
+			/* only the first element of an array is exported */
+			if (envset(v->name, varget(v->name)) < 0) {
+				logerr("setenv '%s':", cmd->argv[i]);
+				ret = 1;
+			} else {
+				varunset(cmd->argv[i]);
 			}
 		}
-		return 127;
 	}
+
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
 }
 
-/*
- * ===========================================================================
- * command execution functions
- */
 static int
-exec(char *s)
+builtin_mapfile(const struct command *cmd, const struct cmdinfo *info)
 {
-	char *pipechr = strchr(s, '|');
-	if (pipechr && pipechr != s && *(pipechr - 1) != '>') {
-		return pipeline(s);
-	} else {
-		struct command origcmd;
-		struct command expcmd;
-		struct command *cmd = &origcmd;
-		struct cmdinfo info;
-		int didglob = 0;
-		int ret = 0;
-		size_t var;
+	/*
+	 * mapfile [-t] [-d delim] [-n count] [-s skip] [-u fd] [array]
+	 *
+	 * read lines into an array, MAPFILE by default. the input is read
+	 * in as few system calls as possible, all at once if it's a file,
+	 * unless a count is given and the input can't be seeked back to
+	 * the end of the last line, then it's read line by line.
+	 */
+	const char *oldargv0 = argv0;
+	const char *name = "MAPFILE";
+	char *buf = NULL, *p, *end, *nl, **items = NULL, **newitems;
+	size_t size = 0, len = 0, nitems = 0, itemsize = 0, l;
+	size_t savefds;
+	int fd = STDIN_FILENO, delim = '\n', trim = 0;
+	int count = 0, skip = 0, ret = 0, r;
+	off_t start;
+	size_t arg;
+
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-		if (parsecmd(s, &origcmd, &info) < 0)
-			return -1;
+	for (arg = 1; arg < cmd->argc && cmd->argv[arg][0] == '-'; ++arg) {
+		if (!strcmp(cmd->argv[arg], "--")) {
+			++arg;
+			break;
+		} else if (!strcmp(cmd->argv[arg], "-t")) {
+			trim = 1;
+		} else if (!strchr("dnsu", cmd->argv[arg][1])
+				|| cmd->argv[arg][2]) {
+			logerr("unknown option '%s'", cmd->argv[arg]);
+			ret = 1;
+		} else if (arg + 1 >= cmd->argc) {
+			logerr("option '%s' needs an argument",
+					cmd->argv[arg]);
+			ret = 1;
+		} else if (cmd->argv[arg][1] == 'd') {
+			delim = cmd->argv[++arg][0];
+		} else if (wexstrtoint((cmd->argv[arg][1] == 'n') ? &count :
+					(cmd->argv[arg][1] == 's') ? &skip :
+					&fd, cmd->argv[arg + 1], 10) < 0) {
+			++arg;
+			ret = 1;
+		} else {
+			++arg;
+		}
+		if (ret)
+			goto end;
+	}
+	if (arg < cmd->argc)
+		name = cmd->argv[arg++];
+	if (arg < cmd->argc) {
+		logerr("too many operands specified");
+		ret = 1;
+		goto end;
+	}
 
-		if (parseenv(&origcmd, &info) < 0)
-			return -1;
+	start = lseek(fd, 0, SEEK_CUR);
+	if (count > 0 && start < 0) {
+		/* can't give back what's past the last line, go one by one */
+		for (r = 0; r < skip + count; ++r) {
+			l = len;
+			if ((ret = readfd(fd, delim, -1, &buf, &size, &len))
+					< 0)
+				break;
+			if (ret > 0 && strappend(&buf, &size, &len,
+						(char *)(&delim), 1) < 0) {
+				ret = -1;
+				break;
+			}
+			if (r < skip)
+				len = l;
+			if (!ret)
+				break;
+		}
+		ret = (ret < 0);
+	} else {
+		for (;;) {
+			if (len + READ_CHUNK_SIZE + 1 > size && strappend(&buf,
+						&size, &len, "", 0) < 0) {
+				ret = 1;
+				break;
+			}
+			if (len + READ_CHUNK_SIZE + 1 > size) {
+				/* make room for a lot more at once */
+				char *newbuf = werealloc(buf, size * 2
+						+ READ_CHUNK_SIZE);
+				if (!newbuf) {
+					ret = 1;
+					break;
+				}
+				buf = newbuf;
+				size = size * 2 + READ_CHUNK_SIZE;
+			}
+			do {
+				r = (int)(read(fd, buf + len, size - len - 1));
+			} while (r < 0 && errno == EINTR);
+			if (r < 0) {
+				logerr("read:");
+				ret = 1;
+				break;
+			}
+			if (r == 0)
+				break;
+			len += (size_t)(r);
+		}
+	}
+	if (ret)
+		goto end;
 
-		if (info.canexpandpath && (opts & OPT_GLOB)) {
-			if (expand_path(&origcmd, &expcmd) < 0) {
-				freecmd(&origcmd);
-				return -1;
+	for (p = buf, end = buf + len, r = 0; p < end
+			&& (count <= 0 || r < skip + count); p = nl, ++r) {
+		if ((nl = memchr(p, delim, (size_t)(end - p))))
+			++nl;
+		else
+			nl = end;
+		if (r < skip)
+			continue;
+		if (nitems >= itemsize) {
+			itemsize = itemsize ? itemsize * 2 : 64;
+			if (!(newitems = wereallocarray(items, itemsize,
+							sizeof(char *)))) {
+				ret = 1;
+				goto end;
 			}
-			cmd = &expcmd;
-			didglob = 1;
+			items = newitems;
 		}
-		if (parseredir(cmd, &info) < 0) {
-			if (didglob)
-				freecmd(&expcmd);
-			freecmd(&origcmd);
-			return -1;
+		l = (size_t)(nl - p);
+		if (trim && l && p[l - 1] == delim)
+			--l;
+		if (!(items[nitems] = westrndup(p, l))) {
+			ret = 1;
+			goto end;
 		}
+		++nitems;
+	}
+	if (count > 0 && start >= 0 && p < end
+			&& lseek(fd, start + (off_t)(p - buf), SEEK_SET) < 0) {
+		/* give back what's after the last line that was read */
+		logerr("lseek:");
+		ret = 1;
+		goto end;
+	}
+	if (!items && !(items = wemalloc(sizeof(char *)))) {
+		ret = 1;
+		goto end;
+	}
+	ret = (varsetarray(name, items, NULL, nitems) < 0);
+	items = NULL;
+	nitems = 0;
+
+end:
+	while (nitems--)
+		free(items[nitems]);
+	free(items);
+	free(buf);
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
+}
 
-		if ((opts & OPT_EXEC) && try_exec_builtin(cmd, &info) == 127) {
-			pid_t chpid = fork();
-			switch (chpid) {
-			case -1:
-				logerr("fork:");
-				ret = -1;
-				break;
-			case 0:
-				/*
-				 * if the shell is interactive, go into
-				 * a new process group and put it into
-				 * the foreground
-				 */
-				if (term >= 0) {
-					if (setpgid(0, 0) < 0) {
-						logerr("setpgid:");
-						_exit(MISC_FAILURE_STATUS);
-					}
-					if (tcsetpgrp(term, getpgrp()) < 0) {
-						logerr("tcsetpgrp:");
-						_exit(MISC_FAILURE_STATUS);
-					}
-				}
+static int
+builtin_read(const struct command *cmd, const struct cmdinfo *info)
+{
+	/*
+	 * read [-r] [-d delim] [-t timeout] [-u fd] [name ...]
+	 *
+	 * read a line and split it into the variables, REPLY if none are
+	 * given. the exit status is 1 at the end of the input, and the
+	 * same as for SIGALRM if the timeout ran out.
+	 */
+	const char *oldargv0 = argv0;
+	const char *ifs;
+	static char replyname[] = "REPLY";
+	char *reply = replyname;
+	char *buf = NULL;
+	size_t size = 0, len = 0, arg, i;
+	long timeout = -1;
+	size_t savefds;
+	int fd = STDIN_FILENO, delim = '\n', raw = 0, ret = 0;
+
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-				/* set env variables */
-				if (info.vars) {
-					for (var = 0; info.vars[var]; ++var) {
-						if (setenv(info.vars[var],
-							info.vals[var],
-							1) < 0) {
-							logerr("setenv:");
-							_exit(MISC_FAILURE_STATUS);
-						}
-					}
-				}
+	for (arg = 1; arg < cmd->argc && cmd->argv[arg][0] == '-'; ++arg) {
+		if (!strcmp(cmd->argv[arg], "--")) {
+			++arg;
+			break;
+		} else if (!strcmp(cmd->argv[arg], "-r")) {
+			raw = 1;
+		} else if (!strchr("dtu", cmd->argv[arg][1])
+				|| cmd->argv[arg][2]) {
+			logerr("unknown option '%s'", cmd->argv[arg]);
+			ret = 1;
+		} else if (arg + 1 >= cmd->argc) {
+			logerr("option '%s' needs an argument",
+					cmd->argv[arg]);
+			ret = 1;
+		} else if (cmd->argv[arg][1] == 'd') {
+			delim = cmd->argv[++arg][0];
+		} else if (cmd->argv[arg][1] == 't') {
+			ret = (readtimeout(cmd->argv[++arg], &timeout) < 0);
+		} else {
+			ret = (wexstrtoint(&fd, cmd->argv[++arg], 10) < 0);
+		}
+		if (ret)
+			goto end;
+	}
 
-				/* redirection */
-				if (info.redirfds[2] >= 0)
-					close(info.redirfds[2]);
+	for (;;) {
+		ret = readfd(fd, delim, timeout, &buf, &size, &len);
+		/* a backslash at the end continues the line */
+		for (i = 0; !raw && ret > 0 && i < len
+				&& buf[len - i - 1] == '\\'; ++i)
+			;
+		if (i % 2 == 0)
+			break;
+		buf[--len] = '\0';
+	}
+	if (ret < 0 && !buf) {
+		ret = (ret == -2) ? SIGNAL_EXITSTATUS + SIGALRM : 1;
+		goto end;
+	}
 
-				if (info.redirfds[0] >= 0
-						&& info.redirfds[1] >= 0) {
-					if (dup2(info.redirfds[0],
-						info.redirfds[1]) < 0) {
-						logerr("dup2:");
-						_exit(MISC_FAILURE_STATUS);
-					}
-				}
+	if (arg < cmd->argc) {
+		if (!(ifs = varget("IFS")))
+			ifs = " \t\n";
+		if (readassign(buf, raw, cmd->argv + arg, cmd->argc - arg,
+					ifs) < 0)
+			ret = -1;
+	} else if (readassign(buf, raw, &reply, 1, "") < 0) {
+		ret = -1;
+	}
+	/* partial lines are still assigned */
+	if (ret == -2)
+		ret = SIGNAL_EXITSTATUS + SIGALRM;
+	else
+		ret = (ret <= 0);
 
-				/* execute the command */
-				if (execvp(cmd->argv[0], cmd->argv) < 0) {
-					logerr("execvp '%s':", cmd->argv[0]);
-					_exit((errno == ENOENT) ? 127 :
-						((errno == ENOEXEC) ? 126 :
-						 MISC_FAILURE_STATUS));
-				}
-				/* unreachable */
-				break;
-			default:
-				report(chpid);
+end:
+	free(buf);
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
+}
 
-				/* put ourselves back into the foreground */
-				if (term >= 0)
-					if (tcsetpgrp(term, shell_pgid) < 0)
-						logerr("tcsetpgrp:");
+static int
+builtin_return(const struct command *cmd, const struct cmdinfo *info)
+{
+	const char *oldargv0 = argv0;
+	size_t savefds;
+	int ret = lastexit;
+	size_t arg = 1;
 
-				update_laststatus(laststatus);
-			}
-		}
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-		if (info.redirfds[0] > STDERR_FILENO)
-			if (weclose(info.redirfds[0]) < 0)
-				ret = -1;
-		if (info.vars) {
-			free(info.vars);
-			free(info.vals);
-		}
-		if (didglob)
-			freecmd(&expcmd);
-		freecmd(&origcmd);
-		return ret;
+	if (cmd->argc > 1 && !strcmp(cmd->argv[1], "--"))
+		++arg;
+
+	if (!funcdepth && !sourcedepth) {
+		logerr("can only be used in a function or a sourced file");
+		ret = 1;
+	} else if (cmd->argc > arg + 1) {
+		logerr("too many operands specified");
+		ret = 1;
+	} else if (cmd->argc > arg && (wexstrtoint(&ret, cmd->argv[arg], 10)
+				< 0 || ret < 0 || ret > 255)) {
+		ret = 1;
+	} else {
+		returning = 1;
 	}
+
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
 }
 
-static pid_t
-pipechain(char *s, pid_t *pgid, int *rpipe, int *wpipe, int *closethis)
+static int
+builtin_set(const struct command *cmd, const struct cmdinfo *info)
 {
-	struct command origcmd;
-	struct command expcmd;
-	struct command *cmd = &origcmd;
-	struct cmdinfo info;
-	int didglob = 0;
-	int failed = 0;
-	size_t var;
+	struct sink out;
+	size_t savefds;
+	int ret = 0;
 
-	pid_t chpid = 0;
-	*closethis = -1;
+	if (start_builtin_redir(info, &savefds, &out) < 0)
+		return MISC_FAILURE_STATUS;
 
-	if (parsecmd(s, &origcmd, &info) < 0)
-		return -1;
+	if (cmd->argc > 1 && strcmp(cmd->argv[1], "--") != 0)
+		if (optparse(1, (int)(cmd->argc), cmd->argv, NULL, NULL,
+					&out) < 0)
+			ret = 1;
 
-	if (parseenv(&origcmd, &info) < 0)
-		return -1;
+	if (sinkflush(&out) < 0)
+		ret = 1;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
+}
 
-	if (info.canexpandpath && (opts & OPT_GLOB)) {
-		if (expand_path(&origcmd, &expcmd) < 0) {
-			freecmd(&origcmd);
-			return -1;
-		}
-		cmd = &expcmd;
-		didglob = 1;
-	}
-	if (parseredir(cmd, &info) < 0) {
-		if (didglob)
-			freecmd(&expcmd);
-		freecmd(&origcmd);
-		return -1;
-	}
-
-	if ((opts & OPT_EXEC) && try_exec_builtin(cmd, &info) == 127) {
-		chpid = fork();
-		switch (chpid) {
-		case -1:
-			logerr("fork:");
-			failed = 1;
-			break;
-		case 0:
-			if (term >= 0) {
-				if (*pgid < 0 || (kill(*pgid, 0 < 0)
-							&& errno == ESRCH)) {
-					/* set new PGID for the pipeline */
-					if (setpgid(0, 0) < 0) {
-						logerr("setpgid:");
-						_exit(MISC_FAILURE_STATUS);
-					}
-					if (tcsetpgrp(term, getpgrp()) < 0) {
-						logerr("tcsetpgrp:");
-						_exit(MISC_FAILURE_STATUS);
-					}
-				} else if (setpgid(0, *pgid) < 0) {
-					/*
-					 * PGID of the pipeline set already,
-					 * join that group
-					 */
-					logerr("setpgid:");
-					_exit(MISC_FAILURE_STATUS);
-				}
-			}
-
-			/* pipe redirection */
-			if (rpipe) {
-				/* there's a pipe from the previous process */
-				if (dup2(rpipe[0], STDIN_FILENO) < 0) {
-					logerr("dup2:");
-					_exit(MISC_FAILURE_STATUS);
-				}
-				if (weclose(rpipe[0]) < 0
-						|| weclose(rpipe[1]) < 0)
-					_exit(MISC_FAILURE_STATUS);
-			}
-			if (wpipe) {
-				/* there's a pipe to the next process */
-				if (dup2(wpipe[1], STDOUT_FILENO) < 0) {
-					logerr("dup2:");
-					_exit(MISC_FAILURE_STATUS);
-				}
-				if (weclose(wpipe[0]) < 0
-						|| weclose(wpipe[1]))
-					_exit(MISC_FAILURE_STATUS);
-			}
+static int
+builtin_shift(const struct command *cmd, const struct cmdinfo *info)
+{
+	const char *oldargv0 = argv0;
+	size_t savefds;
+	int ret = 0, n = 1;
+	size_t arg = 1;
 
-			/* set env variables */
-			if (info.vars) {
-				for (var = 0; info.vars[var]; ++var) {
-					if (setenv(info.vars[var],
-						info.vals[var],
-						1) < 0) {
-						logerr("setenv:");
-						_exit(MISC_FAILURE_STATUS);
-					}
-				}
-			}
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-			/* redirection */
-			if (info.redirfds[2] >= 0)
-				close(info.redirfds[2]);
-			if (info.redirfds[0] >= 0
-					&& info.redirfds[1] >= 0) {
-				if (dup2(info.redirfds[0],
-						info.redirfds[1]) < 0) {
-					logerr("dup2:");
-					_exit(MISC_FAILURE_STATUS);
-				}
-			}
+	if (cmd->argc > 1 && !strcmp(cmd->argv[1], "--"))
+		++arg;
 
-			/* execute the command */
-			if (execvp(cmd->argv[0], cmd->argv) < 0) {
-				logerr("execvp '%s':", cmd->argv[0]);
-				_exit((errno == ENOENT) ? 127 :
-					((errno == ENOEXEC) ? 126 :
-					 MISC_FAILURE_STATUS));
-			}
-			/* unreachable */
-			break;
-		}
+	if (cmd->argc > arg + 1) {
+		logerr("too many operands specified");
+		ret = 1;
+	} else if (cmd->argc > arg && wexstrtoint(&n, cmd->argv[arg], 10)
+			< 0) {
+		ret = 1;
+	} else if (n < 0 || (size_t)(n) > curframe->argc) {
+		logerr("can't shift by %d", n);
+		ret = 1;
+	} else {
+		curframe->argv += n;
+		curframe->argc -= (size_t)(n);
 	}
 
-	if (rpipe && (weclose(rpipe[0]) < 0 || weclose(rpipe[1]) < 0))
-		failed = 1;
-	if (info.redirfds[0] > STDERR_FILENO)
-		*closethis = info.redirfds[0];
-	if (info.vars) {
-		free(info.vars);
-		free(info.vals);
-	}
-	if (didglob)
-		freecmd(&expcmd);
-	freecmd(&origcmd);
-	if ((*pgid = tcgetpgrp(term)) < 0) {
-		logerr("tcgetpgrp:");
-		return -1;
-	}
-	if (failed)
-		return -1;
-	return chpid;
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
 }
 
 static int
-pipeline(char *s)
+builtin_snapshot(const struct command *cmd, const struct cmdinfo *info)
 {
 	/*
-	 * handles pipelines, for instance:
-	 * ps aux | grep proc | grep -v grep | awk '{print $NF}'
+	 * snapshot [-l] [file]
 	 *
-	 * the chain has two processes active at a time, and
-	 * waits for the process in the previous slot from the
-	 * current one to end before moving on. this is to avoid
-	 * deadlocks when the pipe is full since the 2nd process will
-	 * always be there to recieve the first one's input.
-	 */
-	char **cmds = wemallocarray(sizeof(char *), ARGV_ALLOC_SIZE);
-	char *ptr;
-	char *oldptr = s;
-	size_t arrsize = ARGV_ALLOC_SIZE;
-	size_t i = 0, j = 0;
-
-	/*
-	 * two pipes & two pids:
-	 * one from the previous in the chain, one to the next in the chain
+	 * save the shell's functions, variables, options and prompt, and
+	 * the environment variables that changed since it started, to file
+	 * or the snapshot in the cache directory an interactive shell
+	 * loads instead of reading ~/.sushirc, see snapload(). so ending
+	 * ~/.sushirc with 'snapshot' makes the next shells start without
+	 * parsing or running it, until it or a file it sources changes.
+	 * with -l, load file instead, the status is 1 if it's out of date.
 	 */
-	int lpipe[2], rpipe[2];
-	pid_t lpid, rpid;
-	int ldup = -1, rdup = -1;
+	const char *oldargv0 = argv0;
+	char *path = NULL;
+	size_t savefds, arg = 1;
+	int load = 0, ret = 1;
 
-	/* PGID of the pipeline */
-	pid_t pgid = -1;
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-	if (!cmds)
-		return -1;
-	ptr = delimit(s, '|');
-	while (ptr) {
-		if (i >= arrsize) {
-			char **oldcmds = cmds;
-			arrsize += ARGV_ALLOC_SIZE;
-			if (!(cmds = wereallocarray(cmds, sizeof(char *),
-							arrsize))) {
-				free(oldcmds);
-				return -1;
-			}
-		}
-		cmds[i++] = oldptr;
-		oldptr = ptr;
-		ptr = delimit(ptr, '|');
+	if (arg < cmd->argc && !strcmp(cmd->argv[arg], "-l")) {
+		load = 1;
+		++arg;
 	}
-	if (i + 1 >= arrsize) {
-		char **oldcmds = cmds;
-		arrsize += 2;
-		if (!(cmds = wereallocarray(cmds, sizeof(char *), arrsize))) {
-			free(oldcmds);
-			return -1;
-		}
+	if (arg < cmd->argc && !strcmp(cmd->argv[arg], "--"))
+		++arg;
+	if (arg + 1 < cmd->argc) {
+		logerr("usage: snapshot [-l] [file]");
+		goto end;
 	}
-	cmds[i++] = oldptr;
-	cmds[i] = NULL;
+	if (arg < cmd->argc)
+		path = westrdup(cmd->argv[arg]);
+	else
+		path = snappath();
+	if (!path)
+		goto end;
+	if (load)
+		ret = (snapload(path) == 1) ? 0 : 1;
+	else
+		ret = (snapsave(path) < 0);
 
-	/* create the first output pipe */
-	pipe(rpipe);
+end:
+	free(path);
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
+}
 
-	/* first child takes input from wherever the shell gets it */
-	if ((lpid = pipechain(cmds[j++], &pgid, NULL, rpipe, &ldup)) < 0)
-		return -1;
-	/* output pipe becomes input for the next process */
-	lpipe[0] = rpipe[0];
-	lpipe[1] = rpipe[1];
+static int
+builtin_source(const struct command *cmd, const struct cmdinfo *info)
+{
+	const char *oldargv0 = argv0;
+	size_t savefds;
+	int ret = 0;
+	size_t arg = 1;
 
-	/* chain all but the first and last children */
-	while (j < i - 2) {
-		pipe(rpipe); /* make the next output pipe */
-		if ((rpid = pipechain(cmds[j++], &pgid, lpipe, rpipe,
-						&rdup)) < 0)
-			return -1;
-		report(lpid); /* wait for previous process in chain */
-		if (ldup > 0)
-			weclose(ldup);
-		lpid = rpid; /* make this process the "previous in chain" */
-		ldup = rdup;
+	if (start_builtin_redir(info, &savefds, NULL) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-		lpipe[0] = rpipe[0]; /* output pipe becomes input pipe */
-		lpipe[1] = rpipe[1];
+	if (cmd->argc > 1 && !strcmp(cmd->argv[1], "--"))
+		++arg;
+
+	if (cmd->argc <= arg) {
+		logerr("no file specified");
+		ret = 1;
+	} else {
+		/*
+		 * any other operands become the positional parameters
+		 * while the file runs
+		 */
+		struct frame fr;
+		fr.argv = cmd->argv + arg + 1;
+		fr.argc = cmd->argc - arg - 1;
+		fr.prev = curframe;
+		if (fr.argc)
+			curframe = &fr;
+
+		/* the sourced commands report errors as the shell */
+		argv0 = oldargv0;
+		if ((ret = sourcefile(cmd->argv[arg], 1)) < 0)
+			ret = 1;
+		curframe = fr.prev;
 	}
 
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
+}
+
+static int
+builtin_timeout(const struct command *cmd, const struct cmdinfo *info)
+{
 	/*
-	 * fork the last one, its output goes to wherever the shells stdout
-	 * is
+	 * timeout [-k duration] duration command [argument ...]
+	 *
+	 * run an external command like any other, but send SIGTERM to its
+	 * process group if it's still running after duration, and SIGKILL
+	 * if it still is after the -k duration. the shell does the waiting
+	 * itself, so there's no process in between.
 	 */
-	if ((rpid = pipechain(cmds[j++], &pgid, lpipe, NULL, &rdup)) < 0)
-		return -1;
-	report(lpid); /* wait for previous process in chain */
-	report(rpid); /* wait for current (last) process in chain */
+	const char *oldargv0 = argv0;
+	struct command sub;
+	long timeout, killafter = TIMEOUT_KILL_DELAY;
+	size_t arg = 1, i;
+	int tail = tailpos;
+	int ret;
 
-	/* put ourselves back into the foreground */
-	if (term >= 0) {
-		if (tcsetpgrp(term, shell_pgid) < 0) {
-			logerr("tcsetpgrp:");
-			return -1;
+	argv0 = cmd->argv[0];
+	if (cmd->argc > arg + 1 && !strcmp(cmd->argv[arg], "-k")) {
+		if (readtimeout(cmd->argv[arg + 1], &killafter) < 0) {
+			argv0 = oldargv0;
+			return MISC_FAILURE_STATUS;
 		}
+		arg += 2;
 	}
-
-	if (opts & OPT_PIPEFAIL) {
-		update_laststatus(lastfail);
-		lastfail = 0;
-	} else {
-		update_laststatus(laststatus);
+	if (cmd->argc > arg && !strcmp(cmd->argv[arg], "--"))
+		++arg;
+	if (cmd->argc < arg + 2) {
+		logerr("usage: timeout [-k duration] duration command "
+				"[argument ...]");
+		argv0 = oldargv0;
+		return MISC_FAILURE_STATUS;
+	}
+	if (readtimeout(cmd->argv[arg], &timeout) < 0) {
+		argv0 = oldargv0;
+		return MISC_FAILURE_STATUS;
 	}
+	++arg;
+
+	sub.argv = cmd->argv + arg;
+	sub.argc = cmd->argc - arg;
+	sub.orig_argv = NULL;
+	sub.dynallocinfo = NULL;
+	if (funcfind(sub.argv[0])) {
+		logerr("'%s' is a function", sub.argv[0]);
+		argv0 = oldargv0;
+		return MISC_FAILURE_STATUS;
+	}
+	for (i = 0; builtins[i].name; ++i) {
+		if (!strcmp(sub.argv[0], builtins[i].name)) {
+			logerr("'%s' is a builtin", sub.argv[0]);
+			argv0 = oldargv0;
+			return MISC_FAILURE_STATUS;
+		}
+	}
+	argv0 = oldargv0;
 
-	if (ldup > 0)
-		weclose(ldup);
-	if (rdup > 0)
-		weclose(rdup);
-	return 0;
+	/* the shell has to stay around to stop it */
+	tailpos = 0;
+	ret = (spawn(&sub, info, timeout, killafter) < 0)
+		? MISC_FAILURE_STATUS : laststatus;
+	tailpos = tail;
+	return ret;
 }
 
-static void
-takecmd(char *s)
+static int
+builtin_tracedump(const struct command *cmd, const struct cmdinfo *info)
 {
-	if (opts & OPT_VERBOSE) {
-		fputs(s, stderr);
-		/* print a trailing newline if we didn't print one already */
-		if (s[0] && s[strlen(s) - 1] != '\n')
-			putc('\n', stderr);
-	}
+	/*
+	 * tracedump [-c]
+	 *
+	 * print what set -x wrote to the trace buffer and empty it, or with
+	 * -c only empty it
+	 */
+	const char *oldargv0 = argv0;
+	struct sink out;
+	size_t savefds;
+	int ret = 0, clear = 0;
+	size_t arg = 1;
 
-	/* ignore empty commands (e.g user just pressing enter) */
-	if (s[0] && s[0] != '\n') {
-		char *ptr = delimit(s, ';');
+	if (start_builtin_redir(info, &savefds, &out) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-		if (!ptr) {
-			if (exec(s) < 0) {
-				laststatus = lastfail = MISC_FAILURE_STATUS;
-				update_laststatus(laststatus);
-			}
-		} else {
-			char *oldptr = s;
-			while (ptr) {
-				if (exec(oldptr) < 0) {
-					laststatus = lastfail =
-						MISC_FAILURE_STATUS;
-					update_laststatus(laststatus);
-				}
-				oldptr = ptr;
-				ptr = delimit(ptr, ';');
-			}
-			if (exec(oldptr) < 0) {
-				laststatus = lastfail = MISC_FAILURE_STATUS;
-				update_laststatus(laststatus);
-			}
-		}
+	if (cmd->argc > arg && !strcmp(cmd->argv[arg], "-c")) {
+		clear = 1;
+		++arg;
 	}
-}
+	if (cmd->argc > arg && !strcmp(cmd->argv[arg], "--"))
+		++arg;
 
-static void
-update_laststatus(int status)
-{
-	if (prompt != defaultprompt)
-		free(prompt);
-	if (status > 0) {
-		if (wexasprintf(&prompt, "%d %s", status, defaultprompt) < 0) {
-			prompt = defaultprompt;
-		}
+	if (cmd->argc > arg) {
+		logerr("too many operands specified");
+		ret = 1;
+	} else if (!tracering) {
+		logerr("no trace buffer, use set -o xtracebuf=SIZE");
+		ret = 1;
+	} else if (clear) {
+		tracepos = 0;
+		tracewrapped = 0;
 	} else {
-		prompt = defaultprompt;
+		xtracedump(&out);
+		if (sinkflush(&out) < 0)
+			ret = 1;
 	}
+
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
 }
 
-/*
- * ===========================================================================
- * command parsing functions
- */
 static int
-parsecmd(char *s, struct command *cmd, struct cmdinfo *info)
+builtin_type(const struct command *cmd, const struct cmdinfo *info)
 {
-	int canexpandpath = !!(strpbrk(s, "?*["));
-	s[strcspn(s, "\n")] = '\0';
-	if (!strchr(s, ' ')) {
-		/*
-		 * the string has no separators, put everything into
-		 * argv[0]
-		 */
-		if (alloccmd(2, cmd) < 0)
-			return -1;
-		cmd->argv[0] = s;
-		cmd->dynallocinfo[0] = 0;
-		cmd->argv[1] = NULL;
-		cmd->dynallocinfo[1] = -1;
-		cmd->argc = 1;
-		info->canexpandpath = canexpandpath;
-		return 0;
-	} else {
-		char *ptr = s;
-		char *end = s + strlen(s);
-		char *prev_start = s;
+	const char *oldargv0 = argv0;
+	const char *pathenv;
+	size_t i, j;
+	struct sink out;
+	size_t savefds;
+	int found, ret = 0;
 
-		/*
-		 * this variable is set to the character representing
-		 * the delimiter between tokens, e.g
-		 *
-		 * with delim = ' ', "one 'two three'" will be split as
-		 * {"one", "'two", "three'"}
-		 * with delim = '\'', that same string will be split as
-		 * {"one", "two three"}
-		 */
-		char delim = ' ';
-		int searching = 0;
+	if (start_builtin_redir(info, &savefds, &out) < 0)
+		return MISC_FAILURE_STATUS;
+	argv0 = cmd->argv[0];
 
-		size_t currsize = ARGV_ALLOC_SIZE;
-		size_t i = 0;
+	pathenv = envget("PATH");
+	if (!pathenv)
+		logerr("$PATH is not set");
 
-		char *tilde_exp;
-		int tilde_dynalloc;
+	for (i = 1; i < cmd->argc; ++i) {
+		found = 0;
+		if (!strcmp(cmd->argv[i], "--"))
+			continue;
+		if (funcfind(cmd->argv[i])) {
+			sinkprintf(&out, "%s: a function\n", cmd->argv[i]);
+			continue;
+		}
+		for (j = 0; builtins[j].name; ++j) {
+			if (!strcmp(cmd->argv[i], builtins[j].name)) {
+				sinkprintf(&out, "%s: a builtin\n",
+						cmd->argv[i]);
+				found = 1;
+				break;
+			}
+		}
+#if defined(ENABLE_LOADABLE)
+		if (!found && loadedfind(cmd->argv[i])) {
+			sinkprintf(&out, "%s: a builtin from %s\n",
+					cmd->argv[i],
+					loadedfind(cmd->argv[i])->path);
+			found = 1;
+		}
+#endif /* ENABLE_LOADABLE */
+		if (!found && !which(pathenv, cmd->argv[i], &out)) {
+			/* keep the order when both go to the same place */
+			sinkflush(&out);
+			logerr("no such command '%s'", cmd->argv[i]);
+			ret = 1;
+		}
+	}
 
-		if (alloccmd(ARGV_ALLOC_SIZE, cmd) < 0)
-			return -1;
+	if (sinkflush(&out) < 0)
+		ret = 1;
+	argv0 = oldargv0;
+	if (end_builtin_redir(savefds) < 0)
+		return MISC_FAILURE_STATUS;
+	return ret;
+}
 
-		/*
-		 * loop until we can't find any more separators or are
-		 * at the end of the string
-		 */
-		while (ptr && ptr < end) {
-			if (*ptr == '\\') {
-				/*
-				 * remove the \ character and pretend that
-				 * the next char doesn't exist by going
-				 * over it
-				 */
-				popchar(ptr++);
-			} else if (*ptr == delim) {
-				if (delim != ' ') {
-					/* stop searching for closing quote */
-					searching = 0;
-					delim = ' ';
-				}
-				*ptr = '\0';
-				if (i >= currsize) {
-					currsize += ARGV_ALLOC_SIZE;
-					if (realloccmd(currsize, cmd) < 0)
-						return -1;
-				}
-				tilde_exp = expand_tilde(prev_start,
-						&tilde_dynalloc);
-				if (tilde_exp) {
-					cmd->argv[i] = tilde_exp;
-					cmd->dynallocinfo[i] = tilde_dynalloc;
-				} else {
-					cmd->argv[i] = prev_start;
-					cmd->dynallocinfo[i] = 0;
-				}
-				++i;
-				prev_start = ++ptr;
-			} else if (delim == ' '
-					&& (*ptr == '\'' || *ptr == '"')) {
-				delim = *ptr;
-				popchar(ptr);
-				searching = 1;
-			} else {
-				++ptr;
-			}
+static int
+end_builtin_redir(size_t saved)
+{
+	/* put back what start_builtin_redir() saved from saved on */
+	struct redirsave *rs;
+	int ret = 0;
+
+	while (nredirsaves > saved) {
+		rs = &redirsaves[--nredirsaves];
+		evalout = rs->out;
+		if (rs->saved < 0) {
+			close(rs->target);
+			continue;
 		}
-		if (searching) {
-			fputs("syntax error: unclosed quotation\n", stderr);
-			freecmd(cmd);
-			return -1;
-		} else {
-			if (*prev_start) {
-				/*
-				 * i can only be equal to currsize and we only need
-				 * one more slot
-				 */
-				if (i >= currsize)
-					if (realloccmd(++currsize, cmd) < 0)
-						return -1;
-				tilde_exp = expand_tilde(prev_start,
-						&tilde_dynalloc);
-				if (tilde_exp) {
-					cmd->argv[i] = tilde_exp;
-					cmd->dynallocinfo[i] = tilde_dynalloc;
-				} else {
-					cmd->argv[i] = prev_start;
-					cmd->dynallocinfo[i] = 0;
-				}
-				++i;
+		if (dup2(rs->saved, rs->target) < 0) {
+			logerr("dup2:");
+			ret = -1;
+		}
+		close(rs->saved);
+	}
+	if (redirlocked && !nredirsaves) {
+		redirlocked = 0;
+		procunlock();
+	}
+	return ret;
+}
+
+static int
+isbuiltin(const char *name)
+{
+	/* is name a builtin, including the loaded ones */
+	size_t i;
+
+	for (i = 0; builtins[i].name; ++i)
+		if (!strcmp(name, builtins[i].name))
+			return 1;
+#if defined(ENABLE_LOADABLE)
+	if (loadedfind(name))
+		return 1;
+#endif /* ENABLE_LOADABLE */
+	return 0;
+}
+
+static int
+start_builtin_redir(const struct cmdinfo *info, size_t *saved,
+		struct sink *out)
+{
+	/*
+	 * apply the redirections of a command that runs in the shell. what
+	 * they replace is pushed onto redirsaves, *saved is set to where
+	 * this command's part starts, and commands run by a function or a
+	 * group push theirs on top of it.
+	 *
+	 * a builtin that only prints can pass a sink for its output
+	 * instead, which writes straight to where stdout is redirected, so
+	 * stdout doesn't have to be saved and put back.
+	 *
+	 * the descriptors belong to the whole process, so proclock() is
+	 * held from the first one that's replaced until they're all put
+	 * back.
+	 */
+	struct redirsave *newsaves;
+	const struct redir *r;
+	size_t i;
+	int skip = -1, fd;
+
+	*saved = nredirsaves;
+	if (info->noutfds)
+		logerr("only the first output redirection is used");
+	if (out) {
+		fd = redirresolve(info, info->nredirs, STDOUT_FILENO);
+		if (fd == STDOUT_FILENO)
+			fd = stdoutfd();
+		skip = STDOUT_FILENO;
+		/* not if another one moves or closes it, as in >&3 3>&- */
+		for (i = 0; i < info->nredirs; ++i) {
+			if (info->redirs[i].target != STDOUT_FILENO
+					&& info->redirs[i].target == fd) {
+				fd = STDOUT_FILENO;
+				skip = -1;
 			}
-			if (i >= currsize) {
-				/* same as earlier */
-				if (realloccmd(++currsize, cmd) < 0)
-					return -1;
+		}
+		sinkopen(out, fd);
+	}
+	for (i = 0; i < info->nredirs; ++i) {
+		r = &info->redirs[i];
+		if (r->target == skip)
+			continue;
+		if (nredirsaves >= redirsavesize) {
+			if (!(newsaves = wereallocarray(redirsaves,
+						redirsavesize + 16,
+						sizeof(*newsaves)))) {
+				end_builtin_redir(*saved);
+				return -1;
 			}
-			cmd->argv[i] = NULL;
-			cmd->dynallocinfo[i] = -1;
-			cmd->argc = i;
-			info->canexpandpath = canexpandpath;
-			return 0;
+			redirsaves = newsaves;
+			redirsavesize += 16;
+		}
+		if (!redirlocked) {
+			proclock();
+			redirlocked = 1;
 		}
+		redirsaves[nredirsaves].target = r->target;
+		redirsaves[nredirsaves].out = evalout;
+		errno = 0;
+		if ((redirsaves[nredirsaves].saved = fcntl(r->target,
+						F_DUPFD_CLOEXEC,
+						SHELL_FD_BASE)) < 0
+				&& errno != EBADF) {
+			logerr("fcntl:");
+			end_builtin_redir(*saved);
+			return -1;
+		}
+		++nredirsaves;
+		fd = (skip < 0) ? r->fd : redirresolve(info, i, r->fd);
+		if (fd == STDOUT_FILENO && !r->opened)
+			fd = stdoutfd();
+		/* what was buffered before goes where stdout was */
+		if (r->target == STDOUT_FILENO)
+			fflush(stdout);
+		if (fd < 0) {
+			close(r->target);
+		} else if (dup2(fd, r->target) < 0) {
+			logerr("dup2:");
+			end_builtin_redir(*saved);
+			return -1;
+		}
+		/* the process's stdout is the command's now */
+		if (r->target == STDOUT_FILENO)
+			evalout = -1;
 	}
+	return 0;
 }
 
 static int
-parseenv(struct command *cmd, struct cmdinfo *info)
+try_exec_builtin(const struct command *cmd, const struct cmdinfo *info)
 {
-	size_t arrsize = 0;
-	size_t var = 0;
-	char *ptr;
+	/*
+	 * run cmd in the shell if it's a function or a builtin and return
+	 * its exit status, or return -1 if it's neither.
+	 */
+	struct function *fn;
+#if defined(ENABLE_LOADABLE)
+	struct loaded *lb = NULL;
+#endif /* ENABLE_LOADABLE */
+	char **saved = NULL;
+	size_t savefds, nsaved = 0;
+	size_t i = 0;
+	int ret;
+
+	if (!cmd->argv[0])
+		return -1;
+	if (!(fn = funcfind(cmd->argv[0]))) {
+		for (i = 0; builtins[i].name; ++i)
+			if (!strcmp(cmd->argv[0], builtins[i].name))
+				break;
+#if defined(ENABLE_LOADABLE)
+		if (!builtins[i].name && !(lb = loadedfind(cmd->argv[0])))
+			return -1;
+#else
+		if (!builtins[i].name)
+			return -1;
+#endif /* ENABLE_LOADABLE */
+	}
+
+	/* e.g IFS= read -r line, the variables are only set during it */
+	if (info->vars && !(saved = vartemp(info->vars, info->vals, &nsaved)))
+		return MISC_FAILURE_STATUS;
+	if (fn) {
+		if (start_builtin_redir(info, &savefds, NULL) < 0) {
+			ret = MISC_FAILURE_STATUS;
+		} else {
+			ret = funcrun(fn, cmd);
+			if (end_builtin_redir(savefds) < 0)
+				ret = MISC_FAILURE_STATUS;
+		}
+	}
+#if defined(ENABLE_LOADABLE)
+	else if (lb)
+		ret = loadedrun(lb, cmd, info);
+#endif /* ENABLE_LOADABLE */
+	else
+		ret = builtins[i].fn(cmd, info);
+	if (saved)
+		vartempend(info->vars, saved, nsaved);
+	laststatus = ret;
+	if (ret > 0)
+		lastfail = ret;
+	update_laststatus(ret);
+	return ret;
+}
 
+/*
+ * ===========================================================================
+ * command execution functions
+ */
+static int
+applyredirs(const struct cmdinfo *info)
+{
+	/*
+	 * set up the redirections of a command in the child that runs it.
+	 * the files opened for them are closed on exec.
+	 */
+	const struct redir *r;
 	size_t i;
 
-	info->vars = NULL;
-	info->vals = NULL;
-	for (i = 0; i < cmd->argc; ++i) {
-		if ((ptr = strchr(cmd->argv[i], '=')) && ptr != cmd->argv[i]) {
-			if (var >= arrsize) {
-				arrsize += ARGV_ALLOC_SIZE;
-				if (var == 0) {
-					info->vars = wemallocarray(arrsize,
-							sizeof(char *));
-					info->vals = wemallocarray(arrsize,
-							sizeof(char *));
-					if (!info->vars || !info->vals)
-						return -1;
-				} else {
-					char **oldvars = info->vars;
-					char **oldvals = info->vals;
-					info->vars = wereallocarray(info->vars,
-							arrsize,
-							sizeof(char *));
-					if (!info->vars) {
-						free(oldvars);
-						return -1;
-					}
-					info->vals = wereallocarray(info->vals,
-							arrsize,
-							sizeof(char *));
-					if (!info->vals) {
-						free(oldvals);
-						return -1;
-					}
-				}
-			}
-			info->vars[var] = cmd->argv[i];
-			info->vals[var++] = ptr + 1;
-			*ptr = '\0';
-		} else {
-			break;
+	for (i = 0; i < info->nredirs; ++i) {
+		r = &info->redirs[i];
+		if (r->fd < 0) {
+			close(r->target);
+		} else if (dup2(r->fd, r->target) < 0) {
+			logerr("dup2:");
+			return -1;
 		}
 	}
+	return 0;
+}
 
-	if (var) {
-		info->vars[var] = NULL;
-		info->vals[var] = NULL;
-		cmd->argc -= var;
-		cmd->argv += var;
+static void
+closeredirs(struct cmdinfo *info)
+{
+	/* close what parseredir() opened once the command has it */
+	while (info->nredirs)
+		if (info->redirs[--info->nredirs].opened)
+			close(info->redirs[info->nredirs].fd);
+	free(info->redirs);
+	info->redirs = NULL;
+	fanoutclose(info);
+}
+
+static int
+cmdappend(struct cmdwords *w, const char *s, size_t n, int plain,
+		int quoted)
+{
+	/*
+	 * add n characters to the word being built. plain ones are
+	 * unquoted literal text, quoted ones aren't special in patterns.
+	 */
+	const char *p, *end = s + n;
+
+	if (cmdput(w, s, n, plain) < 0)
+		return -1;
+	for (p = s; p < end; s = ++p) {
+		while (p < end && *p != '*' && *p != '?' && *p != '['
+				&& *p != '\\')
+			++p;
+		if (strappend(&w->pat, &w->patsize, &w->patlen, s,
+					(size_t)(p - s)) < 0)
+			return -1;
+		if (p == end)
+			break;
+		if ((quoted || *p == '\\') && strappend(&w->pat, &w->patsize,
+					&w->patlen, "\\", 1) < 0)
+			return -1;
+		if (!quoted && *p != '\\')
+			w->glob = 1;
+		if (strappend(&w->pat, &w->patsize, &w->patlen, p, 1) < 0)
+			return -1;
 	}
 	return 0;
 }
 
 static int
-parseredir(struct command *cmd, struct cmdinfo *info)
+cmdaddword(struct cmdwords *w, const char *s)
 {
-	size_t argend = 0, i;
-	char *ptr = NULL;
-	int flags = 0, target_fd = 0;
-	char *redir_target;
+	/* add a finished word to the command being built */
+	if ((s && cmdput(w, s, strlen(s), 0) < 0) || cmdput(w, "", 1, 0) < 0)
+		return -1;
+	++w->counts[w->cmd];
+	return 0;
+}
 
-	info->redirfds[0] = -1;
-	info->redirfds[1] = -1;
-	info->redirfds[2] = -1;
-	for (i = 1; i < cmd->argc; ++i) {
-		ptr = strpbrk(cmd->argv[i], "<>");
-		if (ptr) {
-			int doclose = 0;
-			argend = i;
+static int
+cmdendword(struct cmdwords *w)
+{
+	/*
+	 * end the word being added, unless it's empty without quotes.
+	 * it's an assignment, a tilde or a pattern only if what makes it
+	 * one was unquoted literal text. assignments before the command
+	 * are left to parseenv().
+	 */
+	struct cmdinfo *info = &w->infos[w->cmd];
+	char *word = w->buf + w->start, *eq, *exp, *tail = NULL;
+	char *pattail = NULL, *plaintail = NULL;
+	size_t n, i;
+	int64_t t = 0;
+	int dynalloc, ret = 0;
+	glob_t g;
+
+	if (w->len == w->start && !w->quoted)
+		goto reset;
+	eq = strchr(word, '=');
+	if (w->nassign == w->counts[w->cmd] && eq && eq != word
+			&& cmdplain(w, w->start, (size_t)(eq - word) + 1)) {
+		++w->nassign;
+		ret = cmdaddword(w, NULL);
+		goto reset;
+	}
+
+	n = strcspn(word, "/");
+	if (*word == '~' && cmdplain(w, w->start, n)
+			&& (exp = expand_tilde(word, &dynalloc))) {
+		/* what it expands to is taken literally */
+		i = strlen(word + n);
+		if (!(tail = westrdup(word + n))
+				|| !(pattail = westrdup(w->pat + n))
+				|| !(plaintail = wemalloc(i + 1))) {
+			ret = -1;
+		} else {
+			memcpy(plaintail, w->plain + w->start + n, i);
+			w->len = w->start;
+			w->patlen = 0;
+			ret = cmdappend(w, exp, strlen(exp) - i, 0, 1);
+			if (!ret && !(ret = cmdput(w, tail, i, 0)))
+				memcpy(w->plain + w->len - i, plaintail, i);
+			if (!ret)
+				ret = strappend(&w->pat, &w->patsize,
+						&w->patlen, pattail,
+						strlen(pattail));
+		}
+		if (dynalloc)
+			free(exp);
+		free(tail);
+		free(pattail);
+		free(plaintail);
+		if (ret)
+			goto reset;
+	}
+
+	if (w->glob && (opts & OPT_GLOB)) {
+		if (tracefd >= 0)
+			t = traceclock();
+		switch (weglob(w->pat, 0, NULL, &g)) {
+		case 0:
+			w->len = w->start;
+			n = w->counts[w->cmd] - w->nassign;
+			if (g.gl_pathc > info->globend - info->globstart) {
+				info->globstart = n;
+				info->globend = n + g.gl_pathc;
+			}
+			for (i = 0; i < g.gl_pathc && !ret; ++i)
+				ret = cmdaddword(w, g.gl_pathv[i]);
+			globfree(&g);
+			if (tracefd >= 0)
+				tracespan("glob", t, w->pat, 0, 0,
+						(w->counts == &w->count) ? -1
+						: (int)(w->cmd));
+			goto reset;
+		case GLOB_NOMATCH:
+			/* the word is kept as it is */
+			globfree(&g);
+			break;
+		default:
+			ret = -1;
+			goto reset;
+		}
+	}
+	ret = cmdaddword(w, NULL);
+
+reset:
+	w->start = w->len;
+	w->quoted = w->glob = 0;
+	w->patlen = 0;
+	return ret;
+}
+
+static int
+cmdexpand(struct cmdwords *w, const char *exp, char quote)
+{
+	/*
+	 * add what expand_param() gave to the words, splitting it and
+	 * removing its escapes like parsecmd() would. none of it is
+	 * plain, and it's only a pattern outside of quotes.
+	 */
+	const char *p;
+	size_t n;
+	int inquote = !!quote;
+
+	for (p = exp; *p; ++p) {
+		n = strcspn(p, inquote ? "\\\"" : "\\\" ");
+		if (cmdappend(w, p, n, 0, inquote) < 0)
+			return -1;
+		if (!*(p += n))
+			break;
+		if (*p == '"') {
+			/* "$@" is joined with " " */
+			inquote = !inquote;
+			w->quoted = 1;
+		} else if (*p == ' ') {
+			if (cmdendword(w) < 0)
+				return -1;
+		} else if (cmdappend(w, (p[1]) ? ++p : p, 1, 0, inquote) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+cmdbuild(const struct node *n, struct cmdwords *w, struct command *cmds,
+		struct cmdinfo *infos)
+{
+	/*
+	 * expand the parameters and start the process substitutions of a
+	 * NODE_CMD that cmdcompile() split, and make commands of the words
+	 * for each of its n->code->ncmds commands. they point into w,
+	 * which is freed with cmdwordsfree() after them.
+	 */
+	const struct cmdcode *c = n->code;
+	const struct cmdpart *part;
+	char *exp = NULL, *word;
+	char path[32];
+	size_t expsize = 0, explen, i, j;
+	int fd, ret = 0;
+
+	memset(w, 0, sizeof(*w));
+	w->counts = &w->count;
+	w->infos = infos;
+	if (cmdput(w, "", 0, 0) < 0)
+		return -1;
+	if (c->ncmds > 1 && !(w->counts = wemallocarray(c->ncmds,
+					sizeof(*w->counts)))) {
+		free(w->buf);
+		free(w->plain);
+		return -1;
+	}
+	for (i = 0; i < c->ncmds; ++i) {
+		w->counts[i] = 0;
+		infos[i].canexpandpath = 0;
+		infos[i].globstart = infos[i].globend = 0;
+	}
+	for (part = c->parts; !ret && part < c->parts + c->nparts; ++part) {
+		switch (part->kind) {
+		case PART_LIT:
+			ret = cmdappend(w, c->lits + part->off, part->len,
+					!part->quote, !!part->quote);
+			break;
+		case PART_QUOTE:
+			w->quoted = 1;
+			break;
+		case PART_PARAM:
+			explen = 0;
+			if (!(ret = expand_param(&exp, &expsize, &explen,
+						n->text + part->off, part->len,
+						part->closelen, part->quote)))
+				ret = cmdexpand(w, explen ? exp : "",
+						part->quote);
+			break;
+		case PART_SUBST:
+			if ((fd = substart(n->text + part->off, part->len,
+							part->quote == '>')) < 0) {
+				ret = -1;
+				break;
+			}
+			sprintf(path, "/dev/fd/%d", fd);
+			ret = cmdappend(w, path, strlen(path), 0, 1);
+			break;
+		case PART_WORD:
+			ret = cmdendword(w);
+			break;
+		case PART_PIPE:
+			/* a command that expanded to nothing is run as '' */
+			if (!(ret = cmdendword(w)) && !w->counts[w->cmd]) {
+				w->quoted = 1;
+				ret = cmdendword(w);
+			}
+			++w->cmd;
+			w->nassign = 0;
+			break;
+		}
+	}
+	if (!ret && !(ret = cmdendword(w)) && !w->counts[w->cmd]) {
+		w->quoted = 1;
+		ret = cmdendword(w);
+	}
+	free(exp);
+
+	/* the commands point into the buffer, which doesn't move anymore */
+	for (i = 0, word = w->buf; !ret && i < c->ncmds; ++i) {
+		if (alloccmd(w->counts[i] + 1, &cmds[i]) < 0) {
+			ret = -1;
+			break;
+		}
+		infos[i].words = w->buf;
+		infos[i].plain = w->plain;
+		for (j = 0; j < w->counts[i]; ++j) {
+			cmds[i].argv[j] = word;
+			cmds[i].dynallocinfo[j] = 0;
+			word += strlen(word) + 1;
+		}
+		cmds[i].argv[j] = NULL;
+		cmds[i].dynallocinfo[j] = -1;
+		cmds[i].argc = j;
+	}
+	if (ret) {
+		while (i--)
+			freecmd(&cmds[i]);
+		cmdwordsfree(w);
+	}
+	return ret;
+}
+
+static int
+cmdplain(const struct cmdwords *w, size_t off, size_t n)
+{
+	/* check if n characters of the buffer were unquoted literal text */
+	return !memchr(w->plain + off, 0, n);
+}
+
+static int
+cmdput(struct cmdwords *w, const char *s, size_t n, int plain)
+{
+	/* add n characters to the buffer, keeping plain the same length */
+	size_t len = w->len;
+	char *p;
+
+	if (strappend(&w->buf, &w->size, &w->len, s, n) < 0)
+		return -1;
+	if (w->plainsize < w->size) {
+		if (!(p = werealloc(w->plain, w->size)))
+			return -1;
+		w->plain = p;
+		w->plainsize = w->size;
+	}
+	memset(w->plain + len, !!plain, n);
+	return 0;
+}
+
+static void
+cmdwordsfree(struct cmdwords *w)
+{
+	free(w->buf);
+	free(w->pat);
+	free(w->plain);
+	if (w->counts != &w->count)
+		free(w->counts);
+}
+
+static int
+cmdrun(const struct node *n)
+{
+	/* run a NODE_CMD that cmdcompile() split */
+	const struct cmdcode *c = n->code;
+	struct cmdwords w;
+	struct command cmd, *cmds = &cmd;
+	struct cmdinfo info, *infos = &info;
+	char **labels = NULL;
+	size_t i;
+	int ret = -1;
+
+	if (c->ncmds > 1) {
+		cmds = wemallocarray(c->ncmds, sizeof(*cmds));
+		infos = wemallocarray(c->ncmds, sizeof(*infos));
+		labels = wemallocarray(c->ncmds, sizeof(*labels));
+	}
+	if (cmds && infos && (c->ncmds == 1 || labels)
+			&& cmdbuild(n, &w, cmds, infos) == 0) {
+		if (c->ncmds > 1) {
+			for (i = 0; i < c->ncmds; ++i)
+				labels[i] = cmds[i].argv[0];
+			ret = runpipeline(cmds, infos, labels, c->ncmds);
+		} else {
+			ret = execcmd(cmds, infos);
+		}
+		cmdwordsfree(&w);
+	}
+	if (c->ncmds > 1) {
+		free(cmds);
+		free(infos);
+		free(labels);
+	}
+	return ret;
+}
+
+static int
+exec(char *s)
+{
+	char *pipechr = findunquoted(s, '|');
+	struct command cmd;
+	struct cmdinfo info;
+
+	if (pipechr && pipechr != s)
+		return pipeline(s);
+	if (parsecmd(s, &cmd, &info) < 0)
+		return -1;
+	return execcmd(&cmd, &info);
+}
+
+static int
+execcmd(struct command *origcmd, struct cmdinfo *info)
+{
+	/* run a command that parsecmd() or cmdrun() split, and free it */
+	struct command expcmd;
+	struct command *cmd = origcmd;
+	int didglob = 0;
+	int ret = 0;
+	int64_t t = 0;
+	size_t var;
+
+	if (parseenv(origcmd, info) < 0)
+		return -1;
+
+	if (info->canexpandpath && (opts & OPT_GLOB)) {
+		if (tracefd >= 0)
+			t = traceclock();
+		if (expand_path(origcmd, &expcmd, info) < 0) {
+			freecmd(origcmd);
+			return -1;
+		}
+		cmd = &expcmd;
+		didglob = 1;
+		if (tracefd >= 0)
+			tracespan("glob", t, cmd->argv[0], 0, 0, -1);
+	}
+	if (parseredir(cmd, info) < 0) {
+		if (didglob)
+			freecmd(&expcmd);
+		freecmd(origcmd);
+		return -1;
+	}
+	if (opts & OPT_XTRACE)
+		xtrace(cmd, info);
+
+	if ((opts & OPT_EXEC) && !cmd->argv[0] && info->vars) {
+		/* only assignments, set shell variables */
+		laststatus = 0;
+		for (var = 0; info->vars[var]; ++var)
+			if (varset(info->vars[var], info->vals[var]) < 0)
+				laststatus = lastfail = 1;
+		update_laststatus(laststatus);
+	} else if ((opts & OPT_EXEC) && try_exec_builtin(cmd, info) < 0) {
+		int r = (opts & OPT_AUTOBATCH) ?
+			runbatches(cmd, info) : 1;
+		if (r > 0)
+			r = spawn(cmd, info, -1, -1);
+		if (r < 0)
+			ret = -1;
+		else
+			update_laststatus(laststatus);
+	}
+
+	closeredirs(info);
+	if (info->vars) {
+		free(info->vars);
+		free(info->vals);
+	}
+	if (didglob)
+		freecmd(&expcmd);
+	freecmd(origcmd);
+	return ret;
+}
+
+static int
+spawn(const struct command *cmd, const struct cmdinfo *info, long timeout,
+		long killafter)
+{
+	/*
+	 * run an external command and wait for it, leaving its status in
+	 * laststatus. if timeout isn't -1, it's sent SIGTERM after that
+	 * many milliseconds, and SIGKILL killafter milliseconds later
+	 * (unless that's -1), see timedwait().
+	 */
+	pid_t chpid;
+	int64_t t;
+
+	if ((chpid = spawnchild(cmd, info, timeout >= 0)) < 0)
+		return -1;
+	t = (tracefd >= 0) ? traceclock() : 0;
+	if (timeout >= 0)
+		timedwait(chpid, timeout, killafter);
+	else
+		report(chpid);
+	if (tracefd >= 0)
+		tracespan("wait", t, cmd->argv[0], chpid,
+				(term >= 0 || timeout >= 0) ? chpid :
+				getpgrp(), -1);
+
+	/* put ourselves back into the foreground */
+	if (term >= 0)
+		if (tcsetpgrp(term, shell_pgid) < 0)
+			logerr("tcsetpgrp:");
+	return 0;
+}
+
+static pid_t
+spawnchild(const struct command *cmd, const struct cmdinfo *info,
+		int ownpgrp)
+{
+	/*
+	 * start an external command and return its pid. if ownpgrp is 1,
+	 * it gets its own process group even if the shell isn't
+	 * interactive, so that it can be killed with everything it starts.
+	 *
+	 * if this is the last command the shell runs, it's executed in
+	 * place of the shell instead of forking and waiting for it.
+	 */
+	pid_t chpid;
+	int64_t t = 0;
+	size_t var;
+	int inplace;
+
+	fflush(stdout);
+	if (tracefd >= 0)
+		t = traceclock();
+	/*
+	 * the trace buffer can't be dumped by a shell that was replaced,
+	 * so it waits unless exec asked for it
+	 */
+	inplace = tailpos > 1 || (tailpos && !tracering);
+	chpid = inplace ? 0 : shellfork();
+	switch (chpid) {
+	case -1:
+		logerr("fork:");
+		return -1;
+	case 0:
+		if (tracefd >= 0)
+			t = traceclock();
+		/*
+		 * if the shell is interactive, go into a new process group
+		 * and put it into the foreground, unless it's replacing the
+		 * shell which is there already. a command with a timeout
+		 * always gets its own group, which is what's killed.
+		 */
+		if ((term >= 0 || ownpgrp) && !inplace) {
+			if (((term >= 0) ? joinpgrp() : setpgid(0, 0)) < 0) {
+				logerr("setpgid:");
+				_exit(MISC_FAILURE_STATUS);
+			}
+			if (term >= 0 && tcsetpgrp(term, getpgrp()) < 0) {
+				logerr("tcsetpgrp:");
+				_exit(MISC_FAILURE_STATUS);
+			}
+		}
+
+		/* set env variables */
+		if (info->vars) {
+			for (var = 0; info->vars[var]; ++var) {
+				if (setenv(info->vars[var], info->vals[var],
+							1) < 0) {
+					logerr("setenv:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+			}
+		}
+
+		/* redirection */
+		if (applyredirs(info) < 0)
+			_exit(MISC_FAILURE_STATUS);
+		if (info->noutfds)
+			fanout(info, -1);
+
+		/* execute the command */
+		substinherit();
+		if (tracefd >= 0)
+			tracespan("exec", t, cmd->argv[0], getpid(),
+					getpgrp(), -1);
+		if (execvp(cmd->argv[0], cmd->argv) < 0) {
+			logerr("execvp '%s':", cmd->argv[0]);
+			_exit((errno == ENOENT) ? 127 :
+				((errno == ENOEXEC) ? 126 :
+				 MISC_FAILURE_STATUS));
+		}
+		/* unreachable */
+		break;
+	default:
+		/* the child might not have gotten there yet */
+		if (ownpgrp)
+			setpgid(chpid, chpid);
+		if (tracefd >= 0)
+			tracespan("fork", t, cmd->argv[0], chpid,
+					(term >= 0 || ownpgrp) ? chpid :
+					getpgrp(), -1);
+	}
+	return chpid;
+}
+
+static int
+runbatches(const struct command *cmd, const struct cmdinfo *info)
+{
+	/*
+	 * for set -o autobatch: if the arguments of cmd and the environment
+	 * are too big for execve(), run it several times like xargs would,
+	 * each time with as many of the arguments that the biggest pathname
+	 * expansion gave as fit, and the arguments around them. up to
+	 * batchjobs of them run at once, all in one process group. the
+	 * status is the first non-zero one of them, if any.
+	 *
+	 * returns 1 without running anything if cmd fits or can't be split,
+	 * 0 if it was run and -1 on error.
+	 */
+	struct command batch;
+	pid_t *pids;
+	size_t start = info->globstart;
+	size_t end = (info->globend < cmd->argc) ? info->globend : cmd->argc;
+	size_t fixed = sizeof(char *), size, limit, i, j, n, running = 0;
+	pid_t oldpgid = substpgid;
+	long argmax = sysconf(_SC_ARG_MAX);
+	int tail = tailpos;
+	int status = 0, ret = 0;
+	char **e;
+
+	if (argmax <= 0 || start >= end)
+		return 1;
+	/* leave some room like xargs does, and count the env variables */
+	proclock();
+	for (e = environ; *e; ++e)
+		fixed += strlen(*e) + 1 + sizeof(char *);
+	procunlock();
+	for (i = 0; info->vars && info->vars[i]; ++i)
+		fixed += strlen(info->vars[i]) + strlen(info->vals[i]) + 2
+			+ sizeof(char *);
+	for (i = 0; i < cmd->argc; ++i)
+		if (i < start || i >= end)
+			fixed += strlen(cmd->argv[i]) + 1 + sizeof(char *);
+	for (size = fixed, i = start; i < end; ++i)
+		size += strlen(cmd->argv[i]) + 1 + sizeof(char *);
+	if (size <= (size_t)(argmax) - 2048 || fixed >= (size_t)(argmax) / 2)
+		return 1;
+	limit = (size_t)(argmax) - 2048;
+
+	batch.orig_argv = NULL;
+	batch.dynallocinfo = NULL;
+	if (!(batch.argv = wemallocarray(cmd->argc + 1, sizeof(char *))))
+		return -1;
+	if (!(pids = wemallocarray((size_t)(batchjobs), sizeof(pid_t)))) {
+		free(batch.argv);
+		return -1;
+	}
+	memcpy(batch.argv, cmd->argv, start * sizeof(char *));
+
+	tailpos = 0;
+	for (i = start; i < end; i = j) {
+		size = fixed;
+		for (j = i, n = start; j < end && (j == i || size
+					+ strlen(cmd->argv[j]) + 1
+					+ sizeof(char *) <= limit); ++j) {
+			size += strlen(cmd->argv[j]) + 1 + sizeof(char *);
+			batch.argv[n++] = cmd->argv[j];
+		}
+		memcpy(batch.argv + n, cmd->argv + end,
+				(cmd->argc - end + 1) * sizeof(char *));
+		batch.argc = n + cmd->argc - end;
+
+		if (running == (size_t)(batchjobs)) {
+			/* wait for the oldest one to make room */
+			report(pids[0]);
+			if (laststatus && !status)
+				status = laststatus;
+			memmove(pids, pids + 1, --running * sizeof(pid_t));
+		}
+		if ((pids[running] = spawnchild(&batch, info, 0)) < 0) {
+			ret = -1;
+			break;
+		}
+		/* the other batches join the group of the first one */
+		if (term >= 0 && substpgid < 0)
+			substpgid = pids[running];
+		++running;
+	}
+	for (i = 0; i < running; ++i) {
+		report(pids[i]);
+		if (laststatus && !status)
+			status = laststatus;
+	}
+	if (term >= 0 && tcsetpgrp(term, shell_pgid) < 0)
+		logerr("tcsetpgrp:");
+	substpgid = oldpgid;
+	tailpos = tail;
+	laststatus = status;
+	if (status)
+		lastfail = status;
+	free(pids);
+	free(batch.argv);
+	return ret;
+}
+
+static void
+substinherit(void)
+{
+	/* let a command that's about to be executed have /dev/fd/N */
+	size_t i;
+
+	for (i = 0; i < nsubsts; ++i)
+		fcntl(substs[i].fd, F_SETFD, 0);
+}
+
+static int
+substart(const char *cmd, size_t len, int out)
+{
+	/*
+	 * start the process substitution <(cmd), or >(cmd) if out is 1,
+	 * in a copy of the shell and return the fd of its end of the pipe.
+	 * it's only inherited by the command it was given to, see
+	 * substinherit(), and closed and waited for after that command by
+	 * substwait().
+	 */
+	struct subst *newsubsts;
+	char *text;
+	int fds[2];
+	size_t i;
+	pid_t pid;
+
+	if (nsubsts >= substsize) {
+		if (!(newsubsts = wereallocarray(substs, substsize + 8,
+						sizeof(struct subst))))
+			return -1;
+		substs = newsubsts;
+		substsize += 8;
+	}
+	if (!(text = westrndup(cmd, len)))
+		return -1;
+	if (makepipe(fds) < 0) {
+		free(text);
+		return -1;
+	}
+	fflush(stdout);
+	switch ((pid = shellfork())) {
+	case -1:
+		logerr("fork:");
+		close(fds[0]);
+		close(fds[1]);
+		free(text);
+		return -1;
+	case 0:
+		forked = 1;
+		if (term >= 0) {
+			/* the command joins this group and takes the terminal */
+			if (joinpgrp() < 0)
+				logerr("setpgid:");
+			term = -1;
+		}
+		for (i = 0; i < nsubsts; ++i)
+			close(substs[i].fd);
+		nsubsts = 0;
+		substpgid = -1;
+		if (dup2(fds[!out], out ? STDIN_FILENO : STDOUT_FILENO) < 0) {
+			logerr("dup2:");
+			_exit(MISC_FAILURE_STATUS);
+		}
+		close(fds[0]);
+		close(fds[1]);
+		if (takecmd(text, 1) > 0)
+			fputs("syntax error: unexpected end of input\n",
+					stderr);
+		fflush(stdout);
+		_exit(lastexit);
+	}
+
+	free(text);
+	close(fds[!out]);
+	if (term >= 0) {
+		/* the child might not have gotten there yet */
+		setpgid(pid, (substpgid > 0) ? substpgid : pid);
+		if (substpgid < 0)
+			substpgid = pid;
+	}
+	substs[nsubsts].pid = pid;
+	substs[nsubsts].fd = fds[out];
+	return substs[nsubsts++].fd;
+}
+
+static void
+substwait(size_t from)
+{
+	/*
+	 * close the pipes of the process substitutions started since there
+	 * were from of them, so that a >(cmd) sees the end of its input,
+	 * and wait for them. the ones before are of a loop or a group that
+	 * the command is in.
+	 */
+	size_t i;
+
+	for (i = from; i < nsubsts; ++i)
+		close(substs[i].fd);
+	for (i = from; i < nsubsts; ++i)
+		while (waitpid(substs[i].pid, NULL, 0) < 0 && errno == EINTR)
+			;
+	nsubsts = from;
+	if (!from)
+		substpgid = -1;
+}
+
+static void
+timedwait(pid_t pid, long timeout, long killafter)
+{
+	/*
+	 * wait for the process pid for timeout milliseconds, then send
+	 * SIGTERM to its process group, and SIGKILL if it's still there
+	 * killafter milliseconds later. laststatus is set to its status,
+	 * or TIMEOUT_EXITSTATUS if it had to be stopped.
+	 *
+	 * the waiting is done with poll() on a pidfd on Linux, so that
+	 * nothing else has to be set up. elsewhere (or on kernels older
+	 * than 5.3), a SIGCHLD handler writes to a pipe that is polled
+	 * instead.
+	 */
+	struct pollfd pfd;
+	int64_t deadline = traceclock() / 1000 + timeout;
+	int64_t now;
+	int wstatus, signalled = 0;
+	int usepipe = 0;
+	pid_t r;
+	char c;
+
+	pfd.fd = -1;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	pfd.fd = (int)(syscall(SYS_pidfd_open, pid, 0));
+#endif /* __linux__ && SYS_pidfd_open */
+	if (pfd.fd < 0) {
+		if ((pfd.fd = sigchldopen()) < 0) {
+			report(pid);
+			return;
+		}
+		usepipe = 1;
+	}
+	pfd.events = POLLIN;
+
+	/* the child could have exited before the handler was installed */
+	while ((r = waitpid(pid, &wstatus, WNOHANG)) == 0) {
+		now = traceclock() / 1000;
+		if (now >= deadline) {
+			kill(-pid, signalled ? SIGKILL : SIGTERM);
+			/* stopped commands can't handle SIGTERM */
+			kill(-pid, SIGCONT);
+			deadline = (signalled || killafter < 0) ? INT64_MAX
+				: now + killafter;
+			signalled = 1;
+			continue;
+		}
+		if (poll(&pfd, 1, (deadline - now > INT_MAX) ? -1
+					: (int)(deadline - now)) < 0
+				&& errno != EINTR) {
+			logerr("poll:");
+			break;
+		}
+		if (usepipe)
+			while (read(pfd.fd, &c, 1) > 0)
+				;
+	}
+
+	if (usepipe) {
+		sigchldclose(pfd.fd);
+	} else {
+		close(pfd.fd);
+	}
+	if (r == pid)
+		reportstatus(wstatus);
+	else if (r == 0)
+		report(pid);
+	else
+		logerr("waitpid:");
+	if (signalled)
+		laststatus = lastfail = TIMEOUT_EXITSTATUS;
+}
+
+static void
+fanout(const struct cmdinfo *info, int pipefd)
+{
+	/*
+	 * called in a child after its redirection is set up, when its
+	 * output goes to more than one place. the command continues in a
+	 * new child writing to a pipe, and this process stays behind to
+	 * copy from the pipe to the first redirection, the others in
+	 * info->outfds and pipefd (the next command of a pipeline) if it
+	 * isn't -1. then it exits with the command's status, so whoever
+	 * waits for it also waits for all of the output to be written.
+	 */
+	int *outs;
+	int fds[2];
+	size_t n = 0, i;
+	pid_t pid;
+	int wstatus;
+
+	if (!(outs = wemallocarray(info->noutfds + 2, sizeof(int))))
+		_exit(MISC_FAILURE_STATUS);
+	outs[n++] = info->outtarget;
+	for (i = 0; i < info->noutfds; ++i)
+		outs[n++] = info->outfds[i];
+	if (pipefd >= 0)
+		outs[n++] = pipefd;
+
+	if (makepipe(fds) < 0)
+		_exit(MISC_FAILURE_STATUS);
+	fflush(stdout);
+	switch ((pid = shellfork())) {
+	case -1:
+		logerr("fork:");
+		_exit(MISC_FAILURE_STATUS);
+	case 0:
+		/* the others are closed on exec */
+		if (dup2(fds[1], info->outtarget) < 0) {
+			logerr("dup2:");
+			_exit(MISC_FAILURE_STATUS);
+		}
+		close(fds[0]);
+		close(fds[1]);
+		free(outs);
+		return;
+	}
+
+	close(fds[1]);
+	/* nothing reads what's left if this fails */
+	fanoutcopy(fds[0], outs, n);
+	close(fds[0]);
+	for (i = 0; i < n; ++i)
+		close(outs[i]);
+	while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+		;
+	if (WIFSIGNALED(wstatus)) {
+		signal(WTERMSIG(wstatus), SIG_DFL);
+		kill(getpid(), WTERMSIG(wstatus));
+		_exit(128 + WTERMSIG(wstatus));
+	}
+	_exit(WEXITSTATUS(wstatus));
+}
+
+static void
+fanoutclose(struct cmdinfo *info)
+{
+	/* close the extra output redirections once they were passed on */
+	while (info->noutfds)
+		close(info->outfds[--info->noutfds]);
+	free(info->outfds);
+	info->outfds = NULL;
+}
+
+static int
+fanoutcopy(int in, const int *outs, size_t nouts)
+{
+	/*
+	 * copy everything from the pipe in to each of outs until the end.
+	 *
+	 * on Linux the data never leaves the kernel: tee() duplicates
+	 * what's in the pipe into a scratch pipe for every output but the
+	 * last one without using it up, then splice() moves it from there
+	 * (and the original into the last output). the scratch pipes are
+	 * as big as the input one and empty each time, so they always
+	 * take all of it.
+	 */
+	size_t bufsize = 65536, i;
+	ssize_t n;
+	char *buf;
+	int ret = 0;
+#if defined(__linux__)
+	int (*scratch)[2];
+	ssize_t *got;
+	int shortcopy;
+	int sz;
+#endif /* __linux__ */
+
+#if defined(__linux__) && defined(F_GETPIPE_SZ)
+	if ((sz = fcntl(in, F_GETPIPE_SZ)) > 0)
+		bufsize = (size_t)(sz);
+#endif /* __linux__ && F_GETPIPE_SZ */
+	/* the second half is for fanoutmove() when the first is in use */
+	if (!(buf = wemallocarray(bufsize, 2)))
+		return -1;
+
+#if defined(__linux__)
+	scratch = wemallocarray(nouts, sizeof(*scratch));
+	got = wemallocarray(nouts, sizeof(*got));
+	for (i = 0; scratch && got && i + 1 < nouts; ++i) {
+		if (makepipe(scratch[i]) < 0)
+			break;
+#if defined(F_SETPIPE_SZ)
+		fcntl(scratch[i][1], F_SETPIPE_SZ, (int)(bufsize));
+#endif /* F_SETPIPE_SZ */
+	}
+	if (!scratch || !got || i + 1 < nouts) {
+		while (scratch && i--) {
+			close(scratch[i][0]);
+			close(scratch[i][1]);
+		}
+		free(scratch);
+		free(got);
+		free(buf);
+		return -1;
+	}
+
+	for (;;) {
+		n = tee(in, scratch[0][1], bufsize, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL)
+			goto userspace;
+		if (n <= 0) {
+			if (n < 0)
+				logerr("tee:");
+			ret = (int)(n);
+			break;
+		}
+		got[0] = n;
+		shortcopy = 0;
+		for (i = 1; i + 1 < nouts; ++i) {
+			while ((got[i] = tee(in, scratch[i][1], (size_t)(n),
+							0)) < 0
+					&& errno == EINTR)
+				;
+			if (got[i] < 0)
+				got[i] = 0;
+			if (got[i] < n)
+				shortcopy = 1;
+		}
+		if (shortcopy) {
+			/* some didn't get it all, send them the rest */
+			if (fanoutmove(in, -1, (size_t)(n), buf) < 0
+					|| fanoutmove(-1, outs[nouts - 1],
+						(size_t)(n), buf) < 0)
+				ret = -1;
+		} else if (fanoutmove(in, outs[nouts - 1], (size_t)(n),
+					buf) < 0) {
+			ret = -1;
+		}
+		for (i = 0; i + 1 < nouts; ++i) {
+			if (fanoutmove(scratch[i][0], outs[i],
+						(size_t)(got[i]), buf + bufsize) < 0
+					|| (got[i] < n && fanoutmove(-1,
+							outs[i],
+							(size_t)(n - got[i]),
+							buf + got[i]) < 0))
+				ret = -1;
+		}
+		if (ret < 0)
+			break;
+	}
+	goto end;
+
+userspace:
+#endif /* __linux__ */
+	/* copy it by hand where tee() can't be used */
+	while ((n = read(in, buf, bufsize)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			logerr("read:");
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < nouts; ++i)
+			if (fanoutmove(-1, outs[i], (size_t)(n), buf) < 0)
+				ret = -1;
+		if (ret < 0)
+			break;
+	}
+
+#if defined(__linux__)
+end:
+	for (i = 0; i + 1 < nouts; ++i) {
+		close(scratch[i][0]);
+		close(scratch[i][1]);
+	}
+	free(scratch);
+	free(got);
+#endif /* __linux__ */
+	free(buf);
+	return ret;
+}
+
+static int
+fanoutmove(int from, int to, size_t n, char *buf)
+{
+	/*
+	 * move n bytes from the pipe from to to with splice(), or if that
+	 * doesn't work for them, through buf (which has room for n). if
+	 * from is -1, buf already holds the bytes, and if to is -1, they
+	 * are only read into buf. whatever splice() already moved isn't
+	 * in buf.
+	 */
+	size_t done = 0, start;
+	ssize_t r;
+
+#if defined(__linux__)
+	while (from >= 0 && to >= 0 && done < n) {
+		r = splice(from, NULL, to, NULL, n - done, SPLICE_F_MOVE);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EINVAL)
+			break;
+		if (r <= 0) {
+			logerr("splice:");
+			return -1;
+		}
+		done += (size_t)(r);
+	}
+	if (done == n)
+		return 0;
+#endif /* __linux__ */
+	start = done;
+	while (from >= 0 && done < n) {
+		r = read(from, buf + done, n - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			logerr("read:");
+			return -1;
+		}
+		done += (size_t)(r);
+	}
+	for (done = start; to >= 0 && done < n; done += (size_t)(r)) {
+		r = write(to, buf + done, n - done);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if (r < 0) {
+			logerr("write:");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+makepipe(int fds[2])
+{
+	/*
+	 * create a pipe between two commands of a pipeline. its ends
+	 * are closed on exec, so a command only keeps the ones it was
+	 * given as its stdin and stdout, and its buffer has the size set
+	 * with 'set -o pipebuf=SIZE'.
+	 */
+#if defined(__linux__)
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		logerr("pipe2:");
+		return -1;
+	}
+#else
+	if (pipe(fds) < 0) {
+		logerr("pipe:");
+		return -1;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif /* __linux__ */
+#if defined(F_SETPIPE_SZ)
+	/* optpipebuf() checked that this size works already */
+	if (pipebuf > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipebuf) < 0)
+		logerr("fcntl F_SETPIPE_SZ:");
+#endif /* F_SETPIPE_SZ */
+	return 0;
+}
+
+static pid_t
+pipechain(struct command *origcmd, struct cmdinfo *info, size_t stage,
+		pid_t *pgid, int *rpipe, int *wpipe)
+{
+	/* start one command of a pipeline and free it */
+	struct command expcmd;
+	struct command *cmd = origcmd;
+	struct function *fn;
+	int didglob = 0;
+	int failed = 0;
+	int pipefd = -1;
+	int64_t t = 0;
+	size_t var;
+
+	pid_t chpid = 0;
+
+	if (parseenv(origcmd, info) < 0)
+		return -1;
+
+	if (info->canexpandpath && (opts & OPT_GLOB)) {
+		if (tracefd >= 0)
+			t = traceclock();
+		if (expand_path(origcmd, &expcmd, info) < 0) {
+			freecmd(origcmd);
+			return -1;
+		}
+		cmd = &expcmd;
+		didglob = 1;
+		if (tracefd >= 0)
+			tracespan("glob", t, cmd->argv[0], 0, 0, (int)(stage));
+	}
+	if (parseredir(cmd, info) < 0) {
+		if (didglob)
+			freecmd(&expcmd);
+		freecmd(origcmd);
+		return -1;
+	}
+	if (opts & OPT_XTRACE)
+		xtrace(cmd, info);
+
+	/*
+	 * functions and builtins get their own process like external
+	 * commands so that they can read from and write to the pipes, e.g
+	 * 'cmd | read v' or 'cache -- cmd | tr'
+	 */
+	fn = funcfind(cmd->argv[0]);
+	if (opts & OPT_EXEC) {
+		fflush(stdout);
+		if (tracefd >= 0)
+			t = traceclock();
+		chpid = shellfork();
+		switch (chpid) {
+		case -1:
+			logerr("fork:");
+			failed = 1;
+			break;
+		case 0:
+			if (tracefd >= 0)
+				t = traceclock();
+			if (term >= 0) {
+				if (*pgid < 0 || (kill(*pgid, 0 < 0)
+							&& errno == ESRCH)) {
+					/* set new PGID for the pipeline */
+					if (joinpgrp() < 0) {
+						logerr("setpgid:");
+						_exit(MISC_FAILURE_STATUS);
+					}
+					if (tcsetpgrp(term, getpgrp()) < 0) {
+						logerr("tcsetpgrp:");
+						_exit(MISC_FAILURE_STATUS);
+					}
+				} else if (setpgid(0, *pgid) < 0) {
+					/*
+					 * PGID of the pipeline set already,
+					 * join that group
+					 */
+					logerr("setpgid:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+			}
+
+			/* pipe redirection */
+			if (rpipe) {
+				/* there's a pipe from the previous process */
+				if (dup2(rpipe[0], STDIN_FILENO) < 0) {
+					logerr("dup2:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+				if (weclose(rpipe[0]) < 0
+						|| weclose(rpipe[1]) < 0)
+					_exit(MISC_FAILURE_STATUS);
+			}
+			if (wpipe) {
+				/* there's a pipe to the next process */
+				if (dup2(wpipe[1], STDOUT_FILENO) < 0) {
+					logerr("dup2:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+				if (weclose(wpipe[0]) < 0
+						|| weclose(wpipe[1]))
+					_exit(MISC_FAILURE_STATUS);
+			}
+
+			/* set env variables */
+			if (info->vars) {
+				for (var = 0; info->vars[var]; ++var) {
+					if (setenv(info->vars[var],
+						info->vals[var],
+						1) < 0) {
+						logerr("setenv:");
+						_exit(MISC_FAILURE_STATUS);
+					}
+				}
+			}
+
+			if (!fn && isbuiltin(cmd->argv[0])) {
+				/* it handles its own redirections */
+				term = -1;
+				forked = 1;
+				try_exec_builtin(cmd, info);
+				fflush(stdout);
+				_exit(laststatus);
+			}
+
+			/* redirection */
+			if (wpipe && info->noutfds
+					&& info->outtarget == STDOUT_FILENO
+					&& (pipefd = fcntl(STDOUT_FILENO,
+						F_DUPFD_CLOEXEC, 3)) < 0) {
+				/* the next command gets the output too */
+				logerr("fcntl:");
+				_exit(MISC_FAILURE_STATUS);
+			}
+			if (applyredirs(info) < 0)
+				_exit(MISC_FAILURE_STATUS);
+			if (info->noutfds)
+				fanout(info, pipefd);
+
+			if (fn) {
+				/* commands in the function stay in our group */
+				term = -1;
+				forked = 1;
+				funcrun(fn, cmd);
+				fflush(stdout);
+				_exit(lastexit);
+			}
+
+			if (opts & OPT_AUTOBATCH) {
+				/* the batches stay in the pipeline's group */
+				term = -1;
+				forked = 1;
+				switch (runbatches(cmd, info)) {
+				case -1:
+					_exit(MISC_FAILURE_STATUS);
+				case 0:
+					_exit(laststatus);
+				}
+			}
+
+			/* execute the command */
+			substinherit();
+			if (tracefd >= 0)
+				tracespan("exec", t, cmd->argv[0], getpid(),
+						getpgrp(), (int)(stage));
+			if (execvp(cmd->argv[0], cmd->argv) < 0) {
+				logerr("execvp '%s':", cmd->argv[0]);
+				_exit((errno == ENOENT) ? 127 :
+					((errno == ENOEXEC) ? 126 :
+					 MISC_FAILURE_STATUS));
+			}
+			/* unreachable */
+			break;
+		default:
+			if (tracefd >= 0)
+				tracespan("fork", t, cmd->argv[0], chpid,
+						(term < 0) ? getpgrp() :
+						(*pgid < 0) ? chpid : *pgid,
+						(int)(stage));
+		}
+	}
+
+	if (rpipe && (weclose(rpipe[0]) < 0 || weclose(rpipe[1]) < 0))
+		failed = 1;
+	closeredirs(info);
+	if (info->vars) {
+		free(info->vars);
+		free(info->vals);
+	}
+	if (didglob)
+		freecmd(&expcmd);
+	freecmd(origcmd);
+	if (term >= 0 && (*pgid = tcgetpgrp(term)) < 0) {
+		logerr("tcgetpgrp:");
+		return -1;
+	}
+	if (failed)
+		return -1;
+	return chpid;
+}
+
+static int
+pipeline(char *s)
+{
+	/*
+	 * handles pipelines, for instance:
+	 * ps aux | grep proc | grep -v grep | awk '{print $NF}'
+	 */
+	char **cmds = wemallocarray(sizeof(char *), ARGV_ALLOC_SIZE);
+	char *ptr;
+	char *oldptr = s;
+	size_t arrsize = ARGV_ALLOC_SIZE;
+	size_t i = 0, j;
+	struct command *stages;
+	struct cmdinfo *infos;
+	int ret;
+
+	if (!cmds)
+		return -1;
+	ptr = delimit(s, '|');
+	while (ptr) {
+		if (i >= arrsize) {
+			char **oldcmds = cmds;
+			arrsize += ARGV_ALLOC_SIZE;
+			if (!(cmds = wereallocarray(cmds, sizeof(char *),
+							arrsize))) {
+				free(oldcmds);
+				return -1;
+			}
+		}
+		cmds[i++] = oldptr;
+		oldptr = ptr;
+		ptr = delimit(ptr, '|');
+	}
+	if (i + 1 >= arrsize) {
+		char **oldcmds = cmds;
+		arrsize += 2;
+		if (!(cmds = wereallocarray(cmds, sizeof(char *), arrsize))) {
+			free(oldcmds);
+			return -1;
+		}
+	}
+	cmds[i++] = oldptr;
+	cmds[i] = NULL;
+
+	stages = wemallocarray(i, sizeof(*stages));
+	infos = wemallocarray(i, sizeof(*infos));
+	for (j = 0; stages && infos && j < i; ++j)
+		if (parsecmd(cmds[j], &stages[j], &infos[j]) < 0)
+			break;
+	if (j < i) {
+		while (j--)
+			freecmd(&stages[j]);
+		ret = -1;
+	} else {
+		ret = runpipeline(stages, infos, cmds, i);
+	}
+	free(stages);
+	free(infos);
+	free(cmds);
+	return ret;
+}
+
+static int
+runpipeline(struct command *cmds, struct cmdinfo *infos, char **labels,
+		size_t n)
+{
+	/*
+	 * start the n commands that pipeline() or cmdrun() split and wait
+	 * for them, labels name them in the trace. the commands are freed.
+	 *
+	 * two pipes: one from the previous in the chain, one to the next
+	 * in the chain
+	 */
+	int lpipe[2], rpipe[2];
+	pid_t *pids;
+	int *statuses;
+	size_t j, k;
+
+	/* PGID of the pipeline */
+	pid_t pgid = -1;
+
+	pids = wemallocarray(n, sizeof(pid_t));
+	statuses = wemallocarray(n, sizeof(int));
+	if (!pids || !statuses) {
+		free(pids);
+		free(statuses);
+		for (k = 0; k < n; ++k)
+			freecmd(&cmds[k]);
+		return -1;
+	}
+
+	/*
+	 * start every command before waiting for any of them, a command
+	 * in the middle can't finish until the next one reads what it
+	 * writes
+	 */
+	for (j = 0, k = 0; j < n; ++j) {
+		/* the last one writes to wherever the shell's stdout is */
+		if (j + 1 < n && makepipe(rpipe) < 0)
+			break;
+		k = j + 1;
+		pids[j] = pipechain(&cmds[j], &infos[j], j, &pgid,
+				j ? lpipe : NULL, (j + 1 < n) ? rpipe : NULL);
+		/* nothing was started with set -n */
+		statuses[j] = laststatus;
+		if (pids[j] < 0) {
+			if (j + 1 < n) {
+				weclose(rpipe[0]);
+				weclose(rpipe[1]);
+			}
+			break;
+		}
+		/* the output pipe becomes the input of the next one */
+		lpipe[0] = rpipe[0];
+		lpipe[1] = rpipe[1];
+	}
+	if (j < n && j > 0) {
+		/* let the ones that were started see the end of the pipe */
+		weclose(lpipe[0]);
+		weclose(lpipe[1]);
+	}
+	/* pipechain() frees the ones it was given */
+	for (; k < n; ++k)
+		freecmd(&cmds[k]);
+	for (k = 0; k < j; ++k) {
+		if (pids[k] > 0) {
+			int64_t t = (tracefd >= 0) ? traceclock() : 0;
+			report(pids[k]);
+			statuses[k] = laststatus;
+			if (tracefd >= 0)
+				tracespan("wait", t, labels[k], pids[k],
+						(term < 0) ? getpgrp() : pgid,
+						(int)(k));
+		}
+	}
+	free(pids);
+	if (j < n) {
+		free(statuses);
+		return -1;
+	}
+
+	/* put ourselves back into the foreground */
+	if (term >= 0) {
+		if (tcsetpgrp(term, shell_pgid) < 0) {
+			logerr("tcsetpgrp:");
+			return -1;
+		}
+	}
+
+	if (opts & OPT_PIPEFAIL) {
+		update_laststatus(lastfail);
+		lastfail = 0;
+	} else {
+		update_laststatus(laststatus);
+	}
+	free(pipestatus);
+	pipestatus = statuses;
+	npipestatus = n;
+
+	return 0;
+}
+
+static int
+groupredir(const char *text, char **s, struct command *cmd,
+		struct cmdinfo *info)
+{
+	/*
+	 * open the redirection after a { } or ( ) group, which is parsed
+	 * like the redirection of a ':' command. *s holds the strings in
+	 * cmd and is freed with it by the caller.
+	 */
+	char *exp, *subst;
+
+	if (expand_procsubst(text, &subst) < 0)
+		return -1;
+	if (expand_params(subst ? subst : text, &exp) < 0) {
+		free(subst);
+		return -1;
+	}
+	free(subst);
+	*s = wemalloc(strlen(exp) + 3);
+	if (*s) {
+		(*s)[0] = ':';
+		(*s)[1] = ' ';
+		strcpy(*s + 2, exp);
+	}
+	free(exp);
+	if (!*s)
+		return -1;
+	if (parsecmd(*s, cmd, info) < 0) {
+		free(*s);
+		return -1;
+	}
+	if (parseredir(cmd, info) < 0) {
+		freecmd(cmd);
+		free(*s);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+joinpgrp(void)
+{
+	/*
+	 * put a child that starts a job into the process group of the
+	 * job's process substitutions if there are any, or a new one
+	 */
+	if (substpgid > 0 && setpgid(0, substpgid) == 0)
+		return 0;
+	return setpgid(0, 0);
+}
+
+static void
+rungroup(const struct node *n)
+{
+	/*
+	 * run a { } group or a loop in the shell process. its redirection
+	 * is opened once and applies to all of the commands in it.
+	 */
+	struct command cmd;
+	struct cmdinfo info;
+	size_t nsubst = nsubsts;
+	size_t savefds;
+	char *s;
+
+	if (!n->text) {
+		if (n->type == NODE_GROUP)
+			runtree(n->body);
+		else
+			runloop(n);
+		return;
+	}
+	if (groupredir(n->text, &s, &cmd, &info) < 0) {
+		laststatus = lastfail = MISC_FAILURE_STATUS;
+		update_laststatus(laststatus);
+		if (nsubsts > nsubst)
+			substwait(nsubst);
+		return;
+	}
+	if (start_builtin_redir(&info, &savefds, NULL) < 0) {
+		laststatus = lastfail = MISC_FAILURE_STATUS;
+		update_laststatus(laststatus);
+	} else {
+		if (n->type == NODE_GROUP)
+			runtree(n->body);
+		else
+			runloop(n);
+		/* don't lose buffered output of builtins */
+		fflush(stdout);
+		if (end_builtin_redir(savefds) < 0) {
+			laststatus = lastfail = MISC_FAILURE_STATUS;
+			update_laststatus(laststatus);
+		}
+	}
+	closeredirs(&info);
+	freecmd(&cmd);
+	free(s);
+	if (nsubsts > nsubst)
+		substwait(nsubst);
+}
+
+static void
+runfor(const struct node *n)
+{
+	/*
+	 * run a for loop:
+	 *
+	 * for [-j jobs [-k]] name [in word ...]; do list; done
+	 *
+	 * the body runs once for each word, or each positional parameter
+	 * without in, with name set to it. its status is the one of the
+	 * last time the body ran, or 0 if it never did.
+	 *
+	 * with -j, up to jobs iterations run at once, each in a forked copy
+	 * of the shell that already has the body parsed. when that many are
+	 * running, the next one starts as soon as any of them finishes, and
+	 * the status is the first non-zero one in the order of the words.
+	 * with -k the output of each one is kept in a temporary file and
+	 * written out in that order too, otherwise it's written as it comes.
+	 * then at most twice jobs iterations are started but not written
+	 * out, so a slow one holds up the rest only after that many.
+	 * break and continue only end the iteration they're in.
+	 */
+	struct command cmd, expcmd;
+	struct command *c = &cmd;
+	struct cmdinfo info;
+	struct cmdwords w;
+	const char *name;
+	char **words;
+	char *s = NULL;
+	size_t nwords, arg = 0, running = 0, done = 0, i, j;
+	pid_t *pids = NULL;
+	pid_t oldpgid = substpgid;
+	int *outs = NULL, *statuses = NULL;
+	int jobs = 0, keep = 0, didglob = 0, built = 0, stop = 0, sigfd;
+	int tail = tailpos;
+	int status = 0;
+	FILE *f;
+
+	if (n->cond->code && n->cond->code->ncmds == 1) {
+		built = 1;
+		if (cmdbuild(n->cond, &w, &cmd, &info) < 0) {
+			laststatus = lastfail = MISC_FAILURE_STATUS;
+			update_laststatus(laststatus);
+			return;
+		}
+	} else if (expand_params(n->cond->text, &s) < 0
+			|| parsecmd(s, &cmd, &info) < 0) {
+		free(s);
+		laststatus = lastfail = MISC_FAILURE_STATUS;
+		update_laststatus(laststatus);
+		return;
+	}
+	if (info.canexpandpath && (opts & OPT_GLOB)) {
+		if (expand_path(&cmd, &expcmd, &info) < 0)
+			goto fail;
+		c = &expcmd;
+		didglob = 1;
+	}
+
+	if (c->argc > 1 && !strcmp(c->argv[0], "-j")) {
+		if (xstrtoint(&jobs, c->argv[1], 10) < 0 || jobs < 1
+				|| jobs > 1024) {
+			logerr("for: invalid number of jobs '%s'", c->argv[1]);
+			goto fail;
+		}
+		arg = 2;
+		if (arg < c->argc && !strcmp(c->argv[arg], "-k")) {
+			keep = 1;
+			++arg;
+		}
+	}
+	name = (arg < c->argc) ? c->argv[arg++] : "";
+	if (!*name || isdigit((unsigned char)*name) || name[strspn(name,
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				"abcdefghijklmnopqrstuvwxyz0123456789_")]) {
+		logerr("for: invalid name '%s'", name);
+		goto fail;
+	}
+	if (arg < c->argc && strcmp(c->argv[arg], "in") != 0) {
+		logerr("for: expected 'in' instead of '%s'", c->argv[arg]);
+		goto fail;
+	}
+	if (arg < c->argc) {
+		words = c->argv + arg + 1;
+		nwords = c->argc - arg - 1;
+	} else {
+		words = curframe->argv;
+		nwords = curframe->argc;
+	}
+
+	tailpos = 0;
+	if (!jobs) {
+		++loopdepth;
+		for (i = 0; i < nwords; ++i) {
+			if (varset(name, words[i]) < 0) {
+				status = MISC_FAILURE_STATUS;
+				break;
+			}
+			runtree(n->body);
+			status = lastexit;
+			if (returning)
+				break;
+			if (loopjump && (--loopjump || !loopcontinue))
+				break;
+			loopcontinue = 0;
+			/* ^C should stop the loop along with the command */
+			if (lastexit == SIGNAL_EXITSTATUS + SIGINT)
+				break;
+		}
+		--loopdepth;
+		goto done;
+	}
+
+	if (!nwords)
+		goto done;
+	if (!(pids = wemallocarray(nwords, sizeof(pid_t)))
+			|| !(outs = wemallocarray(nwords, sizeof(int)))
+			|| !(statuses = wemallocarray(nwords, sizeof(int)))
+			|| (sigfd = sigchldopen()) < 0)
+		goto fail;
+	for (i = 0; i < nwords; ++i) {
+		/* wait for any of them to make room */
+		while (!stop && (running == (size_t)(jobs) || (keep
+						&& i - done >= 2 * (size_t)(jobs))))
+			stop = forreap(sigfd, pids, outs, statuses, i,
+					&done, &running);
+		if (stop)
+			break;
+
+		pids[i] = 0;
+		outs[i] = -1;
+		statuses[i] = 0;
+		if (keep) {
+			if (!(f = tmpfile())) {
+				logerr("tmpfile:");
+				status = MISC_FAILURE_STATUS;
+				break;
+			}
+			outs[i] = fcntl(fileno(f), F_DUPFD_CLOEXEC, 3);
+			fclose(f);
+			if (outs[i] < 0) {
+				logerr("fcntl:");
+				status = MISC_FAILURE_STATUS;
+				break;
+			}
+		}
+		fflush(stdout);
+		if ((pids[i] = shellfork()) < 0) {
+			logerr("fork:");
+			if (outs[i] >= 0)
+				close(outs[i]);
+			status = MISC_FAILURE_STATUS;
+			break;
+		} else if (pids[i] == 0) {
+			forked = 1;
+			if (term >= 0) {
+				/* all of them are in the group of the first */
+				if (joinpgrp() < 0)
+					logerr("setpgid:");
+				if (tcsetpgrp(term, getpgrp()) < 0)
+					logerr("tcsetpgrp:");
+				term = -1;
+			}
+			if (keep && dup2(outs[i], STDOUT_FILENO) < 0) {
+				logerr("dup2:");
+				_exit(MISC_FAILURE_STATUS);
+			}
+			if (varset(name, words[i]) < 0)
+				_exit(MISC_FAILURE_STATUS);
+			loopdepth = 1;
+			update_laststatus(0);
+			runtree(n->body);
+			fflush(stdout);
+			if (nsubsts)
+				substwait(0);
+			_exit(lastexit);
+		}
+		if (term >= 0) {
+			/* the child might not have gotten there yet */
+			if (substpgid < 0)
+				substpgid = pids[i];
+			setpgid(pids[i], substpgid);
+		}
+		++running;
+	}
+	/* even if starting one failed, wait for the rest */
+	while (running)
+		forreap(sigfd, pids, outs, statuses, i, &done, &running);
+	sigchldclose(sigfd);
+	for (j = 0; j < i && !status; ++j)
+		status = statuses[j];
+	if (term >= 0 && tcsetpgrp(term, shell_pgid) < 0)
+		logerr("tcsetpgrp:");
+	substpgid = oldpgid;
+
+done:
+	tailpos = tail;
+	free(pids);
+	free(outs);
+	free(statuses);
+	if (didglob)
+		freecmd(&expcmd);
+	freecmd(&cmd);
+	if (built)
+		cmdwordsfree(&w);
+	free(s);
+	laststatus = status;
+	if (status)
+		lastfail = status;
+	update_laststatus(status);
+	return;
+
+fail:
+	status = MISC_FAILURE_STATUS;
+	goto done;
+}
+
+static int
+forreap(int sigfd, pid_t *pids, int *outs, int *statuses, size_t started,
+		size_t *done, size_t *running)
+{
+	/*
+	 * wait for whichever running iteration of a for -j loop finishes
+	 * first, and write out in order what the ones that are done wrote
+	 * if it was kept. iterations before *done have been written out,
+	 * and pids of finished ones are 0. sigfd is from sigchldopen().
+	 * returns 1 if one was stopped with ^C, then no more should be
+	 * started.
+	 */
+	struct pollfd pfd;
+	size_t i;
+	int wstatus, stop = 0, block = 0, reaped = 0;
+	pid_t r;
+	char c;
+
+	pfd.fd = sigfd;
+	pfd.events = POLLIN;
+	while (!reaped) {
+		for (i = *done; i < started; ++i) {
+			if (pids[i] <= 0)
+				continue;
+			if ((r = waitpid(pids[i], &wstatus,
+							block ? 0 : WNOHANG)) == 0)
+				continue;
+			if (r < 0) {
+				logerr("waitpid:");
+				laststatus = MISC_FAILURE_STATUS;
+			} else {
+				reportstatus(wstatus);
+			}
+			statuses[i] = laststatus;
+			if (laststatus == SIGNAL_EXITSTATUS + SIGINT)
+				stop = 1;
+			pids[i] = 0;
+			--*running;
+			reaped = 1;
+			if (block)
+				break;
+		}
+		if (reaped || !*running)
+			break;
+		/* a child that exits from here on wakes this up */
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			logerr("poll:");
+			block = 1;
+		}
+		while (read(sigfd, &c, 1) > 0)
+			;
+	}
+
+	for (; *done < started && pids[*done] <= 0; ++*done) {
+		if (outs[*done] >= 0) {
+			lseek(outs[*done], 0, SEEK_SET);
+			copyfd(outs[*done], stdoutfd());
+			close(outs[*done]);
+			outs[*done] = -1;
+		}
+	}
+	return stop;
+}
+
+static void
+runloop(const struct node *n)
+{
+	/*
+	 * run a while or until loop. its status is the one of the last
+	 * command in the body, or 0 if the body never ran.
+	 */
+	int tail = tailpos;
+	int status = 0;
+
+	if (n->type == NODE_FOR) {
+		runfor(n);
+		return;
+	}
+	tailpos = 0;
+	++loopdepth;
+	for (;;) {
+		runtree(n->cond);
+		if (!returning && !loopjump && ((n->type == NODE_WHILE) ?
+					!lastexit : !!lastexit)) {
+			runtree(n->body);
+			status = lastexit;
+		} else if (!loopjump) {
+			break;
+		}
+		if (returning)
+			break;
+		if (loopjump && (--loopjump || !loopcontinue))
+			break;
+		loopcontinue = 0;
+		/* ^C should stop the loop along with the command */
+		if (lastexit == SIGNAL_EXITSTATUS + SIGINT)
+			break;
+	}
+	--loopdepth;
+	tailpos = tail;
+	update_laststatus(status);
+}
+
+static void
+runpipe(const struct node *n)
+{
+	/*
+	 * run a NODE_PIPE. every stage runs in a copy of the shell like a
+	 * ( ) subshell, so what a loop at the end of it sets isn't seen
+	 * after it, the same as for a function in a pipeline.
+	 */
+	const struct node **stages;
+	const struct node *stage;
+	int lpipe[2] = {-1, -1}, rpipe[2];
+	pid_t *pids, pgid = -1;
+	int *statuses;
+	size_t nstages = 1, i, j;
+
+	for (stage = n; stage->type == NODE_PIPE; stage = stage->cond)
+		++nstages;
+	stages = wemallocarray(nstages, sizeof(*stages));
+	pids = wemallocarray(nstages, sizeof(pid_t));
+	statuses = wemallocarray(nstages, sizeof(int));
+	if (!stages || !pids || !statuses) {
+		free(stages);
+		free(pids);
+		free(statuses);
+		laststatus = lastfail = MISC_FAILURE_STATUS;
+		update_laststatus(laststatus);
+		return;
+	}
+	for (i = nstages, stage = n; stage->type == NODE_PIPE;
+			stage = stage->cond)
+		stages[--i] = stage->body;
+	stages[0] = stage;
+
+	fflush(stdout);
+	for (j = 0; j < nstages; ++j) {
+		if (j + 1 < nstages && makepipe(rpipe) < 0)
+			break;
+		switch ((pids[j] = shellfork())) {
+		case -1:
+			logerr("fork:");
+			if (j + 1 < nstages) {
+				weclose(rpipe[0]);
+				weclose(rpipe[1]);
+			}
+			break;
+		case 0:
+			forked = 1;
+			if (term >= 0) {
+				if ((j ? setpgid(0, pgid) : joinpgrp()) < 0) {
+					logerr("setpgid:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+				if (!j && tcsetpgrp(term, getpgrp()) < 0) {
+					logerr("tcsetpgrp:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+				/* commands in the stage stay in its group */
+				term = -1;
+			}
+			if (j) {
+				if (dup2(lpipe[0], STDIN_FILENO) < 0) {
+					logerr("dup2:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+				if (weclose(lpipe[0]) < 0
+						|| weclose(lpipe[1]) < 0)
+					_exit(MISC_FAILURE_STATUS);
+			}
+			if (j + 1 < nstages) {
+				if (dup2(rpipe[1], STDOUT_FILENO) < 0) {
+					logerr("dup2:");
+					_exit(MISC_FAILURE_STATUS);
+				}
+				if (weclose(rpipe[0]) < 0
+						|| weclose(rpipe[1]) < 0)
+					_exit(MISC_FAILURE_STATUS);
+			}
+			/* its last command can replace the copy */
+			tailpos = 1;
+			update_laststatus(0);
+			runtree(stages[j]);
+			fflush(stdout);
+			if (nsubsts)
+				substwait(0);
+			_exit(lastexit);
+		default:
+			/* the child may not be in its group yet */
+			if (term >= 0) {
+				if (!j)
+					pgid = (substpgid > 0) ? substpgid
+						: pids[j];
+				setpgid(pids[j], pgid);
+			}
+		}
+		if (pids[j] < 0)
+			break;
+		if (j) {
+			weclose(lpipe[0]);
+			weclose(lpipe[1]);
+		}
+		/* the output pipe becomes the input of the next one */
+		lpipe[0] = rpipe[0];
+		lpipe[1] = rpipe[1];
+	}
+	if (j < nstages && j > 0) {
+		/* let the ones that were started see the end of the pipe */
+		weclose(lpipe[0]);
+		weclose(lpipe[1]);
+	}
+	for (i = 0; i < j; ++i) {
+		report(pids[i]);
+		statuses[i] = laststatus;
+	}
+	free(stages);
+	free(pids);
+
+	/* put ourselves back into the foreground */
+	if (term >= 0 && tcsetpgrp(term, shell_pgid) < 0)
+		logerr("tcsetpgrp:");
+	if (j < nstages) {
+		free(statuses);
+		laststatus = lastfail = MISC_FAILURE_STATUS;
+		update_laststatus(laststatus);
+		return;
+	}
+	if (opts & OPT_PIPEFAIL) {
+		update_laststatus(lastfail);
+		lastfail = 0;
+	} else {
+		update_laststatus(laststatus);
+	}
+	free(pipestatus);
+	pipestatus = statuses;
+	npipestatus = nstages;
+}
+
+static void
+runsubshell(const struct node *n)
+{
+	/*
+	 * run a ( ) subshell. the child already has the parsed tree, so
+	 * it runs it directly instead of executing a new shell. if the
+	 * shell would exit right after it, it's run without forking.
+	 */
+	struct command cmd;
+	struct cmdinfo info;
+	pid_t chpid;
+	char *s;
+	int inplace;
+
+	fflush(stdout);
+	inplace = tailpos && !tracering;
+	switch ((chpid = inplace ? 0 : shellfork())) {
+	case -1:
+		logerr("fork:");
+		laststatus = lastfail = MISC_FAILURE_STATUS;
+		update_laststatus(laststatus);
+		break;
+	case 0:
+		forked = 1;
+		if (term >= 0 && !inplace) {
+			if (setpgid(0, 0) < 0) {
+				logerr("setpgid:");
+				_exit(MISC_FAILURE_STATUS);
+			}
+			if (tcsetpgrp(term, getpgrp()) < 0) {
+				logerr("tcsetpgrp:");
+				_exit(MISC_FAILURE_STATUS);
+			}
+			/* commands in the subshell stay in its group */
+			term = -1;
+		}
+		if (n->text) {
+			if (groupredir(n->text, &s, &cmd, &info) < 0)
+				_exit(MISC_FAILURE_STATUS);
+			if (applyredirs(&info) < 0)
+				_exit(MISC_FAILURE_STATUS);
+			if (info.noutfds)
+				fanout(&info, -1);
+			closeredirs(&info);
+		}
+		update_laststatus(0);
+		runtree(n->body);
+		fflush(stdout);
+		if (nsubsts)
+			substwait(0);
+		_exit(lastexit);
+	default:
+		report(chpid);
+
+		/* put ourselves back into the foreground */
+		if (term >= 0)
+			if (tcsetpgrp(term, shell_pgid) < 0)
+				logerr("tcsetpgrp:");
+
+		update_laststatus(laststatus);
+	}
+}
+
+static void
+runtree(const struct node *n)
+{
+	/*
+	 * tailpos is kept set only while running the last command of a
+	 * list in tail position, never while running a condition
+	 */
+	char *s = NULL, *subst = NULL;
+	size_t nsubst = nsubsts;
+	int tail = tailpos;
+
+	for (; n && !returning && !loopjump; n = n->next) {
+		tailpos = tail && !n->next;
+		switch (n->type) {
+		case NODE_CMD:
+			/*
+			 * exec() splits the string in place, so the expanded
+			 * copy is given to it and the tree stays intact for
+			 * the next run. what cmdcompile() split already only
+			 * needs its parameters expanded.
+			 */
+			if (n->code ? cmdrun(n) < 0
+					: (expand_procsubst(n->text, &subst) < 0
+					|| expand_params(subst ? subst
+						: n->text, &s) < 0
+					|| exec(s) < 0)) {
+				laststatus = lastfail = MISC_FAILURE_STATUS;
+				update_laststatus(laststatus);
+			}
+			free(subst);
+			free(s);
+			subst = s = NULL;
+			if (nsubsts > nsubst)
+				substwait(nsubst);
+			break;
+		case NODE_COND:
+			laststatus = condrun(n->text);
+			if (laststatus > 0)
+				lastfail = laststatus;
+			update_laststatus(laststatus);
+			break;
+		case NODE_AND:
+		case NODE_OR:
+			tailpos = 0;
+			runtree(n->cond);
+			tailpos = tail && !n->next;
+			if (!returning && !loopjump
+					&& ((n->type == NODE_AND) ? !lastexit
+						: !!lastexit))
+				runtree(n->body);
+			break;
+		case NODE_IF:
+			tailpos = 0;
+			runtree(n->cond);
+			tailpos = tail && !n->next;
+			if (returning || loopjump)
+				break;
+			if (!lastexit)
+				runtree(n->body);
+			else if (n->alt)
+				runtree(n->alt);
+			else
+				update_laststatus(0);
+			break;
+		case NODE_GROUP:
+		case NODE_WHILE:
+		case NODE_UNTIL:
+		case NODE_FOR:
+			rungroup(n);
+			break;
+		case NODE_SUBSHELL:
+			runsubshell(n);
+			break;
+		case NODE_PIPE:
+			runpipe(n);
+			break;
+		case NODE_FUNC:
+			if (funcdefine(n->text, n->body) < 0) {
+				laststatus = lastfail = MISC_FAILURE_STATUS;
+				update_laststatus(laststatus);
+			} else {
+				update_laststatus(0);
+			}
+			break;
+		}
+	}
+	tailpos = tail;
+}
+
+static int
+takecmd(const char *s, int last)
+{
+	/*
+	 * returns 1 without running anything if s ends in the middle of a
+	 * command (e.g a function definition spanning multiple lines) and
+	 * more input is needed, 0 otherwise. if last is 1, nothing will be
+	 * run after s and its last command can replace the shell.
+	 */
+	struct node *tree;
+	int64_t t = (tracefd >= 0) ? traceclock() : 0;
+	int ret = parsetree(s, &tree);
+
+	if (tracefd >= 0)
+		tracespan("parse", t, s, 0, 0, -1);
+	if (ret > 0)
+		return 1;
+
+	if (opts & OPT_VERBOSE) {
+		fputs(s, stderr);
+		/* print a trailing newline if we didn't print one already */
+		if (s[0] && s[strlen(s) - 1] != '\n')
+			putc('\n', stderr);
+	}
+
+	if (ret < 0) {
+		laststatus = lastfail = MISC_FAILURE_STATUS;
+		update_laststatus(laststatus);
+		return 0;
+	}
+	tailpos = last;
+	runtree(tree);
+	tailpos = 0;
+	freetree(tree);
+	return 0;
+}
+
+static void
+update_laststatus(int status)
+{
+	/*
+	 * the prompt is rendered from this when it is next shown, so
+	 * there's nothing to allocate here. pipeline() sets PIPESTATUS
+	 * after this, for anything else it's just the status.
+	 */
+	lastexit = status;
+	npipestatus = 0;
+}
+
+/*
+ * ===========================================================================
+ * execution tracing functions
+ */
+static int64_t
+traceclock(void)
+{
+	/* microseconds on a clock that's the same for all processes */
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+tracejson(char **buf, size_t *size, size_t *len, const char *s)
+{
+	/* append s as a JSON string */
+	char esc[8];
+	int ret = strappend(buf, size, len, "\"", 1);
+
+	for (; s && *s && !ret; ++s) {
+		if (*s == '"' || *s == '\\') {
+			esc[0] = '\\';
+			esc[1] = *s;
+			ret = strappend(buf, size, len, esc, 2);
+		} else if ((unsigned char)(*s) < 0x20) {
+			sprintf(esc, "\\u%04x", (unsigned int)(*s));
+			ret = strappend(buf, size, len, esc, 6);
+		} else {
+			ret = strappend(buf, size, len, s, 1);
+		}
+	}
+	return ret ? ret : strappend(buf, size, len, "\"", 1);
+}
+
+static void
+tracespan(const char *name, int64_t start, const char *cmd, pid_t pid,
+		pid_t pgid, int stage)
+{
+	/*
+	 * write an event for set -o tracefile=PATH that started at start
+	 * and ends now, in the Chrome trace event format that trace viewers
+	 * like Perfetto read. it's shown in the timeline of the process
+	 * that wrote it and tagged with the command, the process it's about
+	 * if pid isn't 0, its process group and its place in the pipeline if
+	 * stage isn't -1.
+	 *
+	 * each event is one write() to a file opened with O_APPEND, so the
+	 * ones written by forked children don't get mixed up. the array
+	 * isn't closed, which trace viewers allow.
+	 */
+	static char *buf = NULL;
+	static size_t size = 0;
+	int64_t now = traceclock();
+	char num[64];
+	size_t len = 0;
+	int ret;
+
+	ret = strappend(&buf, &size, &len, "{\"name\":", 8);
+	if (!ret)
+		ret = tracejson(&buf, &size, &len, name);
+	if (!ret)
+		ret = strappend(&buf, &size, &len, ",\"ph\":\"X\",\"ts\":", 15);
+	if (!ret) {
+		arithfmt(start, num);
+		ret = strappend(&buf, &size, &len, num, strlen(num));
+	}
+	if (!ret)
+		ret = strappend(&buf, &size, &len, ",\"dur\":", 7);
+	if (!ret) {
+		arithfmt(now - start, num);
+		ret = strappend(&buf, &size, &len, num, strlen(num));
+	}
+	if (!ret) {
+		sprintf(num, ",\"pid\":%ld", (long)(getpid()));
+		ret = strappend(&buf, &size, &len, num, strlen(num));
+	}
+	if (!ret) {
+		sprintf(num, ",\"tid\":%ld", (long)(getpid()));
+		ret = strappend(&buf, &size, &len, num, strlen(num));
+	}
+	if (!ret)
+		ret = strappend(&buf, &size, &len, ",\"args\":{\"cmd\":", 15);
+	if (!ret)
+		ret = tracejson(&buf, &size, &len, cmd);
+	if (!ret && pid) {
+		sprintf(num, ",\"pid\":%ld,\"pgid\":%ld", (long)(pid),
+				(long)(pgid));
+		ret = strappend(&buf, &size, &len, num, strlen(num));
+	}
+	if (!ret && stage >= 0) {
+		sprintf(num, ",\"stage\":%d", stage);
+		ret = strappend(&buf, &size, &len, num, strlen(num));
+	}
+	if (!ret)
+		ret = strappend(&buf, &size, &len, "}},\n", 4);
+	if (!ret && write(tracefd, buf, len) < 0) {
+		logerr("write '%s':", tracepath);
+		close(tracefd);
+		tracefd = -1;
+	}
+}
+
+static void
+xtrace(const struct command *cmd, const struct cmdinfo *info)
+{
+	/*
+	 * print a command as it's run after expansion for set -x, after
+	 * $PS4 ("+ " if unset), in which %t is the time since the shell
+	 * started and %% is a %. the record goes to stderr with a single
+	 * write, or into the trace buffer if there's one.
+	 */
+	static char *buf = NULL;
+	static size_t size = 0;
+	const char *ps4 = varget("PS4");
+	struct timespec now;
+	char num[64];
+	size_t len = 0, i, n;
+	int ret = 0;
+
+	if (!ps4)
+		ps4 = "+ ";
+	if (strappend(&buf, &size, &len, "", 0) < 0)
+		return;
+	for (; *ps4 && !ret; ++ps4) {
+		if (ps4[0] == '%' && ps4[1] == 't') {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			now.tv_sec -= shellstart.tv_sec;
+			if ((now.tv_nsec -= shellstart.tv_nsec) < 0) {
+				--now.tv_sec;
+				now.tv_nsec += 1000000000;
+			}
+			sprintf(num, "%ld.%06ld", (long)(now.tv_sec),
+					(long)(now.tv_nsec / 1000));
+			ret = strappend(&buf, &size, &len, num, strlen(num));
+			++ps4;
+		} else {
+			if (ps4[0] == '%' && ps4[1] == '%')
+				++ps4;
+			ret = strappend(&buf, &size, &len, ps4, 1);
+		}
+	}
+	for (i = 0; !ret && info->vars && info->vars[i]; ++i) {
+		if (i)
+			ret = strappend(&buf, &size, &len, " ", 1);
+		if (!ret)
+			ret = strappend(&buf, &size, &len, info->vars[i],
+					strlen(info->vars[i]));
+		if (!ret)
+			ret = strappend(&buf, &size, &len, "=", 1);
+		if (!ret)
+			ret = xtracequote(&buf, &size, &len, info->vals[i]);
+	}
+	for (i = 0; !ret && i < cmd->argc; ++i) {
+		if (i || (info->vars && info->vars[0]))
+			ret = strappend(&buf, &size, &len, " ", 1);
+		if (!ret)
+			ret = xtracequote(&buf, &size, &len, cmd->argv[i]);
+	}
+	if (ret || strappend(&buf, &size, &len, "\n", 1) < 0)
+		return;
+
+	if (!tracering) {
+		fwrite(buf, 1, len, stderr);
+		return;
+	}
+	/* only the end of a record that doesn't fit is kept */
+	if (len > tracesize) {
+		memmove(buf, buf + len - tracesize, tracesize);
+		len = tracesize;
+	}
+	n = (len < tracesize - tracepos) ? len : tracesize - tracepos;
+	memcpy(tracering + tracepos, buf, n);
+	memcpy(tracering, buf + n, len - n);
+	if (tracepos + len >= tracesize)
+		tracewrapped = 1;
+	tracepos = (tracepos + len) % tracesize;
+}
+
+static void
+xtracedump(struct sink *out)
+{
+	/*
+	 * print the records in the trace buffer, oldest first, and empty
+	 * it. once it has wrapped around, the oldest record was partly
+	 * overwritten, so it's skipped.
+	 */
+	const char *nl;
+	size_t start = 0;
+
+	if (tracewrapped) {
+		nl = memchr(tracering + tracepos, '\n',
+				tracesize - tracepos);
+		if (nl) {
+			start = (size_t)(nl - tracering) + 1;
+			sinkwrite(out, tracering + start, tracesize - start);
+			start = 0;
+		} else if ((nl = memchr(tracering, '\n', tracepos))) {
+			start = (size_t)(nl - tracering) + 1;
+		} else {
+			start = tracepos;
+		}
+	}
+	sinkwrite(out, tracering + start, tracepos - start);
+	tracepos = 0;
+	tracewrapped = 0;
+}
+
+static int
+xtracequote(char **buf, size_t *size, size_t *len, const char *s)
+{
+	/* append s, in single quotes if it wouldn't be read back as is */
+	const char *p;
+
+	for (p = s; *p; ++p)
+		if (!isalnum((unsigned char)(*p)) && !strchr("%+,-./:=@_", *p))
+			break;
+	if (*s && !*p)
+		return strappend(buf, size, len, s, (size_t)(p - s));
+
+	if (strappend(buf, size, len, "'", 1) < 0)
+		return -1;
+	for (; *s; ++s) {
+		if (*s == '\'' ? strappend(buf, size, len, "'\\''", 4) < 0
+				: strappend(buf, size, len, s, 1) < 0)
+			return -1;
+	}
+	return strappend(buf, size, len, "'", 1);
+}
+
+/*
+ * ===========================================================================
+ * prompt functions
+ */
+#if !defined(SUSHI_LIBRARY)
+static int
+promptcollect(struct promptseg *seg)
+{
+	/*
+	 * read whatever the segment command has written so far. returns 1
+	 * if the command finished and the cached value was replaced, 0 if
+	 * it is still running and -1 on error.
+	 */
+	char scratch[PROMPT_SEGMENT_MAX];
+	ssize_t n;
+	char *val;
+
+	for (;;) {
+		if (seg->buflen < sizeof(seg->buf) - 1)
+			n = read(seg->fd, seg->buf + seg->buflen,
+					sizeof(seg->buf) - 1 - seg->buflen);
+		else /* throw away anything past the limit */
+			n = read(seg->fd, scratch, sizeof(scratch));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			logerr("read:");
+			break;
+		} else if (n == 0) {
+			break;
+		} else if (seg->buflen < sizeof(seg->buf) - 1) {
+			seg->buflen += (size_t)(n);
+		}
+	}
+
+	weclose(seg->fd);
+	waitpid(seg->pid, NULL, 0);
+	seg->fd = -1;
+	seg->pid = -1;
+
+	seg->buf[seg->buflen] = '\0';
+	seg->buf[strcspn(seg->buf, "\n")] = '\0';
+	if (!(val = westrdup(seg->buf)))
+		return -1;
+	free(seg->val);
+	seg->val = val;
+	return 1;
+}
+
+#endif /* !SUSHI_LIBRARY */
+static const char *
+promptcwd(void)
+{
+	static char *cwd = NULL;
+	static size_t cwdsize = 0;
+
+	for (;;) {
+		char *newcwd;
+		if (cwd && getcwd(cwd, cwdsize))
+			return cwd;
+		if (cwd && errno != ERANGE)
+			return NULL;
+		cwdsize = cwdsize ? cwdsize * 2 : 256;
+		if (!(newcwd = werealloc(cwd, cwdsize)))
+			return NULL;
+		cwd = newcwd;
+	}
+}
+
+#if !defined(SUSHI_LIBRARY)
+static struct promptseg *
+promptlookup(const char *cmd, size_t len, const char *dir)
+{
+	/*
+	 * values are cached per directory, so that going back to a
+	 * directory shows its old value right away while a new one is
+	 * being computed. the most recently used come first.
+	 */
+	struct promptseg **prev, **idle = NULL;
+	struct promptseg *seg;
+	size_t n = 0;
+
+	for (prev = &promptsegs; (seg = *prev); prev = &seg->next, ++n) {
+		if (!strncmp(seg->cmd, cmd, len) && !seg->cmd[len]
+				&& !strcmp(seg->dir, dir)) {
+			*prev = seg->next;
+			seg->next = promptsegs;
+			promptsegs = seg;
+			return seg;
+		}
+		if (seg->pid < 0)
+			idle = prev;
+	}
+	if (n >= PROMPT_SEGMENTS_MAX && idle) {
+		/* forget the least recently used one that isn't running */
+		seg = *idle;
+		*idle = seg->next;
+		free(seg->cmd);
+		free(seg->dir);
+		free(seg->val);
+		free(seg);
+	}
+
+	if (!(seg = wemalloc(sizeof(*seg))))
+		return NULL;
+	if (!(seg->cmd = westrndup(cmd, len))) {
+		free(seg);
+		return NULL;
+	}
+	if (!(seg->dir = westrdup(dir))) {
+		free(seg->cmd);
+		free(seg);
+		return NULL;
+	}
+	seg->val = NULL;
+	seg->buflen = 0;
+	seg->pid = -1;
+	seg->fd = -1;
+	seg->next = promptsegs;
+	promptsegs = seg;
+	return seg;
+}
+
+static void
+promptrefresh(void)
+{
+	/*
+	 * start recomputing every %(command) segment of the prompt in the
+	 * background. the cached values keep being shown until the new
+	 * ones arrive.
+	 */
+	const char *fmt = promptfmt ? promptfmt : defaultprompt;
+	const char *cwd = promptcwd();
+	const char *end;
+	int depth;
+
+	if (!cwd)
+		return;
+	for (; *fmt; ++fmt) {
+		if (fmt[0] != '%' || fmt[1] != '(')
+			continue;
+		depth = 0;
+		for (end = fmt + 1; *end; ++end) {
+			if (*end == '(')
+				++depth;
+			else if (*end == ')' && !--depth)
+				break;
+		}
+		if (*end) {
+			struct promptseg *seg = promptlookup(fmt + 2,
+					(size_t)(end - fmt - 2), cwd);
+			if (seg && seg->pid < 0)
+				promptspawn(seg);
+			fmt = end;
+		}
+	}
+}
+
+static int
+promptrender(char **buf, size_t *size)
+{
+	/*
+	 * supported sequences in the prompt format:
+	 *
+	 * %d       the current directory, with $HOME shortened to ~
+	 * %s       the exit status of the last command
+	 * %e       the exit status and a space if it was non-zero
+	 * %t       how long the last command took to run
+	 * %(cmd)   the first line of the output of cmd, computed in the
+	 *          background. a cached or placeholder value is used
+	 *          until the command is done.
+	 * %%       a literal %
+	 *
+	 * this never blocks or forks, so it can be called any time.
+	 */
+	const char *fmt = promptfmt ? promptfmt : defaultprompt;
+	const char *cwd = NULL;
+	const char *end;
+	char num[64];
+	size_t len = 0;
+	int depth;
+
+	if (strappend(buf, size, &len, "", 0) < 0)
+		return -1;
+	for (; *fmt; ++fmt) {
+		int ret = 0;
+		if (*fmt != '%' || !fmt[1]) {
+			ret = strappend(buf, size, &len, fmt, 1);
+		} else switch (*++fmt) {
+		case 'd':
+			if (cwd || (cwd = promptcwd())) {
+				const char *home = getenv("HOME");
+				size_t homelen = home ? strlen(home) : 0;
+				if (homelen > 1 && !strncmp(cwd, home, homelen)
+						&& (cwd[homelen] == '/'
+						|| !cwd[homelen])) {
+					ret = strappend(buf, size, &len,
+							"~", 1);
+					cwd += homelen;
+				}
+				if (!ret)
+					ret = strappend(buf, size, &len,
+							cwd, strlen(cwd));
+				cwd = NULL;
+			}
+			break;
+		case 's':
+		case 'e':
+			if (*fmt == 's' || lastexit > 0) {
+				sprintf(num, (*fmt == 's') ? "%d" : "%d ",
+						lastexit);
+				ret = strappend(buf, size, &len, num,
+						strlen(num));
+			}
+			break;
+		case 't':
+			if (lastduration < 0)
+				break;
+			else if (lastduration < 1000)
+				sprintf(num, "%ldms", lastduration);
+			else if (lastduration < 60000)
+				sprintf(num, "%ld.%02lds", lastduration / 1000,
+						lastduration % 1000 / 10);
+			else
+				sprintf(num, "%ldm%lds", lastduration / 60000,
+						lastduration % 60000 / 1000);
+			ret = strappend(buf, size, &len, num, strlen(num));
+			break;
+		case '(':
+			depth = 1;
+			for (end = fmt + 1; *end; ++end) {
+				if (*end == '(')
+					++depth;
+				else if (*end == ')' && !--depth)
+					break;
+			}
+			if (!*end) {
+				ret = strappend(buf, size, &len, fmt - 1, 2);
+			} else {
+				struct promptseg *seg = NULL;
+				if ((cwd = promptcwd()))
+					seg = promptlookup(fmt + 1,
+						(size_t)(end - fmt - 1), cwd);
+				cwd = NULL;
+				if (seg && seg->val)
+					ret = strappend(buf, size, &len,
+							seg->val,
+							strlen(seg->val));
+				else
+					ret = strappend(buf, size, &len,
+						promptplaceholder,
+						sizeof(promptplaceholder) - 1);
+				fmt = end;
+			}
+			break;
+		case '%':
+			ret = strappend(buf, size, &len, "%", 1);
+			break;
+		default:
+			ret = strappend(buf, size, &len, fmt - 1, 2);
+		}
+		if (ret < 0)
+			return -1;
+	}
+	return 0;
+}
+
+#endif /* !SUSHI_LIBRARY */
+static void
+promptset(const char *fmt)
+{
+	char *newfmt = NULL;
+	if (strcmp(fmt, defaultprompt) != 0 && !(newfmt = westrdup(fmt)))
+		return;
+	free(promptfmt);
+	promptfmt = newfmt;
+}
+
+#if !defined(SUSHI_LIBRARY)
+static void
+promptspawn(struct promptseg *seg)
+{
+	int p[2];
+	int devnull;
+	pid_t pid;
+
+	if (pipe(p) < 0) {
+		logerr("pipe:");
+		return;
+	}
+	fflush(stdout);
+	switch ((pid = shellfork())) {
+	case -1:
+		logerr("fork:");
+		weclose(p[0]);
+		weclose(p[1]);
+		return;
+	case 0:
+		/*
+		 * run the command in this already initialized shell instead
+		 * of starting a new one, away from the terminal so that it
+		 * can't steal the foreground or read the user's input.
+		 */
+		setpgid(0, 0);
+		term = -1;
+		forked = 1;
+		opts &= ~(OPT_VERBOSE | OPT_XTRACE);
+		if (dup2(p[1], STDOUT_FILENO) < 0)
+			_exit(MISC_FAILURE_STATUS);
+		close(p[0]);
+		close(p[1]);
+		if ((devnull = open("/dev/null", O_RDWR)) >= 0) {
+			dup2(devnull, STDIN_FILENO);
+			dup2(devnull, STDERR_FILENO);
+			if (devnull > STDERR_FILENO)
+				close(devnull);
+		}
+		if (chdir(seg->dir) == 0)
+			takecmd(seg->cmd, 1);
+		fflush(stdout);
+		_exit(laststatus);
+	default:
+		weclose(p[1]);
+		fcntl(p[0], F_SETFL, fcntl(p[0], F_GETFL) | O_NONBLOCK);
+		seg->fd = p[0];
+		seg->pid = pid;
+		seg->buflen = 0;
+	}
+}
+
+static void
+promptwait(FILE *input)
+{
+	/*
+	 * wait until there is input to read, picking up the results of
+	 * prompt segments that finish in the meantime and redrawing the
+	 * prompt with them. the terminal is left as it is and nothing is
+	 * read, so what is typed meanwhile is edited and read as usual.
+	 * the prompt isn't redrawn once input is waiting, but a terminal
+	 * only has input once a whole line has been typed, so a redraw
+	 * can still draw over part of a line being typed.
+	 */
+	struct pollfd *fds = NULL;
+	struct promptseg *seg;
+	char *newprompt = NULL;
+	const char *nl;
+	size_t newsize = 0;
+	size_t n, i, start;
+	int changed;
+
+	for (;;) {
+		n = 1;
+		for (seg = promptsegs; seg; seg = seg->next)
+			if (seg->fd >= 0)
+				++n;
+		if (n == 1)
+			break;
+
+		free(fds);
+		if (!(fds = wemallocarray(n, sizeof(*fds))))
+			break;
+		fds[0].fd = fileno(input);
+		fds[0].events = POLLIN;
+		i = 1;
+		for (seg = promptsegs; seg; seg = seg->next) {
+			if (seg->fd >= 0) {
+				fds[i].fd = seg->fd;
+				fds[i++].events = POLLIN;
+			}
+		}
+		if (poll(fds, (nfds_t)(n), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			logerr("poll:");
+			break;
+		}
+		/* the rest stays with the input for getline() */
+		if (fds[0].revents)
+			break;
+
+		changed = 0;
+		for (seg = promptsegs; seg; seg = seg->next) {
+			for (i = 1; i < n; ++i)
+				if (fds[i].fd == seg->fd && fds[i].revents)
+					break;
+			if (i < n && promptcollect(seg) > 0)
+				changed = 1;
+		}
+		if (!changed || !prompt
+				|| promptrender(&newprompt, &newsize) < 0
+				|| !strcmp(newprompt, prompt))
+			continue;
+		/*
+		 * only the line the cursor is on can be drawn over, the
+		 * lines of the prompt before it have to stay the same
+		 */
+		nl = strrchr(prompt, '\n');
+		start = nl ? (size_t)(nl - prompt + 1) : 0;
+		if (!strncmp(prompt, newprompt, start)
+				&& !strchr(newprompt + start, '\n')) {
+			/*
+			 * go back to the start of the line and draw over
+			 * the old prompt, blanking out whatever is left of
+			 * it if the new one is shorter
+			 */
+			size_t oldlen = strlen(prompt);
+			size_t newlen = strlen(newprompt);
+			char *tmp = prompt;
+			size_t tmpsize = promptsize;
+			putc('\r', stderr);
+			fputs(newprompt + start, stderr);
+			for (i = newlen; i < oldlen; ++i)
+				putc(' ', stderr);
+			for (i = newlen; i < oldlen; ++i)
+				putc('\b', stderr);
+			prompt = newprompt;
+			promptsize = newsize;
+			newprompt = tmp;
+			newsize = tmpsize;
+		}
+	}
+	free(fds);
+	free(newprompt);
+}
+#endif /* !SUSHI_LIBRARY */
+
+/*
+ * ===========================================================================
+ * command parsing functions
+ */
+static struct cmdpart *
+cmdaddpart(struct cmdcode *c, size_t *size, enum partkind kind)
+{
+	struct cmdpart *part;
+
+	if (c->nparts >= *size) {
+		*size = *size ? *size * 2 : ARGV_ALLOC_SIZE;
+		if (!(part = wereallocarray(c->parts, *size, sizeof(*part))))
+			return NULL;
+		c->parts = part;
+	}
+	part = &c->parts[c->nparts++];
+	part->kind = kind;
+	part->off = part->len = part->closelen = 0;
+	part->quote = '\0';
+	return part;
+}
+
+static struct cmdcode *
+cmdcompile(const char *s)
+{
+	/*
+	 * split the text of a NODE_CMD into words the way expand_params(),
+	 * exec() and parsecmd() would, so that running it again only has
+	 * to expand its parameters and start its process substitutions.
+	 * NULL is returned for syntax errors, which are left to the text
+	 * path to report when it's run.
+	 *
+	 * literal text is kept apart from what was quoted or escaped,
+	 * since only unquoted literal text can be a redirection, an
+	 * assignment, a tilde or a pattern, see cmdendword().
+	 */
+	struct cmdcode *c;
+	struct cmdpart *part = NULL;
+	const char *p, *end, *name, *nameend, *plainend = NULL;
+	size_t size = 0, litsize = 0, litlen = 0, closelen;
+	char quote = '\0', endquote, lit;
+	int empty = 1; /* the current command of the pipeline is empty */
+	int depth;
+
+	if (strchr(s, '\n') || !(c = wemalloc(sizeof(*c))))
+		return NULL;
+	c->parts = NULL;
+	c->nparts = 0;
+	c->ncmds = 1;
+	c->lits = NULL;
+	for (p = s; *p; ++p) {
+		lit = quote;
+		if (*p == '$' && quote != '\'') {
+			switch (scanparam(p, &name, &nameend, &closelen)) {
+			case -1:
+				goto fail;
+			case 1:
+				if (!(part = cmdaddpart(c, &size, PART_PARAM)))
+					goto fail;
+				part->off = (size_t)(name - s);
+				part->len = (size_t)(nameend - name);
+				part->closelen = closelen;
+				part->quote = quote;
+				p = nameend + closelen - 1;
+				empty = 0;
+				continue;
+			}
+		} else if (quote && *p == quote) {
+			quote = '\0';
+			continue;
+		} else if (quote) {
+			if (*p == '\\' && !*++p)
+				goto fail;
+		} else if (*p == '\\') {
+			if (!*++p)
+				goto fail;
+			lit = '\\';
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+			if (!(part = cmdaddpart(c, &size, PART_QUOTE)))
+				goto fail;
+			empty = 0;
+			continue;
+		} else if (*p == ' ') {
+			if ((!part || part->kind != PART_WORD)
+					&& !(part = cmdaddpart(c, &size,
+							PART_WORD)))
+				goto fail;
+			continue;
+		} else if (*p == '|' && (p == s || p[-1] != '>'
+					|| plainend != p)) {
+			/* an unquoted > right before it makes it >| */
+			if (empty)
+				goto fail;
+			if (!(part = cmdaddpart(c, &size, PART_PIPE)))
+				goto fail;
+			++c->ncmds;
+			empty = 1;
+			continue;
+		} else if ((*p == '<' || *p == '>') && p[1] == '('
+				&& (p == s || p[-1] == ' ' || p[-1] == '\t')) {
+			/* a process substitution, see expand_procsubst() */
+			endquote = '\0';
+			depth = 0;
+			for (end = p + 2; *end; ++end) {
+				if (*end == '\\' && end[1])
+					++end;
+				else if (endquote && *end == endquote)
+					endquote = '\0';
+				else if (endquote)
+					continue;
+				else if (*end == '\'' || *end == '"')
+					endquote = *end;
+				else if (*end == '(')
+					++depth;
+				else if (*end == ')' && !depth--)
+					break;
+			}
+			if (!*end || !(part = cmdaddpart(c, &size,
+							PART_SUBST)))
+				goto fail;
+			part->off = (size_t)(p + 2 - s);
+			part->len = (size_t)(end - p - 2);
+			part->quote = *p;
+			p = end;
+			empty = 0;
+			continue;
+		}
+
+		/*
+		 * a literal character, added to the one before if it's
+		 * just as quoted
+		 */
+		if (strappend(&c->lits, &litsize, &litlen, p, 1) < 0)
+			goto fail;
+		if (!part || part->kind != PART_LIT || !part->quote != !lit) {
+			if (!(part = cmdaddpart(c, &size, PART_LIT)))
+				goto fail;
+			part->off = litlen - 1;
+			part->quote = lit;
+		}
+		++part->len;
+		if (!lit)
+			plainend = p + 1;
+		empty = 0;
+	}
+	if (quote || empty)
+		goto fail;
+	return c;
+
+fail:
+	cmdfree(c);
+	return NULL;
+}
+
+static int
+parsecmd(char *s, struct command *cmd, struct cmdinfo *info)
+{
+	int canexpandpath = !!(strpbrk(s, "?*["));
+	info->plain = NULL;
+	s[strcspn(s, "\n")] = '\0';
+	if (!strpbrk(s, " '\"\\")) {
+		/*
+		 * the string has no separators or quotes to remove, put
+		 * everything into argv[0]
+		 */
+		if (alloccmd(2, cmd) < 0)
+			return -1;
+		cmd->argv[0] = s;
+		cmd->dynallocinfo[0] = 0;
+		cmd->argv[1] = NULL;
+		cmd->dynallocinfo[1] = -1;
+		cmd->argc = 1;
+		info->canexpandpath = canexpandpath;
+		info->globstart = info->globend = 0;
+		return 0;
+	} else {
+		char *ptr = s;
+		char *end = s + strlen(s);
+		char *prev_start = s;
+
+		/*
+		 * this variable is set to the character representing
+		 * the delimiter between tokens, e.g
+		 *
+		 * with delim = ' ', "one 'two three'" will be split as
+		 * {"one", "'two", "three'"}
+		 * with delim = '\'', that same string will be split as
+		 * {"one", "two three"}
+		 */
+		char delim = ' ';
+		int searching = 0;
+		int quoted = 0; /* the current token had quotes in it */
+
+		size_t currsize = ARGV_ALLOC_SIZE;
+		size_t i = 0;
+
+		char *tilde_exp;
+		int tilde_dynalloc;
+
+		if (alloccmd(ARGV_ALLOC_SIZE, cmd) < 0)
+			return -1;
+
+		/*
+		 * loop until we can't find any more separators or are
+		 * at the end of the string
+		 */
+		while (ptr && ptr < end) {
+			if (*ptr == '\\') {
+				/*
+				 * remove the \ character and pretend that
+				 * the next char doesn't exist by going
+				 * over it
+				 */
+				popchar(ptr++);
+			} else if (*ptr == delim && delim != ' ') {
+				/*
+				 * stop searching for closing quote, the
+				 * token goes on after it
+				 */
+				searching = 0;
+				delim = ' ';
+				popchar(ptr);
+			} else if (*ptr == delim) {
+				*ptr = '\0';
+				if (ptr == prev_start && !quoted) {
+					/* skip over runs of spaces */
+					prev_start = ++ptr;
+					continue;
+				}
+				if (i >= currsize) {
+					currsize += ARGV_ALLOC_SIZE;
+					if (realloccmd(currsize, cmd) < 0)
+						return -1;
+				}
+				tilde_exp = expand_tilde(prev_start,
+						&tilde_dynalloc);
+				if (tilde_exp) {
+					cmd->argv[i] = tilde_exp;
+					cmd->dynallocinfo[i] = tilde_dynalloc;
+				} else {
+					cmd->argv[i] = prev_start;
+					cmd->dynallocinfo[i] = 0;
+				}
+				++i;
+				prev_start = ++ptr;
+				quoted = 0;
+			} else if (delim == ' '
+					&& (*ptr == '\'' || *ptr == '"')) {
+				delim = *ptr;
+				popchar(ptr);
+				searching = 1;
+				quoted = 1;
+			} else {
+				++ptr;
+			}
+		}
+		if (searching) {
+			fputs("syntax error: unclosed quotation\n", stderr);
+			/* argv isn't terminated yet, freecmd() can't be used */
+			while (i--)
+				if (cmd->dynallocinfo[i])
+					free(cmd->argv[i]);
+			free(cmd->argv);
+			free(cmd->dynallocinfo);
+			return -1;
+		} else {
+			if (*prev_start || quoted) {
+				/*
+				 * i can only be equal to currsize and we only need
+				 * one more slot
+				 */
+				if (i >= currsize)
+					if (realloccmd(++currsize, cmd) < 0)
+						return -1;
+				tilde_exp = expand_tilde(prev_start,
+						&tilde_dynalloc);
+				if (tilde_exp) {
+					cmd->argv[i] = tilde_exp;
+					cmd->dynallocinfo[i] = tilde_dynalloc;
+				} else {
+					cmd->argv[i] = prev_start;
+					cmd->dynallocinfo[i] = 0;
+				}
+				++i;
+			}
+			if (i >= currsize) {
+				/* same as earlier */
+				if (realloccmd(++currsize, cmd) < 0)
+					return -1;
+			}
+			cmd->argv[i] = NULL;
+			cmd->dynallocinfo[i] = -1;
+			cmd->argc = i;
+			info->canexpandpath = canexpandpath;
+			info->globstart = info->globend = 0;
+			return 0;
+		}
+	}
+}
+
+static int
+parseandor(const char **pp, struct node **n)
+{
+	/*
+	 * parse commands joined by && and ||, which have the same
+	 * precedence and are run from left to right, e.g in
+	 * 'a || b && c', c runs if either a or b succeeds.
+	 */
+	const char *p = *pp;
+	struct node *rhs, *op = NULL;
+	enum nodetype type;
+	int ret;
+
+	if ((ret = parsepipe(&p, n)) != 0)
+		return ret;
+	for (;;) {
+		p = skipblank(p);
+		if (p[0] == '&' && p[1] == '&')
+			type = NODE_AND;
+		else if (p[0] == '|' && p[1] == '|')
+			type = NODE_OR;
+		else
+			break;
+		p += 2;
+		/* the next command can be on the next line */
+		while (*(p = skipblank(p)) == '\n')
+			++p;
+		if (!*p) {
+			ret = 1;
+		} else if (*p == ';' || isclosing(p)) {
+			ret = syntaxerr(p);
+		} else if ((ret = parsepipe(&p, &rhs)) == 0) {
+			if (!(op = newnode(type, NULL, 0))) {
+				freetree(rhs);
+				ret = -1;
+			}
+		}
+		if (ret != 0) {
+			freetree(*n);
+			*n = NULL;
+			return ret;
+		}
+		op->cond = *n;
+		op->body = rhs;
+		*n = op;
+	}
+	*pp = p;
+	return 0;
+}
+
+static int
+parsecommand(const char **pp, struct node **n)
+{
+	/*
+	 * parse a single command, which is either a function definition,
+	 * a [[ ]] conditional, an if, a group, a loop or a pipeline.
+	 */
+	const char *p = *pp;
+	const char *end;
+	size_t namelen = 0;
+
+	if (iskeyword(p, "[["))
+		return parsecond(pp, n);
+	if (iskeyword(p, "if"))
+		return parseif(pp, n);
+	if (*p == '(' || iskeyword(p, "{"))
+		return parsegroup(pp, n);
+	if (iskeyword(p, "while") || iskeyword(p, "until"))
+		return parseloop(pp, n);
+	if (iskeyword(p, "for"))
+		return parsefor(pp, n);
+	if (isalpha((unsigned char)(*p)) || *p == '_') {
+		while (isalnum((unsigned char)(p[namelen]))
+				|| p[namelen] == '_')
+			++namelen;
+		end = skipblank(p + namelen);
+		if (*end == '(' && *(end = skipblank(end + 1)) == ')')
+			return parsefunc(pp, n, namelen, end + 1);
+	}
+
+	end = scancmd(p, 0);
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		--end;
+	if (end == p) {
+		fprintf(stderr, "syntax error: unexpected '%.2s'\n", p);
+		return -1;
+	}
+	if (!(*n = newnode(NODE_CMD, p, (size_t)(end - p))))
+		return -1;
+	*pp = scancmd(p, 0);
+	return 0;
+}
+
+static int
+parsecond(const char **pp, struct node **n)
+{
+	/*
+	 * parse a [[ expression ]] command. the expression can span
+	 * multiple lines, it's compiled the first time it's run.
+	 */
+	const char *p = *pp + 2;
+	const char *start = p;
+	char quote;
+
+	for (;;) {
+		p += strspn(p, " \t\n");
+		if (!*p)
+			return 1;
+		if (iskeyword(p, "]]"))
+			break;
+		for (quote = '\0'; *p; ++p) {
+			if (*p == '\\' && p[1])
+				++p;
+			else if (quote && *p == quote)
+				quote = '\0';
+			else if (quote)
+				continue;
+			else if (*p == '\'' || *p == '"')
+				quote = *p;
+			else if (*p == ' ' || *p == '\t' || *p == '\n')
+				break;
+		}
+	}
+	if (!(*n = newnode(NODE_COND, start, (size_t)(p - start))))
+		return -1;
+	*pp = p + 2;
+	return 0;
+}
+
+static int
+parseenv(struct command *cmd, struct cmdinfo *info)
+{
+	size_t arrsize = 0;
+	size_t var = 0;
+	char *ptr;
+
+	size_t i;
+
+	info->vars = NULL;
+	info->vals = NULL;
+	for (i = 0; i < cmd->argc; ++i) {
+		if ((ptr = strchr(cmd->argv[i], '=')) && ptr != cmd->argv[i]
+					&& argplain(info, cmd->argv[i],
+					(size_t)(ptr - cmd->argv[i]) + 1)) {
+			if (var >= arrsize) {
+				arrsize += ARGV_ALLOC_SIZE;
+				if (var == 0) {
+					info->vars = wemallocarray(arrsize,
+							sizeof(char *));
+					info->vals = wemallocarray(arrsize,
+							sizeof(char *));
+					if (!info->vars || !info->vals)
+						return -1;
+				} else {
+					char **oldvars = info->vars;
+					char **oldvals = info->vals;
+					info->vars = wereallocarray(info->vars,
+							arrsize,
+							sizeof(char *));
+					if (!info->vars) {
+						free(oldvars);
+						return -1;
+					}
+					info->vals = wereallocarray(info->vals,
+							arrsize,
+							sizeof(char *));
+					if (!info->vals) {
+						free(oldvals);
+						return -1;
+					}
+				}
+			}
+			info->vars[var] = cmd->argv[i];
+			info->vals[var++] = ptr + 1;
+			*ptr = '\0';
+		} else {
+			break;
+		}
+	}
+
+	if (var) {
+		info->vars[var] = NULL;
+		info->vals[var] = NULL;
+		cmd->argc -= var;
+		cmd->argv += var;
+	}
+	return 0;
+}
+
+static int
+parsefunc(const char **pp, struct node **n, size_t namelen, const char *p)
+{
+	/*
+	 * parse the body of a function definition, e.g:
+	 *
+	 * name() {
+	 *     commands
+	 * }
+	 *
+	 * *pp points to the name and p to right after the parentheses.
+	 */
+	struct node *body;
+	int ret;
+
+	while (*(p = skipblank(p)) == '\n')
+		++p;
+	if (!*p)
+		return 1;
+	if (!iskeyword(p, "{")) {
+		fprintf(stderr, "syntax error: expected '{' after '%.*s()'\n",
+				(int)(namelen), *pp);
+		return -1;
+	}
+	++p;
+	if ((ret = parselist(&p, &body)) != 0)
+		return ret;
+	if (*p != '}') {
+		freetree(body);
+		if (!*p)
+			return 1;
+		fprintf(stderr, "syntax error: unexpected '%.*s'\n",
+				(int)(strcspn(p, " \t\n;")), p);
+		return -1;
+	}
+	if (!(*n = newnode(NODE_FUNC, *pp, namelen))) {
+		freetree(body);
+		return -1;
+	}
+	(*n)->body = body;
+	*pp = p + 1;
+	return 0;
+}
+
+static int
+parsecompound(const char **pp, const char *p, enum nodetype type,
+		struct node *cond, struct node *body, struct node **n)
+{
+	/*
+	 * make the node for a group or a loop, which ends right before p,
+	 * with the redirection after it if there's one. cond and body are
+	 * freed if this fails.
+	 */
+	const char *end;
+
+	p = skipblank(p);
+	end = scancmd(p, 1);
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		--end;
+	if (end > p && !strchr("<>0123456789", *p)) {
+		freetree(cond);
+		freetree(body);
+		return syntaxerr(p);
+	}
+	if (!(*n = newnode(type, (end > p) ? p : NULL, (size_t)(end - p)))) {
+		freetree(cond);
+		freetree(body);
+		return -1;
+	}
+	(*n)->cond = cond;
+	(*n)->body = body;
+	*pp = scancmd(p, 1);
+	return 0;
+}
+
+static int
+parsegroup(const char **pp, struct node **n)
+{
+	/*
+	 * parse a ( list ) subshell or a { list; } group, and the
+	 * redirection after it if there's one
+	 */
+	const char *p = *pp + 1;
+	enum nodetype type = (**pp == '(') ? NODE_SUBSHELL : NODE_GROUP;
+	struct node *body;
+	int ret;
+
+	if ((ret = parselist(&p, &body)) != 0)
+		return ret;
+	if (!*p) {
+		freetree(body);
+		return 1;
+	}
+	if (!body || !iskeyword(p, (type == NODE_SUBSHELL) ? ")" : "}")) {
+		freetree(body);
+		return syntaxerr(p);
+	}
+
+	return parsecompound(pp, p + 1, type, NULL, body, n);
+}
+
+static int
+parsefor(const char **pp, struct node **n)
+{
+	/*
+	 * parse a for loop, see runfor(). what's between for and the ; or
+	 * newline is kept as text and expanded when the loop runs:
+	 *
+	 * for name in word ...; do
+	 *     list
+	 * done
+	 */
+	const char *p = skipblank(*pp + 3);
+	const char *end = scancmd(p, 0);
+	struct node *head, *body = NULL;
+	int ret;
+
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		--end;
+	if (end == p)
+		return *p ? syntaxerr(p) : 1;
+	if (!(head = newnode(NODE_CMD, p, (size_t)(end - p))))
+		return -1;
+	p = scancmd(end, 0);
+	while (*(p = skipblank(p)) == ';' || *p == '\n')
+		++p;
+	if (iskeyword(p, "do")) {
+		p += 2;
+		if ((ret = parselist(&p, &body)) == 0) {
+			if (body && iskeyword(p, "done"))
+				return parsecompound(pp, p + 4, NODE_FOR, head,
+						body, n);
+			ret = *p ? syntaxerr(p) : 1;
+		}
+	} else {
+		ret = *p ? syntaxerr(p) : 1;
+	}
+	freetree(head);
+	freetree(body);
+	return ret;
+}
+
+static int
+parseloop(const char **pp, struct node **n)
+{
+	/*
+	 * parse a while or until loop:
+	 *
+	 * while list; do
+	 *     list
+	 * done
+	 */
+	const char *p = *pp + 5;
+	enum nodetype type = (**pp == 'w') ? NODE_WHILE : NODE_UNTIL;
+	struct node *cond, *body = NULL;
+	int ret;
+
+	if ((ret = parselist(&p, &cond)) != 0)
+		return ret;
+	if (cond && iskeyword(p, "do")) {
+		p += 2;
+		if ((ret = parselist(&p, &body)) == 0) {
+			if (body && iskeyword(p, "done"))
+				return parsecompound(pp, p + 4, type, cond,
+						body, n);
+			ret = *p ? syntaxerr(p) : 1;
+		}
+	} else {
+		ret = *p ? syntaxerr(p) : 1;
+	}
+	freetree(cond);
+	freetree(body);
+	return ret;
+}
+
+static int
+parseif(const char **pp, struct node **n)
+{
+	/*
+	 * parse an if command, *pp points to the 'if' or to an 'elif',
+	 * which is parsed as an if nested in the else part:
+	 *
+	 * if list; then
+	 *     list
+	 * elif list; then
+	 *     list
+	 * else
+	 *     list
+	 * fi
+	 */
+	const char *p = *pp + ((**pp == 'i') ? 2 : 4);
+	struct node *cond = NULL, *body = NULL, *alt = NULL;
+	int ret;
+
+	if ((ret = parselist(&p, &cond)) != 0)
+		return ret;
+	if (cond && iskeyword(p, "then")) {
+		p += 4;
+		if ((ret = parselist(&p, &body)) != 0) {
+			freetree(cond);
+			return ret;
+		}
+		if (!body && *p) {
+			/* an empty then part */
+			ret = syntaxerr(p);
+		} else if (iskeyword(p, "elif")) {
+			ret = parseif(&p, &alt);
+		} else if (iskeyword(p, "else")) {
+			p += 4;
+			if ((ret = parselist(&p, &alt)) == 0 && *p) {
+				if (alt && iskeyword(p, "fi"))
+					p += 2;
+				else
+					ret = syntaxerr(p);
+			} else if (ret == 0) {
+				ret = 1;
+			}
+		} else if (iskeyword(p, "fi")) {
+			p += 2;
+		} else {
+			ret = *p ? syntaxerr(p) : 1;
+		}
+	} else {
+		ret = *p ? syntaxerr(p) : 1;
+	}
+
+	if (ret != 0) {
+		freetree(cond);
+		freetree(body);
+		freetree(alt);
+		return ret;
+	}
+	if (!(*n = newnode(NODE_IF, NULL, 0))) {
+		freetree(cond);
+		freetree(body);
+		freetree(alt);
+		return -1;
+	}
+	(*n)->cond = cond;
+	(*n)->body = body;
+	(*n)->alt = alt;
+	*pp = p;
+	return 0;
+}
+
+static int
+parselist(const char **pp, struct node **list)
+{
+	/*
+	 * parse commands separated by semicolons or newlines until the
+	 * end of the input or a keyword that closes the list, e.g the
+	 * '}' of a function body or the 'then' of an if, which is left for
+	 * the caller.
+	 */
+	struct node **tail = list;
+	const char *p = *pp;
+	int ret;
+
+	*list = NULL;
+	for (;;) {
+		while (*(p = skipblank(p)) == ';' || *p == '\n')
+			++p;
+		if (!*p || isclosing(p))
+			break;
+		if ((ret = parseandor(&p, tail)) != 0) {
+			freetree(*list);
+			*list = NULL;
+			return ret;
+		}
+		tail = &(*tail)->next;
+
+		p = skipblank(p);
+		if (*p && *p != ';' && *p != '\n' && !isclosing(p)) {
+			fprintf(stderr, "syntax error: unexpected '%.*s'\n",
+					(int)(strcspn(p, " \t\n;")), p);
+			freetree(*list);
+			*list = NULL;
+			return -1;
+		}
+	}
+	*pp = p;
+	return 0;
+}
+
+static int
+parsepipe(const char **pp, struct node **n)
+{
+	/*
+	 * parse commands joined by |. a pipeline of simple commands is
+	 * left in one NODE_CMD, see scancmd(), so this only joins the
+	 * stages around a compound command, e.g
+	 * 'cmd | while read -r line; do ...; done'.
+	 */
+	const char *p = *pp;
+	struct node *rhs, *op = NULL;
+	int ret;
+
+	if ((ret = parsecommand(&p, n)) != 0)
+		return ret;
+	for (;;) {
+		p = skipblank(p);
+		if (p[0] != '|' || p[1] == '|')
+			break;
+		/* the next stage can be on the next line */
+		while (*(p = skipblank(p + 1)) == '\n')
+			;
+		if (!*p) {
+			ret = 1;
+		} else if (*p == ';' || *p == '|' || isclosing(p)) {
+			ret = syntaxerr(p);
+		} else if ((ret = parsecommand(&p, &rhs)) == 0) {
+			if (!(op = newnode(NODE_PIPE, NULL, 0))) {
+				freetree(rhs);
+				ret = -1;
+			}
+		}
+		if (ret != 0) {
+			freetree(*n);
+			*n = NULL;
+			return ret;
+		}
+		op->cond = *n;
+		op->body = rhs;
+		*n = op;
+	}
+	*pp = p;
+	return 0;
+}
+
+static int
+parseredir(struct command *cmd, struct cmdinfo *info)
+{
+	/*
+	 * open the files of cmd's redirections and take them out of its
+	 * arguments. they're kept in info->redirs in the order they're
+	 * given, e.g 'cmd >out 2>&1' sends both to out. they're opened
+	 * close-on-exec, so a child doesn't have to close them after
+	 * moving them where they go.
+	 *
+	 * output redirected more than once in a row, e.g 'cmd >a >b', goes
+	 * to all of the files, see fanout(). the extra ones are kept in
+	 * outfds.
+	 */
+	size_t argend = 0, i, j;
+	char *ptr = NULL;
+	int flags = 0, target_fd = 0;
+	int fd = -1, opened = 0;
+	int lastout = 0;
+	char *redir_target;
+	struct redir *newredirs;
+	int *newoutfds;
+	struct stat st;
+
+	info->redirs = NULL;
+	info->nredirs = 0;
+	info->outfds = NULL;
+	info->noutfds = 0;
+	info->outtarget = -1;
+	for (i = 1; i < cmd->argc; ++i) {
+		/* quoted and expanded text is never a redirection */
+		ptr = strpbrk(cmd->argv[i], "<>");
+		if (ptr && argplain(info, ptr, 1)) {
+			int doclose = 0;
+			int isout = (*ptr == '>');
+			char *op = ptr;
+			size_t next = i;
+			fd = -1;
+			opened = 0;
+			if (!argend)
+				argend = i;
 			switch (*ptr) {
 			case '<':
 				flags = O_RDONLY;
 				target_fd = STDIN_FILENO;
 				break;
-			case '>':
-				if (*(ptr + 1) == '|') {
-					ptr++;
-					flags = O_WRONLY | O_CREAT
-						| O_TRUNC;
-				} else if (opts & OPT_CLOBBER) {
-					flags = O_WRONLY | O_CREAT
-						| O_TRUNC;
-				} else {
-					flags = O_WRONLY | O_CREAT
-						| O_EXCL;
-				}
-				target_fd = STDOUT_FILENO;
+			case '>':
+				if (*(ptr + 1) == '>'
+						&& argplain(info, ptr + 1, 1)) {
+					ptr++;
+					flags = O_WRONLY | O_CREAT
+						| O_APPEND;
+				} else if (*(ptr + 1) == '|'
+						&& argplain(info, ptr + 1, 1)) {
+					ptr++;
+					flags = O_WRONLY | O_CREAT
+						| O_TRUNC;
+				} else if (opts & OPT_CLOBBER) {
+					flags = O_WRONLY | O_CREAT
+						| O_TRUNC;
+				} else {
+					flags = O_WRONLY | O_CREAT
+						| O_EXCL;
+				}
+				target_fd = STDOUT_FILENO;
+			}
+			if (*(ptr + 1) == '\0') {
+				if (i + 1 >= cmd->argc) {
+					fputs("syntax error: missing "
+						"redirection target\n",
+						stderr);
+					goto fail;
+				}
+				redir_target = cmd->argv[++next];
+			} else {
+				redir_target = ptr + 1;
+			}
+			if (*redir_target == '&'
+					&& argplain(info, redir_target, 1)) {
+				if (*(redir_target + 1) == '\0') {
+					fputs("syntax error: missing "
+						"redirection target\n",
+						stderr);
+					goto fail;
+				} else if (!strcmp(redir_target, "&-")) {
+					doclose = 1;
+				} else if (wexstrtoint(&fd, redir_target + 1,
+							10) < 0) {
+					/*
+					 * wexstrtoint already prints a
+					 * message on failure
+					 */
+					goto fail;
+				}
+			} else {
+				if (flags & O_CREAT) {
+					fd = open(redir_target,
+							flags | O_CLOEXEC,
+							S_IRUSR | S_IWUSR |
+							S_IRGRP | S_IWGRP |
+							S_IROTH | S_IWOTH);
+				} else {
+					fd = open(redir_target,
+							flags | O_CLOEXEC);
+				}
+				if (fd < 0 && errno == EEXIST
+						&& !stat(redir_target, &st)
+						&& !S_ISREG(st.st_mode)) {
+					/*
+					 * only regular files are protected
+					 * from being overwritten, not e.g
+					 * /dev/null or >(cmd)
+					 */
+					fd = open(redir_target,
+							O_WRONLY | O_CLOEXEC);
+				}
+				if (fd < 0) {
+					logerr("open '%s':", redir_target);
+					goto fail;
+				}
+				opened = 1;
+			}
+
+			/*
+			 * if this is not the beginning of the argument
+			 * string, e.g:
+			 *
+			 * will be false for 'cmd > file'
+			 * will be true for 'cmd 2>file'
+			 */
+			if (op != cmd->argv[i]) {
+				/*
+				 * if xstrtoint fails target_fd will be
+				 * left unchanged
+				 */
+				char c = *op;
+				*op = '\0';
+				xstrtoint(&target_fd, cmd->argv[i], 10);
+				*op = c;
+			}
+			i = next;
+
+			/*
+			 * a file opened for one redirection can't be where
+			 * another one goes, e.g 'cmd 3>a' could get fd 3
+			 * for a, move it out of the way
+			 */
+			if (opened && redirclash(info, fd, target_fd)
+					&& redirmove(&fd) < 0)
+				goto failfd;
+			for (j = 0; j < info->nredirs; ++j)
+				if (info->redirs[j].opened
+						&& info->redirs[j].fd == target_fd
+						&& redirmove(&info->redirs[j].fd)
+						< 0)
+					goto failfd;
+			for (j = 0; j < info->noutfds; ++j)
+				if (info->outfds[j] == target_fd
+						&& redirmove(&info->outfds[j])
+						< 0)
+					goto failfd;
+
+			if (!isout || doclose || !lastout
+					|| info->redirs[info->nredirs - 1].target
+					!= target_fd
+					|| (info->noutfds
+					&& info->outtarget != target_fd)) {
+				if (!(newredirs = wereallocarray(info->redirs,
+							info->nredirs + 1,
+							sizeof(*newredirs))))
+					goto failfd;
+				info->redirs = newredirs;
+				newredirs[info->nredirs].fd = fd;
+				newredirs[info->nredirs].target = target_fd;
+				newredirs[info->nredirs++].opened = opened;
+				lastout = isout && !doclose;
+				continue;
+			}
+			/* another place for the same output to go */
+			if (!(newoutfds = wereallocarray(info->outfds,
+						info->noutfds + 1,
+						sizeof(int))))
+				goto failfd;
+			info->outfds = newoutfds;
+			if (!opened && (fd = fcntl(fd, F_DUPFD_CLOEXEC,
+							3)) < 0) {
+				logerr("fcntl:");
+				goto fail;
+			}
+			info->outfds[info->noutfds++] = fd;
+			info->outtarget = target_fd;
+		}
+	}
+
+	if (argend > 0) {
+		cmd->argv[argend] = NULL;
+		cmd->argc = argend;
+	}
+	return 0;
+
+failfd:
+	/* the fd of the redirection that failed isn't in info yet */
+	if (opened)
+		close(fd);
+fail:
+	closeredirs(info);
+	return -1;
+}
+
+static int
+argplain(const struct cmdinfo *info, const char *p, size_t n)
+{
+	/* check if n characters at p in an argument were unquoted literal text */
+	return !info->plain || !memchr(info->plain + (p - info->words), 0, n);
+}
+
+static int
+redirclash(const struct cmdinfo *info, int fd, int target)
+{
+	/* if fd is where one of the redirections so far goes, or target */
+	size_t i;
+
+	if (fd == target)
+		return 1;
+	for (i = 0; i < info->nredirs; ++i)
+		if (info->redirs[i].target == fd)
+			return 1;
+	return 0;
+}
+
+static int
+redirmove(int *fd)
+{
+	int newfd;
+
+	if ((newfd = fcntl(*fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE)) < 0) {
+		logerr("fcntl:");
+		return -1;
+	}
+	close(*fd);
+	*fd = newfd;
+	return 0;
+}
+
+static int
+redirresolve(const struct cmdinfo *info, size_t n, int fd)
+{
+	/*
+	 * the descriptor fd is a copy of after the first n redirections,
+	 * or -1 if they close it
+	 */
+	while (n--) {
+		if (info->redirs[n].target != fd)
+			continue;
+		if (info->redirs[n].fd < 0 || info->redirs[n].opened)
+			return info->redirs[n].fd;
+		fd = info->redirs[n].fd;
+	}
+	return fd;
+}
+
+static int
+parsetree(const char *s, struct node **tree)
+{
+	/*
+	 * parse a script into a tree of commands, which can be run any
+	 * number of times with runtree(). returns 0 on success, -1 on a
+	 * syntax error and 1 if s ends in the middle of a command and
+	 * more input is needed.
+	 */
+	const char *p = s;
+	int ret = parselist(&p, tree);
+
+	if (ret == 0 && *p) {
+		/* parselist() only stops early at a closing keyword */
+		fprintf(stderr, "syntax error: unexpected '%.*s'\n",
+				(int)(strcspn(p, " \t\n;")), p);
+		freetree(*tree);
+		*tree = NULL;
+		return -1;
+	}
+	return ret;
+}
+
+/*
+ * ===========================================================================
+ * memory allocation functions for commands
+ */
+static int
+alloccmd(size_t slots, struct command *cmd)
+{
+	if (!(cmd->argv = wemallocarray(sizeof(char *), slots)))
+		return -1;
+	cmd->orig_argv = cmd->argv;
+	if (!(cmd->dynallocinfo = wemallocarray(sizeof(int), slots)))
+		return -1;
+	return 0;
+}
+
+static int
+realloccmd(size_t slots, struct command *cmd)
+{
+	char **oldargv = cmd->argv;
+	int *olddynallocinfo = cmd->dynallocinfo;
+	cmd->argv = wereallocarray(cmd->argv, sizeof(char *), slots);
+	cmd->orig_argv = cmd->argv;
+	if (!cmd->argv) {
+		free(oldargv);
+		return -1;
+	}
+	cmd->dynallocinfo = wereallocarray(
+			cmd->dynallocinfo, sizeof(int), slots);
+	if (!cmd->dynallocinfo) {
+		free(olddynallocinfo);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+freecmd(const struct command *cmd)
+{
+	size_t i;
+	for (i = 0; cmd->orig_argv[i]; ++i)
+		if (cmd->dynallocinfo[i])
+			free(cmd->orig_argv[i]);
+	free(cmd->orig_argv);
+	free(cmd->dynallocinfo);
+}
+
+static void
+cmdfree(struct cmdcode *c)
+{
+	if (!c)
+		return;
+	free(c->parts);
+	free(c->lits);
+	free(c);
+}
+
+static int
+duptree(const struct node *n, struct node **copy)
+{
+	struct node **tail = copy;
+
+	*copy = NULL;
+	for (; n; n = n->next) {
+		if (!(*tail = newnode(n->type, n->text,
+				n->text ? strlen(n->text) : 0))
+				|| duptree(n->body, &(*tail)->body) < 0
+				|| duptree(n->cond, &(*tail)->cond) < 0
+				|| duptree(n->alt, &(*tail)->alt) < 0) {
+			freetree(*copy);
+			*copy = NULL;
+			return -1;
+		}
+		tail = &(*tail)->next;
+	}
+	return 0;
+}
+
+static void
+freetree(struct node *n)
+{
+	struct node *next;
+	for (; n; n = next) {
+		next = n->next;
+		freetree(n->body);
+		freetree(n->cond);
+		freetree(n->alt);
+		cmdfree(n->code);
+		free(n->text);
+		free(n);
+	}
+}
+
+static struct node *
+newnode(enum nodetype type, const char *text, size_t len)
+{
+	struct node *n = wemalloc(sizeof(*n));
+	if (!n)
+		return NULL;
+	n->type = type;
+	n->text = NULL;
+	n->body = NULL;
+	n->cond = NULL;
+	n->alt = NULL;
+	n->next = NULL;
+	n->code = NULL;
+	if (text && !(n->text = westrndup(text, len))) {
+		free(n);
+		return NULL;
+	}
+	if (type == NODE_CMD && text)
+		n->code = cmdcompile(n->text);
+	return n;
+}
+
+/*
+ * ===========================================================================
+ * function definition functions
+ */
+static int
+funcdefine(const char *name, const struct node *body)
+{
+	/*
+	 * the function keeps its own copy of the body, so the tree it was
+	 * defined in can be freed
+	 */
+	struct function *fn, **prev;
+	size_t h = strhash(name, strlen(name)) % LEN(functions);
+
+	if (!(fn = wemalloc(sizeof(*fn))))
+		return -1;
+	if (!(fn->name = westrdup(name))) {
+		free(fn);
+		return -1;
+	}
+	if (duptree(body, &fn->body) < 0) {
+		free(fn->name);
+		free(fn);
+		return -1;
+	}
+	fn->refs = 0;
+	fn->stale = 0;
+
+	for (prev = &functions[h]; *prev; prev = &(*prev)->next) {
+		if (!strcmp((*prev)->name, name)) {
+			struct function *old = *prev;
+			*prev = old->next;
+			old->stale = 1;
+			if (!old->refs)
+				funcrelease(old);
+			break;
+		}
+	}
+	fn->next = functions[h];
+	functions[h] = fn;
+	return 0;
+}
+
+static struct function *
+funcfind(const char *name)
+{
+	struct function *fn;
+	if (!name)
+		return NULL;
+	for (fn = functions[strhash(name, strlen(name)) % LEN(functions)]; fn;
+			fn = fn->next)
+		if (!strcmp(fn->name, name))
+			return fn;
+	return NULL;
+}
+
+static void
+funcrelease(struct function *fn)
+{
+	freetree(fn->body);
+	free(fn->name);
+	free(fn);
+}
+
+static int
+funcrun(struct function *fn, const struct command *cmd)
+{
+	/*
+	 * call a function in the current shell process with the rest of
+	 * cmd's arguments as the positional parameters. they are only
+	 * pointed to, cmd has to outlive the call.
+	 */
+	struct frame fr;
+	int oldloopdepth = loopdepth;
+
+	if (funcdepth >= FUNCTION_DEPTH_MAX) {
+		logerr("%s: maximum function nesting depth exceeded",
+				fn->name);
+		return MISC_FAILURE_STATUS;
+	}
+	fr.argv = cmd->argv + 1;
+	fr.argc = cmd->argc - 1;
+	fr.prev = curframe;
+	curframe = &fr;
+	++funcdepth;
+	++fn->refs;
+	/* break and continue only work on loops inside the function */
+	loopdepth = 0;
+
+	update_laststatus(0);
+	runtree(fn->body);
+	returning = EXITING;
+	loopdepth = oldloopdepth;
+
+	--fn->refs;
+	--funcdepth;
+	curframe = fr.prev;
+	if (fn->stale && !fn->refs)
+		funcrelease(fn);
+	return lastexit;
+}
+
+/*
+ * ===========================================================================
+ * shell variable functions
+ */
+static struct var *
+varfind(const char *name)
+{
+	struct var *v;
+	for (v = variables[strhash(name, strlen(name)) % LEN(variables)]; v;
+			v = v->next)
+		if (!strcmp(v->name, name))
+			return v;
+	return NULL;
+}
+
+static void
+varfree(struct var *v)
+{
+	size_t i;
+
+	for (i = 0; i < v->nitems; ++i)
+		free(v->items[i]);
+	free(v->items);
+	free(v->index);
+	free(v->val);
+	free(v->name);
+	free(v);
+}
+
+static const char *
+varget(const char *name)
+{
+	/* the value of an array is its first element */
+	struct var *v;
+	size_t n;
+
+	if (!strcmp(name, "PIPESTATUS"))
+		return varitem(name, 0, &n);
+	if (!(v = varfind(name)))
+		return envget(name);
+	if (v->items)
+		return (v->nitems && !v->index[0]) ? v->items[0] : "";
+	return v->val;
+}
+
+static const char *
+varitem(const char *name, size_t i, size_t *n)
+{
+	/*
+	 * return element i of an array, or NULL if it isn't set, and set
+	 * *n to one more than the highest index that is. a variable that
+	 * isn't an array is the same as an array of just its value.
+	 *
+	 * PIPESTATUS is made from the statuses kept by pipeline() when
+	 * it's used, its elements are only valid until the next call.
+	 */
+	static char num[21];
+	struct var *v;
+	const char *val;
+	size_t k;
+
+	if (!strcmp(name, "PIPESTATUS")) {
+		*n = npipestatus ? npipestatus : 1;
+		if (i >= *n)
+			return NULL;
+		sprintf(num, "%d", npipestatus ? pipestatus[i] : lastexit);
+		return num;
+	}
+	if ((v = varfind(name)) && v->items) {
+		*n = v->nitems ? v->index[v->nitems - 1] + 1 : 0;
+		k = varslot(v, i);
+		return (k < v->nitems && v->index[k] == i) ? v->items[k]
+			: NULL;
+	}
+	val = varget(name);
+	*n = val ? 1 : 0;
+	return (i == 0) ? val : NULL;
+}
+
+static const char *
+varnth(const char *name, size_t k, size_t *n)
+{
+	/*
+	 * return the kth set element of an array, in the order of their
+	 * indexes, and set *n to how many are set, see varitem()
+	 */
+	struct var *v;
+
+	if ((v = varfind(name)) && v->items) {
+		*n = v->nitems;
+		return (k < v->nitems) ? v->items[k] : NULL;
+	}
+	return varitem(name, k, n);
+}
+
+static int
+varset(const char *name, const char *val)
+{
+	/*
+	 * variables that are in the environment (because they were
+	 * inherited or exported) are changed there, the rest are only
+	 * known to the shell. setting an array sets its first element,
+	 * and NAME[index] sets any other one.
+	 */
+	struct var *v;
+	char *valdup;
+	const char *sub;
+	size_t h;
+
+	if ((sub = strchr(name, '[')))
+		return varsetitem(name, sub, val);
+	if (envget(name)) {
+		if (envset(name, val) < 0) {
+			logerr("setenv '%s':", name);
+			return -1;
+		}
+		return 0;
+	}
+	if ((v = varfind(name)) && v->items)
+		return varsetitem(name, "[0]", val);
+	if (!(valdup = westrdup(val)))
+		return -1;
+	if (v) {
+		free(v->val);
+		v->val = valdup;
+		return 0;
+	}
+	if (!(v = wemalloc(sizeof(*v))) || !(v->name = westrdup(name))) {
+		free(v);
+		free(valdup);
+		return -1;
+	}
+	v->val = valdup;
+	v->items = NULL;
+	v->index = NULL;
+	v->nitems = v->itemsize = 0;
+	h = strhash(name, strlen(name)) % LEN(variables);
+	v->next = variables[h];
+	variables[h] = v;
+	return 0;
+}
+
+static int
+varsetarray(const char *name, char **items, size_t *idx, size_t n)
+{
+	/*
+	 * make name an array of the n strings in items, replacing what
+	 * it was before. idx has the index of each of them in
+	 * increasing order, or is NULL for 0 to n - 1. items, idx and
+	 * the strings belong to the variable afterwards, or are freed if
+	 * this fails.
+	 */
+	struct var *v;
+	size_t h, i;
+
+	if (!idx && (idx = wemallocarray(n ? n : 1, sizeof(*idx))))
+		for (i = 0; i < n; ++i)
+			idx[i] = i;
+	if (!idx) {
+		v = NULL;
+	} else if (envunset(name) < 0) {
+		logerr("unsetenv '%s':", name);
+		v = NULL;
+	} else if ((v = wemalloc(sizeof(*v))) && !(v->name = westrdup(name))) {
+		free(v);
+		v = NULL;
+	}
+	if (!v) {
+		while (n--)
+			free(items[n]);
+		free(items);
+		free(idx);
+		return -1;
+	}
+	varunset(name);
+	v->val = NULL;
+	v->items = items;
+	v->index = idx;
+	v->nitems = v->itemsize = n;
+	h = strhash(name, strlen(name)) % LEN(variables);
+	v->next = variables[h];
+	variables[h] = v;
+	return 0;
+}
+
+static int
+varsetitem(const char *name, const char *sub, const char *val)
+{
+	/*
+	 * set an element of an array, e.g a[i + 1]=val. the index is an
+	 * arithmetic expression, name may also be just the name of the
+	 * array with sub being the subscript. only the elements that are
+	 * set are kept, so a[1000000]=val doesn't make a million of them.
+	 */
+	struct arith *a;
+	struct var *v;
+	char *base, *valdup, **items;
+	size_t len = strlen(sub), k, *idx;
+	int64_t i;
+
+	if (len < 3 || sub[len - 1] != ']') {
+		logerr("bad array subscript '%s'", sub);
+		return -1;
+	}
+	if (!(a = arithcompile(sub + 1, len - 2)) || aritheval(a, &i) < 0)
+		return -1;
+	if (i < 0 || (uint64_t)(i) >= SIZE_MAX) {
+		logerr("bad array subscript '%s'", sub);
+		return -1;
+	}
+	if (!(base = westrndup(name, strcspn(name, "["))))
+		return -1;
+	if (!(v = varfind(base)) || !v->items) {
+		/* a scalar becomes the first element */
+		const char *old = varget(base);
+		char *olddup = NULL;
+		if (!(items = wemalloc(sizeof(char *)))
+				|| (old && !(olddup = westrdup(old)))) {
+			free(items);
+			free(base);
+			return -1;
+		}
+		items[0] = olddup;
+		if (varsetarray(base, items, NULL, old ? 1 : 0) < 0) {
+			free(base);
+			return -1;
+		}
+		v = varfind(base);
+	}
+	free(base);
+
+	if (!(valdup = westrdup(val)))
+		return -1;
+	k = varslot(v, (size_t)(i));
+	if (k < v->nitems && v->index[k] == (size_t)(i)) {
+		free(v->items[k]);
+		v->items[k] = valdup;
+		return 0;
+	}
+	if (v->nitems >= v->itemsize) {
+		v->itemsize = v->itemsize ? v->itemsize * 2 : 8;
+		if (!(items = wereallocarray(v->items, v->itemsize,
+						sizeof(*items)))) {
+			free(valdup);
+			return -1;
+		}
+		v->items = items;
+		if (!(idx = wereallocarray(v->index, v->itemsize,
+						sizeof(*idx)))) {
+			free(valdup);
+			return -1;
+		}
+		v->index = idx;
+	}
+	memmove(v->items + k + 1, v->items + k,
+			(v->nitems - k) * sizeof(*v->items));
+	memmove(v->index + k + 1, v->index + k,
+			(v->nitems - k) * sizeof(*v->index));
+	v->items[k] = valdup;
+	v->index[k] = (size_t)(i);
+	++v->nitems;
+	return 0;
+}
+
+static size_t
+varslot(const struct var *v, size_t i)
+{
+	/* find where element i of an array is or would go */
+	size_t lo = 0, hi = v->nitems, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (v->index[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static char **
+vartemp(char **vars, char **vals, size_t *n)
+{
+	/*
+	 * make the assignments before a builtin or a function and return
+	 * what the variables were before, for vartempend(). ones that
+	 * weren't set are exported meanwhile like for other commands.
+	 * elements of arrays are left alone.
+	 */
+	const char *old;
+	char **saved;
+	size_t i;
+
+	for (*n = 0; vars[*n]; ++*n)
+		;
+	if (!(saved = wemallocarray(*n, sizeof(*saved))))
+		return NULL;
+	for (i = 0; i < *n; ++i) {
+		saved[i] = NULL;
+		if (strchr(vars[i], '['))
+			continue;
+		if ((old = varget(vars[i])) && !(saved[i] = westrdup(old)))
+			break;
+		if (old ? varset(vars[i], vals[i]) < 0
+				: envset(vars[i], vals[i]) < 0) {
+			if (!old)
+				logerr("setenv '%s':", vars[i]);
+			free(saved[i]);
+			break;
+		}
+	}
+	if (i < *n) {
+		vartempend(vars, saved, i);
+		return NULL;
+	}
+	return saved;
+}
+
+static void
+vartempend(char **vars, char **saved, size_t n)
+{
+	/* undo vartemp(), the last assignment of a name first */
+	while (n--) {
+		if (strchr(vars[n], '['))
+			continue;
+		if (saved[n]) {
+			varset(vars[n], saved[n]);
+			free(saved[n]);
+		} else {
+			varunset(vars[n]);
+			if (envunset(vars[n]) < 0)
+				logerr("unsetenv '%s':", vars[n]);
+		}
+	}
+	free(saved);
+}
+
+static void
+varunset(const char *name)
+{
+	struct var *v, **prev;
+	prev = &variables[strhash(name, strlen(name)) % LEN(variables)];
+	for (; (v = *prev); prev = &v->next) {
+		if (!strcmp(v->name, name)) {
+			*prev = v->next;
+			varfree(v);
+			return;
+		}
+	}
+}
+
+/*
+ * ===========================================================================
+ * sourced files functions
+ */
+static char *
+sourcefind(const char *name)
+{
+	/*
+	 * names without a slash are looked up in $PATH first and then in
+	 * the current directory.
+	 */
+	const char *pathenv = envget("PATH");
+	const char *dir, *end;
+	char *path;
+	size_t namelen = strlen(name);
+
+	if (strchr(name, '/') || !pathenv)
+		return westrdup(name);
+	for (dir = pathenv; dir; dir = *end ? end + 1 : NULL) {
+		size_t dirlen;
+		end = dir + strcspn(dir, ":");
+		dirlen = (size_t)(end - dir);
+		if (!dirlen)
+			continue;
+		if (!(path = wemalloc(dirlen + namelen + 2)))
+			return NULL;
+		memcpy(path, dir, dirlen);
+		path[dirlen] = '/';
+		memcpy(path + dirlen + 1, name, namelen + 1);
+		if (access(path, R_OK) == 0)
+			return path;
+		free(path);
+	}
+	return westrdup(name);
+}
+
+static struct sourced *
+sourceload(const char *path, const struct stat *st)
+{
+	/*
+	 * return the parsed contents of a file, reading and parsing it
+	 * only if it's not cached or has changed since it was cached. one
+	 * that was read right after it changed is read again, see
+	 * statracy(). its commands are split into words by cmdcompile() then, so
+	 * sourcing it again only expands their parameters.
+	 */
+	struct sourced *src, **prev;
+	char *buf;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	for (prev = &sourcecache; (src = *prev); prev = &src->next) {
+		if (src->dev != st->st_dev || src->ino != st->st_ino)
+			continue;
+		if (!src->racy && src->size == st->st_size
+				&& src->mtime.tv_sec == st->st_mtim.tv_sec
+				&& src->mtime.tv_nsec == st->st_mtim.tv_nsec
+				&& src->ctime.tv_sec == st->st_ctim.tv_sec
+				&& src->ctime.tv_nsec == st->st_ctim.tv_nsec)
+			return src;
+		/* the file changed, drop the old entry */
+		*prev = src->next;
+		src->stale = 1;
+		if (!src->refs)
+			sourcerelease(src);
+		break;
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		logerr("open '%s':", path);
+		return NULL;
+	}
+	if (!(buf = wemalloc((size_t)(st->st_size) + 1))) {
+		close(fd);
+		return NULL;
+	}
+	while (len < (size_t)(st->st_size)) {
+		n = read(fd, buf + len, (size_t)(st->st_size) - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			logerr("read '%s':", path);
+			free(buf);
+			close(fd);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += (size_t)(n);
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	if (!(src = wemalloc(sizeof(*src)))) {
+		free(buf);
+		return NULL;
+	}
+	if (parsetree(buf, &src->tree) != 0) {
+		if (src->tree == NULL && *buf)
+			fprintf(stderr, "syntax error: unexpected end of "
+					"file in '%s'\n", path);
+		free(buf);
+		free(src);
+		return NULL;
+	}
+	free(buf);
+	if (!(src->path = westrdup(path))) {
+		freetree(src->tree);
+		free(src);
+		return NULL;
+	}
+	src->dev = st->st_dev;
+	src->ino = st->st_ino;
+	src->mtime = st->st_mtim;
+	src->ctime = st->st_ctim;
+	src->size = st->st_size;
+	src->racy = statracy(st);
+	src->refs = 0;
+	src->stale = 0;
+	src->next = sourcecache;
+	sourcecache = src;
+	return src;
+}
+
+static int
+sourcefile(const char *name, int mustexist)
+{
+	/*
+	 * run the commands in a file in the current shell, returning the
+	 * exit status of the last one. if mustexist is 0, a file that
+	 * doesn't exist is silently ignored.
+	 */
+	struct sourced *src;
+	struct stat st;
+	char *path;
+
+	if (!(path = sourcefind(name)))
+		return -1;
+	if (stat(path, &st) < 0) {
+		if (mustexist || errno != ENOENT)
+			logerr("stat '%s':", path);
+		free(path);
+		return (mustexist || errno != ENOENT) ? -1 : 0;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		logerr("'%s' is not a regular file", path);
+		free(path);
+		return -1;
+	}
+	src = sourceload(path, &st);
+	free(path);
+	if (!src)
+		return -1;
+
+	/*
+	 * the file may be sourced again while it runs and replace this
+	 * entry in the cache, keep the tree around until we're done
+	 */
+	++src->refs;
+	++sourcedepth;
+	update_laststatus(0);
+	runtree(src->tree);
+	returning = EXITING;
+	--sourcedepth;
+	--src->refs;
+	if (src->stale && !src->refs)
+		sourcerelease(src);
+	return lastexit;
+}
+
+static void
+sourcerelease(struct sourced *src)
+{
+	freetree(src->tree);
+	free(src->path);
+	free(src);
+}
+
+/*
+ * ===========================================================================
+ * shell state snapshot functions
+ *
+ * a snapshot is written in the native byte order and sizes, it's only
+ * read again by the same shell on the same machine. numbers are copied
+ * out of it with memcpy(), so it can be used straight from mmap() and
+ * is the same wherever it's mapped. it's laid out as:
+ *
+ * - SNAPSHOT_MAGIC
+ * - the opts the shell started with and a hash of its environment, see
+ *   snapenvhash(), both of which have to be the same to load it
+ * - the sourced files, each as its path, device, inode, mtime and ctime
+ *   (seconds and nanoseconds) and size, none of which may have changed.
+ *   the mtime of one that was read right after it changed is -1, so
+ *   that the snapshot is never loaded, see statracy()
+ * - opts, pipebuf, batchjobs and the prompt format
+ * - the environment variables to set ('=' and NAME=VALUE) and unset
+ *   ('-' and NAME)
+ * - the shell variables, each as its name and either 0 and its value or
+ *   1, its number of set elements and the index and value of each
+ * - the functions, each as its name and body, see snapputtree()
+ *
+ * strings are a uint32_t length and the bytes, or SNAPSHOT_NULL for a
+ * NULL pointer, and lists are a uint32_t count and the items.
+ */
+#define SNAPSHOT_MAGIC "sushi snapshot 3\n"
+#define SNAPSHOT_NULL 0xffffffffUL
+
+static uint64_t
+snapenvhash(char **env)
+{
+	/*
+	 * a hash of the environment that doesn't depend on the order of
+	 * the variables, leaving out the ones that change all the time and
+	 * never affect what ~/.sushirc does
+	 */
+	static const char *const skip[] = {"PWD=", "OLDPWD=", "SHLVL=", "_="};
+	uint64_t h = 0;
+	size_t i;
+
+	for (; env && *env; ++env) {
+		for (i = 0; i < LEN(skip); ++i)
+			if (!strncmp(*env, skip[i], strlen(skip[i])))
+				break;
+		if (i == LEN(skip))
+			h += hash64(*env, strlen(*env), 0);
+	}
+	return h;
+}
+
+static int
+snapget(struct snapreader *r, void *p, size_t n)
+{
+	if ((size_t)(r->end - r->p) < n)
+		return -1;
+	memcpy(p, r->p, n);
+	r->p += n;
+	return 0;
+}
+
+static int
+snapgetstr(struct snapreader *r, char **s)
+{
+	/* *s is a copy of the string, or NULL if it was a NULL pointer */
+	uint32_t len;
+
+	*s = NULL;
+	if (snapget(r, &len, sizeof(len)) < 0)
+		return -1;
+	if (len == SNAPSHOT_NULL)
+		return 0;
+	if ((size_t)(r->end - r->p) < len || memchr(r->p, '\0', len))
+		return -1;
+	if (!(*s = westrndup(r->p, len)))
+		return -1;
+	r->p += len;
+	return 0;
+}
+
+static int
+snapgettree(struct snapreader *r, struct node **tree, int depth)
+{
+	/* the opposite of snapputtree() */
+	struct node **tail = tree;
+	struct node *n;
+	uint32_t type;
+	unsigned char more;
+
+	*tree = NULL;
+	/* a tree can't be deeper than its nesting in the source */
+	if (depth > FUNCTION_DEPTH_MAX)
+		return -1;
+	for (;;) {
+		if (snapget(r, &more, 1) < 0)
+			goto fail;
+		if (!more)
+			return 0;
+		if (snapget(r, &type, sizeof(type)) < 0 || type > NODE_PIPE
+				|| !(n = wemalloc(sizeof(*n))))
+			goto fail;
+		n->type = (enum nodetype)(type);
+		n->body = n->cond = n->alt = n->next = NULL;
+		n->code = NULL;
+		*tail = n;
+		tail = &n->next;
+		if (snapgetstr(r, &n->text) < 0
+				|| snapgettree(r, &n->body, depth + 1) < 0
+				|| snapgettree(r, &n->cond, depth + 1) < 0
+				|| snapgettree(r, &n->alt, depth + 1) < 0)
+			goto fail;
+		if (n->type == NODE_CMD && n->text)
+			n->code = cmdcompile(n->text);
+	}
+
+fail:
+	freetree(*tree);
+	*tree = NULL;
+	return -1;
+}
+
+static int
+snapload(const char *path)
+{
+	/*
+	 * load a snapshot made by snapsave(). returns 1 if it was loaded,
+	 * 0 if there is none or it's out of date, and -1 if it's broken.
+	 */
+	struct snapreader r;
+	struct stat st;
+	struct node *body;
+	uint64_t u, dev, ino;
+	int64_t times[4], size;
+	uint32_t n, i, j, nitems, isarray;
+	int32_t num[3];
+	char *name = NULL, *val = NULL, **items;
+	size_t *idx;
+	const char *start;
+	void *map;
+	int fd, apply, ret = 0;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, (size_t)(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		logerr("mmap '%s':", path);
+		return -1;
+	}
+	r.p = map;
+	r.end = r.p + st.st_size;
+
+	/* is it still what ~/.sushirc would do? */
+	if ((size_t)(st.st_size) < sizeof(SNAPSHOT_MAGIC) - 1 || memcmp(r.p,
+				SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1))
+		goto out;
+	r.p += sizeof(SNAPSHOT_MAGIC) - 1;
+	if (snapget(&r, num, sizeof(*num)) < 0 || num[0] != startopts
+			|| snapget(&r, &u, sizeof(u)) < 0
+			|| u != snapenvhash(startenv)
+			|| snapget(&r, &n, sizeof(n)) < 0)
+		goto out;
+	for (i = 0; i < n; ++i) {
+		if (snapgetstr(&r, &name) < 0 || !name
+				|| snapget(&r, &dev, sizeof(dev)) < 0
+				|| snapget(&r, &ino, sizeof(ino)) < 0
+				|| snapget(&r, times, sizeof(times)) < 0
+				|| snapget(&r, &size, sizeof(size)) < 0
+				|| stat(name, &st) < 0
+				|| (uint64_t)(st.st_dev) != dev
+				|| (uint64_t)(st.st_ino) != ino
+				|| (int64_t)(st.st_mtim.tv_sec) != times[0]
+				|| (int64_t)(st.st_mtim.tv_nsec) != times[1]
+				|| (int64_t)(st.st_ctim.tv_sec) != times[2]
+				|| (int64_t)(st.st_ctim.tv_nsec) != times[3]
+				|| (int64_t)(st.st_size) != size)
+			goto out;
+		free(name);
+		name = NULL;
+	}
+
+	/*
+	 * go through the rest twice, first only checking it so that a
+	 * broken snapshot changes nothing, then loading it
+	 */
+	ret = -1;
+	start = r.p;
+	for (apply = 0; apply < 2; ++apply) {
+		r.p = start;
+		if (snapget(&r, num, sizeof(num)) < 0
+				|| snapgetstr(&r, &val) < 0)
+			goto out;
+		if (apply) {
+			opts = num[0];
+			pipebuf = num[1];
+			batchjobs = num[2];
+			promptset(val ? val : defaultprompt);
+		}
+		free(val);
+		val = NULL;
+
+		if (snapget(&r, &n, sizeof(n)) < 0)
+			goto out;
+		for (i = 0; i < n; ++i) {
+			if (snapgetstr(&r, &name) < 0 || !name)
+				goto out;
+			if (*name == '-') {
+				if (apply)
+					envunset(name + 1);
+			} else if (!(val = strchr(name + 1, '='))) {
+				goto out;
+			} else if (apply) {
+				*val = '\0';
+				if (envset(name + 1, val + 1) < 0)
+					logerr("setenv '%s':", name + 1);
+			}
+			free(name);
+			name = NULL;
+			val = NULL;
+		}
+
+		if (snapget(&r, &n, sizeof(n)) < 0)
+			goto out;
+		for (i = 0; i < n; ++i) {
+			if (snapgetstr(&r, &name) < 0 || !name
+					|| snapget(&r, &isarray,
+						sizeof(isarray)) < 0)
+				goto out;
+			if (!isarray) {
+				if (snapgetstr(&r, &val) < 0 || !val)
+					goto out;
+				if (apply)
+					varset(name, val);
+				free(val);
+				val = NULL;
+			} else {
+				if (snapget(&r, &nitems, sizeof(nitems)) < 0
+						|| nitems > (size_t)(r.end - r.p)
+						/ (sizeof(u) + sizeof(uint32_t))
+						|| !(items = wemallocarray(
+							(size_t)(nitems) + 1,
+							sizeof(char *))))
+					goto out;
+				if (!(idx = wemallocarray(
+							(size_t)(nitems) + 1,
+							sizeof(*idx)))) {
+					free(items);
+					goto out;
+				}
+				/* the indexes have to be increasing */
+				for (j = 0; j < nitems; ++j) {
+					if (snapget(&r, &u, sizeof(u)) < 0
+							|| u >= SIZE_MAX
+							|| (j && u <= idx[j
+								- 1])
+							|| snapgetstr(&r,
+								&items[j]) < 0
+							|| !items[j]) {
+						while (j--)
+							free(items[j]);
+						free(items);
+						free(idx);
+						goto out;
+					}
+					idx[j] = (size_t)(u);
+				}
+				if (apply) {
+					/* it takes the items */
+					varsetarray(name, items, idx,
+							nitems);
+				} else {
+					while (nitems--)
+						free(items[nitems]);
+					free(items);
+					free(idx);
+				}
+			}
+			free(name);
+			name = NULL;
+		}
+
+		if (snapget(&r, &n, sizeof(n)) < 0)
+			goto out;
+		for (i = 0; i < n; ++i) {
+			if (snapgetstr(&r, &name) < 0 || !name
+					|| snapgettree(&r, &body, 0) < 0)
+				goto out;
+			if (apply)
+				funcdefine(name, body);
+			freetree(body);
+			free(name);
+			name = NULL;
+		}
+	}
+	ret = 1;
+
+out:
+	if (ret < 0)
+		logerr("'%s' is broken", path);
+	free(name);
+	free(val);
+	munmap(map, (size_t)(r.end - (const char *)(map)));
+	return ret;
+}
+
+static char *
+snappath(void)
+{
+	/* the snapshot an interactive shell loads instead of ~/.sushirc */
+	char *dir, *path;
+
+	if (!(dir = cachedir()))
+		return NULL;
+	if ((path = wemalloc(strlen(dir) + 16)))
+		sprintf(path, "%s/sushirc.snap", dir);
+	free(dir);
+	return path;
+}
+
+static int
+snapput(struct snapbuf *b, const void *p, size_t n)
+{
+	return strappend(&b->buf, &b->size, &b->len, p, n);
+}
+
+static int
+snapputfield(struct snapbuf *b, char c, const char *s, size_t len)
+{
+	/* c followed by the len bytes of s, as one string */
+	uint32_t l = (uint32_t)(len + 1);
+
+	if (snapput(b, &l, sizeof(l)) < 0 || snapput(b, &c, 1) < 0)
+		return -1;
+	return snapput(b, s, len);
+}
+
+static int
+snapputstr(struct snapbuf *b, const char *s)
+{
+	uint32_t len = s ? (uint32_t)(strlen(s)) : SNAPSHOT_NULL;
+
+	if (snapput(b, &len, sizeof(len)) < 0)
+		return -1;
+	return s ? snapput(b, s, len) : 0;
+}
+
+static int
+snapputtree(struct snapbuf *b, const struct node *n)
+{
+	/*
+	 * each node of a list is a 1 byte, its type, text, body, cond and
+	 * alt, and a 0 byte ends the list
+	 */
+	uint32_t type;
+
+	for (; n; n = n->next) {
+		type = (uint32_t)(n->type);
+		if (snapput(b, "\1", 1) < 0
+				|| snapput(b, &type, sizeof(type)) < 0
+				|| snapputstr(b, n->text) < 0
+				|| snapputtree(b, n->body) < 0
+				|| snapputtree(b, n->cond) < 0
+				|| snapputtree(b, n->alt) < 0)
+			return -1;
+	}
+	return snapput(b, "", 1);
+}
+
+static int
+snapsave(const char *path)
+{
+	/* write the shell's state for snapload(), see the layout above */
+	struct snapbuf b = {NULL, 0, 0};
+	struct sourced *src;
+	struct function *fn;
+	struct var *v;
+	char **e, **se;
+	char *tmp = NULL;
+	uint64_t u;
+	int64_t i64, times[4];
+	uint32_t n, isarray, nitems;
+	int32_t num[3];
+	size_t i, j, count, len;
+	int fd = -1, ret = -1;
+
+	num[0] = startopts;
+	u = snapenvhash(startenv);
+	if (snapput(&b, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) < 0
+			|| snapput(&b, num, sizeof(*num)) < 0
+			|| snapput(&b, &u, sizeof(u)) < 0)
+		goto end;
+
+	for (n = 0, src = sourcecache; src; src = src->next)
+		++n;
+	if (snapput(&b, &n, sizeof(n)) < 0)
+		goto end;
+	for (src = sourcecache; src; src = src->next) {
+		if (snapputstr(&b, src->path) < 0)
+			goto end;
+		u = (uint64_t)(src->dev);
+		if (snapput(&b, &u, sizeof(u)) < 0)
+			goto end;
+		u = (uint64_t)(src->ino);
+		if (snapput(&b, &u, sizeof(u)) < 0)
+			goto end;
+		times[0] = src->racy ? -1 : (int64_t)(src->mtime.tv_sec);
+		times[1] = (int64_t)(src->mtime.tv_nsec);
+		times[2] = (int64_t)(src->ctime.tv_sec);
+		times[3] = (int64_t)(src->ctime.tv_nsec);
+		if (snapput(&b, times, sizeof(times)) < 0)
+			goto end;
+		i64 = (int64_t)(src->size);
+		if (snapput(&b, &i64, sizeof(i64)) < 0)
+			goto end;
+	}
+
+	num[0] = opts;
+	num[1] = pipebuf;
+	num[2] = batchjobs;
+	if (snapput(&b, num, sizeof(num)) < 0
+			|| snapputstr(&b, promptfmt) < 0)
+		goto end;
+
+	/* the environment is saved as what changed since the start */
+	count = b.len;
+	n = 0;
+	if (snapput(&b, &n, sizeof(n)) < 0)
+		goto end;
+	proclock();
+	for (e = environ; *e; ++e) {
+		for (se = startenv; se && *se && strcmp(*se, *e); ++se)
+			;
+		if (se && *se)
+			continue;
+		len = strlen(*e);
+		if (snapputfield(&b, '=', *e, len) < 0) {
+			procunlock();
+			goto end;
+		}
+		++n;
+	}
+	for (se = startenv; se && *se; ++se) {
+		len = strcspn(*se, "=");
+		for (e = environ; *e; ++e)
+			if (!strncmp(*e, *se, len) && (*e)[len] == '=')
+				break;
+		if (*e)
+			continue;
+		if (snapputfield(&b, '-', *se, len) < 0) {
+			procunlock();
+			goto end;
+		}
+		++n;
+	}
+	procunlock();
+	memcpy(b.buf + count, &n, sizeof(n));
+
+	count = b.len;
+	n = 0;
+	if (snapput(&b, &n, sizeof(n)) < 0)
+		goto end;
+	for (i = 0; i < LEN(variables); ++i) {
+		for (v = variables[i]; v; v = v->next, ++n) {
+			isarray = !!v->items;
+			if (snapputstr(&b, v->name) < 0
+					|| snapput(&b, &isarray,
+						sizeof(isarray)) < 0)
+				goto end;
+			if (!isarray) {
+				if (snapputstr(&b, v->val ? v->val : "") < 0)
+					goto end;
+				continue;
+			}
+			nitems = (uint32_t)(v->nitems);
+			if (snapput(&b, &nitems, sizeof(nitems)) < 0)
+				goto end;
+			for (j = 0; j < v->nitems; ++j) {
+				u = (uint64_t)(v->index[j]);
+				if (snapput(&b, &u, sizeof(u)) < 0
+						|| snapputstr(&b, v->items[j])
+						< 0)
+					goto end;
+			}
+		}
+	}
+	memcpy(b.buf + count, &n, sizeof(n));
+
+	count = b.len;
+	n = 0;
+	if (snapput(&b, &n, sizeof(n)) < 0)
+		goto end;
+	for (i = 0; i < LEN(functions); ++i) {
+		for (fn = functions[i]; fn; fn = fn->next, ++n)
+			if (snapputstr(&b, fn->name) < 0
+					|| snapputtree(&b, fn->body) < 0)
+				goto end;
+	}
+	memcpy(b.buf + count, &n, sizeof(n));
+
+	/* replace it in one go, a shell could be starting right now */
+	if (!(tmp = wemalloc(strlen(path) + 32)))
+		goto end;
+	sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					0600)) < 0) {
+		logerr("open '%s':", tmp);
+		goto end;
+	}
+	if (write(fd, b.buf, b.len) != (ssize_t)(b.len)) {
+		logerr("write '%s':", tmp);
+		goto end;
+	}
+	if (rename(tmp, path) < 0) {
+		logerr("rename '%s':", tmp);
+		goto end;
+	}
+	ret = 0;
+
+end:
+	if (fd >= 0)
+		close(fd);
+	if (ret < 0 && tmp)
+		unlink(tmp);
+	free(tmp);
+	free(b.buf);
+	return ret;
+}
+
+/*
+ * ===========================================================================
+ * arithmetic expansion functions
+ */
+static struct arith *
+arithcompile(const char *s, size_t len)
+{
+	/*
+	 * return the parsed form of the arithmetic expression s, which is
+	 * len bytes long. compiled expressions are cached by their text,
+	 * so the same expression in a loop or a function is only parsed
+	 * once.
+	 */
+	struct arithexpr *e = &arithcache[strhash(s, len) % LEN(arithcache)];
+	struct arith *tree;
+	const char *p;
+	char *text;
+
+	if (e->text && e->len == len && !memcmp(e->text, s, len))
+		return e->tree;
+
+	if (!(text = westrndup(s, len)))
+		return NULL;
+	p = text;
+	while (isspace((unsigned char)(*p)))
+		++p;
+	if (!*p) {
+		/* an empty expression is 0 */
+		if (arithnew(ARITH_NUM, NULL, NULL, &tree) < 0) {
+			free(text);
+			return NULL;
+		}
+		tree->num = 0;
+	} else if (arithparse(&p, 1, &tree) < 0) {
+		free(text);
+		return NULL;
+	}
+	while (isspace((unsigned char)(*p)))
+		++p;
+	if (*p) {
+		aritherr(p);
+		arithfree(tree);
+		free(text);
+		return NULL;
+	}
+
+	free(e->text);
+	arithfree(e->tree);
+	e->text = text;
+	e->len = len;
+	e->tree = tree;
+	return tree;
+}
+
+static int
+aritherr(const char *p)
+{
+	if (*p)
+		fprintf(stderr, "syntax error: unexpected '%.*s' in arithmetic "
+				"expression\n", (int)(strcspn(p, " \t\n")), p);
+	else
+		fputs("syntax error: unexpected end of arithmetic "
+				"expression\n", stderr);
+	return -1;
+}
+
+static int
+aritheval(const struct arith *a, int64_t *res)
+{
+	/*
+	 * evaluate a compiled expression. overflow wraps around, like it
+	 * would on the machine with two's complement integers.
+	 */
+	int64_t x, y;
+	uint64_t ux, uy;
+
+	switch (a->op) {
+	case ARITH_NUM:
+		*res = a->num;
+		return 0;
+	case ARITH_VAR:
+	case ARITH_PARAM:
+		return arithvar(a, res);
+	case ARITH_NEG:
+		if (aritheval(a->a, &x) < 0)
+			return -1;
+		*res = (int64_t)(0 - (uint64_t)(x));
+		return 0;
+	case ARITH_NOT:
+		if (aritheval(a->a, &x) < 0)
+			return -1;
+		*res = !x;
+		return 0;
+	case ARITH_COMPL:
+		if (aritheval(a->a, &x) < 0)
+			return -1;
+		*res = ~x;
+		return 0;
+	case ARITH_PREINC:
+	case ARITH_PREDEC:
+	case ARITH_POSTINC:
+	case ARITH_POSTDEC:
+		if (arithvar(a->a, &x) < 0)
+			return -1;
+		if (a->op == ARITH_PREINC || a->op == ARITH_POSTINC)
+			y = (int64_t)((uint64_t)(x) + 1);
+		else
+			y = (int64_t)((uint64_t)(x) - 1);
+		if (arithset(a->a->name, y) < 0)
+			return -1;
+		*res = (a->op == ARITH_PREINC || a->op == ARITH_PREDEC) ? y : x;
+		return 0;
+	case ARITH_AND:
+	case ARITH_OR:
+		/* only evaluate the right side if needed */
+		if (aritheval(a->a, &x) < 0)
+			return -1;
+		if ((a->op == ARITH_AND) ? !x : !!x) {
+			*res = !!x;
+			return 0;
+		}
+		if (aritheval(a->b, &y) < 0)
+			return -1;
+		*res = !!y;
+		return 0;
+	case ARITH_COND:
+		if (aritheval(a->a, &x) < 0)
+			return -1;
+		return aritheval(x ? a->b : a->c, res);
+	case ARITH_COMMA:
+		if (aritheval(a->a, &x) < 0)
+			return -1;
+		return aritheval(a->b, res);
+	case ARITH_ASSIGN:
+		if (aritheval(a->b, &y) < 0)
+			return -1;
+		if (a->binop != ARITH_ASSIGN) {
+			struct arith op;
+			struct arith lhs, rhs;
+			if (arithvar(a->a, &x) < 0)
+				return -1;
+			lhs.op = ARITH_NUM;
+			lhs.num = x;
+			rhs.op = ARITH_NUM;
+			rhs.num = y;
+			op.op = a->binop;
+			op.a = &lhs;
+			op.b = &rhs;
+			if (aritheval(&op, &y) < 0)
+				return -1;
+		}
+		*res = y;
+		return arithset(a->a->name, y);
+	default:
+		break;
+	}
+
+	/* binary operators */
+	if (aritheval(a->a, &x) < 0 || aritheval(a->b, &y) < 0)
+		return -1;
+	ux = (uint64_t)(x);
+	uy = (uint64_t)(y);
+	switch (a->op) {
+	case ARITH_MUL:
+		*res = (int64_t)(ux * uy);
+		break;
+	case ARITH_DIV:
+	case ARITH_MOD:
+		if (y == 0) {
+			logerr("division by zero");
+			return -1;
+		}
+		if (x == INT64_MIN && y == -1)
+			*res = (a->op == ARITH_DIV) ? x : 0;
+		else
+			*res = (a->op == ARITH_DIV) ? x / y : x % y;
+		break;
+	case ARITH_ADD:
+		*res = (int64_t)(ux + uy);
+		break;
+	case ARITH_SUB:
+		*res = (int64_t)(ux - uy);
+		break;
+	case ARITH_SHL:
+		*res = (int64_t)(ux << (uy & 63));
+		break;
+	case ARITH_SHR:
+		*res = x >> (uy & 63);
+		break;
+	case ARITH_LT:
+		*res = x < y;
+		break;
+	case ARITH_LE:
+		*res = x <= y;
+		break;
+	case ARITH_GT:
+		*res = x > y;
+		break;
+	case ARITH_GE:
+		*res = x >= y;
+		break;
+	case ARITH_EQ:
+		*res = x == y;
+		break;
+	case ARITH_NE:
+		*res = x != y;
+		break;
+	case ARITH_BAND:
+		*res = x & y;
+		break;
+	case ARITH_BXOR:
+		*res = x ^ y;
+		break;
+	case ARITH_BOR:
+		*res = x | y;
+		break;
+	default:
+		logerr("bad arithmetic operator %d", (int)(a->op));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+arithfree(struct arith *a)
+{
+	if (a) {
+		arithfree(a->a);
+		arithfree(a->b);
+		arithfree(a->c);
+		free(a->name);
+		free(a);
+	}
+}
+
+static char *
+arithfmt(int64_t n, char *buf)
+{
+	/*
+	 * format n in decimal into buf, which must have room for 21
+	 * characters. printf() can't be used for this in C89.
+	 */
+	uint64_t u = (n < 0) ? 0 - (uint64_t)(n) : (uint64_t)(n);
+	char tmp[21];
+	size_t i = 0, j = 0;
+
+	do {
+		tmp[i++] = (char)('0' + (int)(u % 10));
+		u /= 10;
+	} while (u);
+	if (n < 0)
+		buf[j++] = '-';
+	while (i)
+		buf[j++] = tmp[--i];
+	buf[j] = '\0';
+	return buf;
+}
+
+static int
+arithnew(enum arithop op, struct arith *a, struct arith *b,
+		struct arith **res)
+{
+	if (!(*res = wemalloc(sizeof(**res)))) {
+		arithfree(a);
+		arithfree(b);
+		return -1;
+	}
+	(*res)->op = op;
+	(*res)->binop = op;
+	(*res)->num = 0;
+	(*res)->name = NULL;
+	(*res)->a = a;
+	(*res)->b = b;
+	(*res)->c = NULL;
+	return 0;
+}
+
+static int
+arithnum(const char *s, int64_t *res, const char **end)
+{
+	/*
+	 * parse an integer constant in decimal, octal (0 prefix) or
+	 * hexadecimal (0x prefix), like in C. if end is NULL, the whole
+	 * string has to be a number, optionally signed and surrounded by
+	 * whitespace, and an empty string is 0.
+	 */
+	uint64_t u = 0;
+	unsigned int base = 10, digit;
+	int neg = 0;
+	const char *p = s;
+
+	if (!end) {
+		while (isspace((unsigned char)(*p)))
+			++p;
+		if (*p == '-' || *p == '+')
+			neg = (*p++ == '-');
+	}
+	if (!end && !*p) {
+		*res = 0;
+		return 0;
+	}
+	if (!isdigit((unsigned char)(*p)))
+		return -1;
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')
+			&& isxdigit((unsigned char)(p[2]))) {
+		base = 16;
+		p += 2;
+	} else if (p[0] == '0') {
+		base = 8;
+	}
+	for (;; ++p) {
+		if (isdigit((unsigned char)(*p)))
+			digit = (unsigned int)(*p - '0');
+		else if (base == 16 && isxdigit((unsigned char)(*p)))
+			digit = (unsigned int)(tolower((unsigned char)(*p))
+					- 'a' + 10);
+		else
+			break;
+		if (digit >= base)
+			return -1;
+		u = u * base + digit;
+	}
+	if (end) {
+		if (isalnum((unsigned char)(*p)) || *p == '_')
+			return -1;
+		*end = p;
+	} else {
+		while (isspace((unsigned char)(*p)))
+			++p;
+		if (*p)
+			return -1;
+	}
+	*res = (int64_t)(neg ? 0 - u : u);
+	return 0;
+}
+
+static int
+arithparse(const char **pp, int minprec, struct arith **res)
+{
+	/*
+	 * parse a (sub)expression whose operators bind at least as tightly
+	 * as minprec, with the usual C precedence and associativity.
+	 */
+	const struct arithinfix *inf;
+	struct arith *left, *mid, *right;
+	const char *p;
+	size_t i;
+
+	if (arithunary(pp, &left) < 0)
+		return -1;
+	for (;;) {
+		p = *pp;
+		while (isspace((unsigned char)(*p)))
+			++p;
+		inf = NULL;
+		for (i = 0; i < LEN(arithinfixes); ++i) {
+			if (!strncmp(p, arithinfixes[i].str,
+					strlen(arithinfixes[i].str))) {
+				inf = &arithinfixes[i];
+				break;
+			}
+		}
+		if (!inf || inf->prec < minprec)
+			break;
+		p += strlen(inf->str);
+
+		if (inf->op == ARITH_ASSIGN && left->op != ARITH_VAR) {
+			fprintf(stderr, "syntax error: assignment to a "
+					"non-variable in arithmetic "
+					"expression\n");
+			arithfree(left);
+			return -1;
+		}
+		if (inf->op == ARITH_COND) {
+			/* a ? b : c, right associative */
+			if (arithparse(&p, 1, &mid) < 0) {
+				arithfree(left);
+				return -1;
+			}
+			while (isspace((unsigned char)(*p)))
+				++p;
+			if (*p != ':') {
+				arithfree(left);
+				arithfree(mid);
+				return aritherr(p);
+			}
+			++p;
+			if (arithparse(&p, inf->prec, &right) < 0) {
+				arithfree(left);
+				arithfree(mid);
+				return -1;
+			}
+			if (arithnew(ARITH_COND, left, mid, &left) < 0) {
+				arithfree(right);
+				return -1;
+			}
+			left->c = right;
+		} else {
+			/* assignments are right associative */
+			if (arithparse(&p, (inf->op == ARITH_ASSIGN) ? inf->prec
+					: inf->prec + 1, &right) < 0) {
+				arithfree(left);
+				return -1;
+			}
+			if (arithnew(inf->op, left, right, &left) < 0)
+				return -1;
+			left->binop = inf->binop;
+		}
+		*pp = p;
+	}
+	*res = left;
+	return 0;
+}
+
+static int
+arithprimary(const char **pp, struct arith **res)
+{
+	/* numbers, variables and parenthesized expressions */
+	const char *p = *pp;
+	const char *end;
+	struct arith *a;
+
+	while (isspace((unsigned char)(*p)))
+		++p;
+	if (*p == '(') {
+		++p;
+		if (arithparse(&p, 1, &a) < 0)
+			return -1;
+		while (isspace((unsigned char)(*p)))
+			++p;
+		if (*p != ')') {
+			arithfree(a);
+			return aritherr(p);
+		}
+		++p;
+	} else if (isdigit((unsigned char)(*p))) {
+		if (arithnew(ARITH_NUM, NULL, NULL, &a) < 0)
+			return -1;
+		if (arithnum(p, &a->num, &end) < 0) {
+			arithfree(a);
+			fprintf(stderr, "syntax error: bad number '%.*s' in "
+					"arithmetic expression\n",
+					(int)(strspn(p, "0123456789abcdefABCDEF"
+						"xX_")), p);
+			return -1;
+		}
+		p = end;
+	} else if (*p == '$' && isdigit((unsigned char)(p[1]))) {
+		/* positional parameters can only be read */
+		if (arithnew(ARITH_PARAM, NULL, NULL, &a) < 0)
+			return -1;
+		for (++p; isdigit((unsigned char)(*p)); ++p)
+			a->num = a->num * 10 + (*p - '0');
+	} else if (*p == '$' && p[1] && strchr("#?$", p[1])) {
+		if (arithnew(ARITH_PARAM, NULL, NULL, &a) < 0)
+			return -1;
+		if (!(a->name = westrndup(p + 1, 1))) {
+			arithfree(a);
+			return -1;
+		}
+		p += 2;
+	} else if (isalpha((unsigned char)(p[*p == '$']))
+			|| p[*p == '$'] == '_') {
+		/* the $ in front of variable names is optional */
+		if (*p == '$')
+			++p;
+		for (end = p; isalnum((unsigned char)(*end)) || *end == '_';
+				++end)
+			;
+		if (arithnew(ARITH_VAR, NULL, NULL, &a) < 0)
+			return -1;
+		if (!(a->name = westrndup(p, (size_t)(end - p)))) {
+			arithfree(a);
+			return -1;
+		}
+		p = end;
+	} else {
+		return aritherr(p);
+	}
+
+	/* postfix increment and decrement */
+	while (isspace((unsigned char)(*p)))
+		++p;
+	if (a->op == ARITH_VAR && (!strncmp(p, "++", 2)
+				|| !strncmp(p, "--", 2))) {
+		if (arithnew((*p == '+') ? ARITH_POSTINC : ARITH_POSTDEC, a,
+				NULL, &a) < 0)
+			return -1;
+		for (p += 2; isspace((unsigned char)(*p)); ++p)
+			;
+	}
+	*pp = p;
+	*res = a;
+	return 0;
+}
+
+static int
+arithset(const char *name, int64_t n)
+{
+	char buf[21];
+	return varset(name, arithfmt(n, buf));
+}
+
+static int
+arithunary(const char **pp, struct arith **res)
+{
+	/* prefix operators, which bind tighter than any infix one */
+	const char *p = *pp;
+	struct arith *a;
+	enum arithop op;
+
+	while (isspace((unsigned char)(*p)))
+		++p;
+	if (!strncmp(p, "++", 2) || !strncmp(p, "--", 2)) {
+		op = (*p == '+') ? ARITH_PREINC : ARITH_PREDEC;
+		p += 2;
+		if (arithunary(&p, &a) < 0)
+			return -1;
+		if (a->op != ARITH_VAR) {
+			arithfree(a);
+			fprintf(stderr, "syntax error: %s on a non-variable "
+					"in arithmetic expression\n",
+					(op == ARITH_PREINC) ? "++" : "--");
+			return -1;
+		}
+	} else if (*p && strchr("+-!~", *p)) {
+		op = (*p == '-') ? ARITH_NEG : (*p == '!') ? ARITH_NOT
+			: (*p == '~') ? ARITH_COMPL : ARITH_NUM;
+		++p;
+		if (arithunary(&p, &a) < 0)
+			return -1;
+		if (op == ARITH_NUM) {
+			/* unary plus does nothing */
+			*pp = p;
+			*res = a;
+			return 0;
+		}
+	} else {
+		return arithprimary(pp, res);
+	}
+	if (arithnew(op, a, NULL, res) < 0)
+		return -1;
+	*pp = p;
+	return 0;
+}
+
+static int
+arithvar(const struct arith *a, int64_t *res)
+{
+	/* read the value of a variable or parameter */
+	const char *val;
+
+	if (a->op == ARITH_PARAM && a->name) {
+		*res = (*a->name == '#') ? (int64_t)(curframe->argc)
+			: (*a->name == '?') ? lastexit : (int64_t)(getpid());
+		return 0;
+	} else if (a->op == ARITH_PARAM) {
+		val = (a->num == 0) ? argv0 : ((uint64_t)(a->num)
+				<= curframe->argc) ? curframe->argv[a->num - 1]
+				: "";
+	} else {
+		val = varget(a->name);
+	}
+	if (!val)
+		val = "";
+	if (arithnum(val, res, NULL) < 0) {
+		logerr("'%s' is not a number", val);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * ===========================================================================
+ * conditional expression functions
+ */
+static int
+condaccess(const struct stat *st, int bits)
+{
+	/*
+	 * check if a file can be accessed like access(2) would, but from
+	 * its mode so -r, -w and -x can use the stat() that was already
+	 * done instead of another system call. bits is a combination of
+	 * 4 (read), 2 (write) and 1 (execute). ACLs are not checked.
+	 */
+	int shift = 0, i;
+
+	if (ngroups < 0) {
+		euid = geteuid();
+		egid = getegid();
+		ngroups = getgroups(0, NULL);
+		if (ngroups > 0 && (groups = wemallocarray((size_t)(ngroups),
+						sizeof(gid_t))))
+			ngroups = getgroups(ngroups, groups);
+		else
+			ngroups = 0;
+		if (ngroups < 0)
+			ngroups = 0;
+	}
+
+	if (euid == 0)
+		return !(bits & 1) || S_ISDIR(st->st_mode)
+			|| (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+	if (st->st_uid == euid) {
+		shift = 6;
+	} else if (st->st_gid == egid) {
+		shift = 3;
+	} else {
+		for (i = 0; i < ngroups; ++i) {
+			if (st->st_gid == groups[i]) {
+				shift = 3;
+				break;
 			}
-			if (*(ptr + 1) == '\0') {
-				if (i + 1 >= cmd->argc) {
-					fputs("syntax error: missing "
-						"redirection target\n",
-						stderr);
-					return -1;
-				}
-				redir_target = cmd->argv[i + 1];
+		}
+	}
+	return ((int)(st->st_mode >> shift) & bits) == bits;
+}
+
+static struct cond *
+condcompile(const char *s)
+{
+	/*
+	 * return the parsed form of the [[ ]] expression s. like
+	 * arithmetic expressions, they're cached by their text.
+	 */
+	struct condexpr *e = &condcache[strhash(s, strlen(s))
+		% LEN(condcache)];
+	struct condtok *toks;
+	struct cond *tree = NULL;
+	size_t i = 0;
+	char *text;
+
+	if (e->text && !strcmp(e->text, s))
+		return e->tree;
+
+	if (condtokenize(s, &toks) < 0)
+		return NULL;
+	if (!toks[0].s) {
+		conderr(NULL);
+	} else if (condparse(toks, &i, 0, &tree) < 0) {
+		tree = NULL;
+	} else if (toks[i].s) {
+		conderr(toks[i].s);
+		condfree(tree);
+		tree = NULL;
+	}
+	for (i = 0; toks[i].s; ++i)
+		free(toks[i].s);
+	free(toks);
+	if (!tree)
+		return NULL;
+	if (!(text = westrdup(s))) {
+		condfree(tree);
+		return NULL;
+	}
+
+	free(e->text);
+	condfree(e->tree);
+	e->text = text;
+	e->tree = tree;
+	return tree;
+}
+
+static int
+conderr(const char *tok)
+{
+	if (tok)
+		fprintf(stderr, "syntax error: unexpected '%s' in conditional "
+				"expression\n", tok);
+	else
+		fputs("syntax error: unexpected end of conditional "
+				"expression\n", stderr);
+	return -1;
+}
+
+static int
+condeval(const struct cond *c, struct condstat *cs)
+{
+	/*
+	 * evaluate a compiled expression, returns 1 if it's true, 0 if
+	 * it's false and -1 on error. operands are only expanded when
+	 * they're needed, so the right side of && and || may not be.
+	 */
+	struct stat *st, lst;
+	struct arith *a;
+	char *l, *r = NULL;
+	int64_t x, y;
+	int ret = -1, lerr, mode = 0;
+	regex_t *re;
+
+	switch (c->op) {
+	case COND_OR:
+	case COND_AND:
+		if ((ret = condeval(c->a, cs)) < 0)
+			return -1;
+		if ((c->op == COND_AND) ? !ret : ret)
+			return ret;
+		return condeval(c->b, cs);
+	case COND_NOT:
+		if ((ret = condeval(c->a, cs)) < 0)
+			return -1;
+		return !ret;
+	default:
+		break;
+	}
+
+	if (c->op == COND_MATCH || c->op == COND_NOMATCH)
+		mode = 1;
+	else if (c->op == COND_REGEX)
+		mode = 2;
+	if (!(l = condword(c->l, 0)))
+		return -1;
+	if (c->r && !(r = condword(c->r, mode))) {
+		free(l);
+		return -1;
+	}
+
+	switch (c->op) {
+	case COND_NONEMPTY:
+		ret = !!*l;
+		break;
+	case COND_EMPTY:
+		ret = !*l;
+		break;
+	case COND_FILE:
+		ret = condfile(c->flag, l, cs);
+		break;
+	case COND_TTY:
+		ret = isatty(atoi(l));
+		break;
+	case COND_MATCH:
+	case COND_NOMATCH:
+		ret = (fnmatch(r, l, 0) == 0) == (c->op == COND_MATCH);
+		break;
+	case COND_LT:
+		ret = strcmp(l, r) < 0;
+		break;
+	case COND_GT:
+		ret = strcmp(l, r) > 0;
+		break;
+	case COND_REGEX:
+		if ((re = condregex(r)))
+			ret = !regexec(re, l, 0, NULL, 0);
+		break;
+	case COND_EQ:
+	case COND_NE:
+	case COND_ILT:
+	case COND_ILE:
+	case COND_IGT:
+	case COND_IGE:
+		/* the operands are arithmetic expressions */
+		if (!(a = arithcompile(l, strlen(l))) || aritheval(a, &x) < 0
+				|| !(a = arithcompile(r, strlen(r)))
+				|| aritheval(a, &y) < 0)
+			break;
+		switch (c->op) {
+		case COND_EQ:
+			ret = x == y;
+			break;
+		case COND_NE:
+			ret = x != y;
+			break;
+		case COND_ILT:
+			ret = x < y;
+			break;
+		case COND_ILE:
+			ret = x <= y;
+			break;
+		case COND_IGT:
+			ret = x > y;
+			break;
+		default:
+			ret = x >= y;
+			break;
+		}
+		break;
+	case COND_NT:
+	case COND_OT:
+	case COND_EF:
+		if ((lerr = condstat(l, 0, cs, &st)) < 0)
+			break;
+		lst = *st;
+		if ((ret = condstat(r, 0, cs, &st)) < 0)
+			break;
+		if (c->op == COND_NT)
+			ret = !lerr && (ret || lst.st_mtime > st->st_mtime);
+		else if (c->op == COND_OT)
+			ret = !ret && (lerr || lst.st_mtime < st->st_mtime);
+		else
+			ret = !lerr && !ret && lst.st_dev == st->st_dev
+				&& lst.st_ino == st->st_ino;
+		break;
+	default:
+		break;
+	}
+	free(l);
+	free(r);
+	return ret;
+}
+
+static int
+condfile(char flag, const char *path, struct condstat *cs)
+{
+	struct stat *st;
+	int ret = condstat(path, flag == 'h' || flag == 'L', cs, &st);
+
+	if (ret)
+		return (ret < 0) ? -1 : 0;
+	switch (flag) {
+	case 'b':
+		return S_ISBLK(st->st_mode);
+	case 'c':
+		return S_ISCHR(st->st_mode);
+	case 'd':
+		return S_ISDIR(st->st_mode);
+	case 'f':
+		return S_ISREG(st->st_mode);
+	case 'g':
+		return !!(st->st_mode & S_ISGID);
+	case 'h':
+	case 'L':
+		return S_ISLNK(st->st_mode);
+	case 'k':
+#if defined(S_ISVTX)
+		return !!(st->st_mode & S_ISVTX);
+#else
+		return 0;
+#endif /* S_ISVTX */
+	case 'p':
+		return S_ISFIFO(st->st_mode);
+	case 'r':
+		return condaccess(st, 4);
+	case 's':
+		return st->st_size > 0;
+	case 'S':
+		return S_ISSOCK(st->st_mode);
+	case 'u':
+		return !!(st->st_mode & S_ISUID);
+	case 'w':
+		return condaccess(st, 2);
+	case 'x':
+		return condaccess(st, 1);
+	case 'O':
+		condaccess(st, 0);
+		return st->st_uid == euid;
+	case 'G':
+		condaccess(st, 0);
+		return st->st_gid == egid;
+	default:
+		/* -e */
+		return 1;
+	}
+}
+
+static void
+condfree(struct cond *c)
+{
+	if (c) {
+		free(c->l);
+		free(c->r);
+		condfree(c->a);
+		condfree(c->b);
+		free(c);
+	}
+}
+
+static int
+condnew(enum condop op, struct cond **res)
+{
+	if (!(*res = wemalloc(sizeof(**res))))
+		return -1;
+	(*res)->op = op;
+	(*res)->flag = '\0';
+	(*res)->l = NULL;
+	(*res)->r = NULL;
+	(*res)->a = NULL;
+	(*res)->b = NULL;
+	return 0;
+}
+
+static int
+condparse(struct condtok *toks, size_t *i, int prec, struct cond **res)
+{
+	/*
+	 * parse an expression starting at toks[*i]. prec is 0 for a list
+	 * of || operators, 1 for && which binds tighter, and 2 for the
+	 * operand of a !.
+	 */
+	struct cond *c, *rhs;
+	const char *op = prec ? "&&" : "||";
+
+	if (prec == 2) {
+		if (toks[*i].s && !toks[*i].op && !strcmp(toks[*i].s, "!")) {
+			++*i;
+			if (condparse(toks, i, 2, &rhs) < 0)
+				return -1;
+			if (condnew(COND_NOT, res) < 0) {
+				condfree(rhs);
+				return -1;
+			}
+			(*res)->a = rhs;
+			return 0;
+		}
+		return condprimary(toks, i, res);
+	}
+
+	if (condparse(toks, i, prec + 1, &c) < 0)
+		return -1;
+	while (toks[*i].s && toks[*i].op && !strcmp(toks[*i].s, op)) {
+		++*i;
+		if (condparse(toks, i, prec + 1, &rhs) < 0) {
+			condfree(c);
+			return -1;
+		}
+		if (condnew(prec ? COND_AND : COND_OR, res) < 0) {
+			condfree(c);
+			condfree(rhs);
+			return -1;
+		}
+		(*res)->a = c;
+		(*res)->b = rhs;
+		c = *res;
+	}
+	*res = c;
+	return 0;
+}
+
+static int
+condprimary(struct condtok *toks, size_t *i, struct cond **res)
+{
+	/*
+	 * parse a parenthesized expression, a test with a unary or binary
+	 * operator, or a word on its own which is true if it's not empty
+	 */
+	struct condtok *t = &toks[*i];
+	enum condop op = COND_NONEMPTY;
+	char flag = '\0';
+	size_t j, n = 1;
+
+	if (!t->s)
+		return conderr(NULL);
+	if (t->op) {
+		if (strcmp(t->s, "("))
+			return conderr(t->s);
+		++*i;
+		if (condparse(toks, i, 0, res) < 0)
+			return -1;
+		if (!toks[*i].s || strcmp(toks[*i].s, ")")) {
+			condfree(*res);
+			return conderr(toks[*i].s);
+		}
+		++*i;
+		return 0;
+	}
+
+	if (t[1].s && !t[1].op) {
+		for (j = 0; j < LEN(condbinops); ++j) {
+			if (!strcmp(t[1].s, condbinops[j].str)) {
+				if (!t[2].s || t[2].op)
+					return conderr(t[2].s);
+				op = condbinops[j].op;
+				n = 3;
+				break;
+			}
+		}
+		if (n == 1 && t->s[0] == '-' && t->s[1] && !t->s[2]) {
+			n = 2;
+			if (strchr("bcdefghkprsuwxGLOS", t->s[1])) {
+				op = COND_FILE;
+				flag = t->s[1];
+			} else if (t->s[1] == 'n') {
+				op = COND_NONEMPTY;
+			} else if (t->s[1] == 'z') {
+				op = COND_EMPTY;
+			} else if (t->s[1] == 't') {
+				op = COND_TTY;
 			} else {
-				redir_target = ptr + 1;
+				return conderr(t->s);
+			}
+		}
+	}
+
+	if (condnew(op, res) < 0)
+		return -1;
+	(*res)->flag = flag;
+	if (!((*res)->l = westrdup(t[n == 2].s))
+			|| (n == 3 && !((*res)->r = westrdup(t[2].s)))) {
+		condfree(*res);
+		return -1;
+	}
+	*i += n;
+	return 0;
+}
+
+static regex_t *
+condregex(const char *pattern)
+{
+	/*
+	 * return the compiled form of an extended regular expression,
+	 * cached by the pattern so a =~ in a loop is compiled once
+	 */
+	struct regexcache *e = &regexcache[strhash(pattern, strlen(pattern))
+		% LEN(regexcache)];
+	char msg[256];
+	char *dup;
+	int err;
+
+	if (e->pattern && !strcmp(e->pattern, pattern))
+		return &e->re;
+
+	if (!(dup = westrdup(pattern)))
+		return NULL;
+	if (e->pattern) {
+		free(e->pattern);
+		regfree(&e->re);
+		e->pattern = NULL;
+	}
+	if ((err = regcomp(&e->re, pattern, REG_EXTENDED | REG_NOSUB))) {
+		regerror(err, &e->re, msg, sizeof(msg));
+		logerr("bad regular expression '%s': %s", pattern, msg);
+		free(dup);
+		return NULL;
+	}
+	e->pattern = dup;
+	return &e->re;
+}
+
+static int
+condrun(const char *s)
+{
+	/* run a [[ ]] command and return its exit status */
+	struct condstat cs;
+	struct cond *c;
+	int ret;
+
+	if (!(c = condcompile(s)))
+		return MISC_FAILURE_STATUS;
+	cs.path[0] = cs.path[1] = NULL;
+	ret = condeval(c, &cs);
+	free(cs.path[0]);
+	free(cs.path[1]);
+	return (ret < 0) ? MISC_FAILURE_STATUS : !ret;
+}
+
+static int
+condstat(const char *path, int link, struct condstat *cs, struct stat **st)
+{
+	/*
+	 * stat() or lstat() a file, reusing the result if it's the same
+	 * file as last time. returns 0 if it exists, 1 if it doesn't and
+	 * -1 on error.
+	 */
+	if (!cs->path[link] || strcmp(cs->path[link], path)) {
+		free(cs->path[link]);
+		if (!(cs->path[link] = westrdup(path)))
+			return -1;
+		cs->err[link] = (link ? lstat(path, &cs->st[link])
+				: stat(path, &cs->st[link])) < 0;
+	}
+	*st = &cs->st[link];
+	return cs->err[link];
+}
+
+static int
+condtokenize(const char *s, struct condtok **toks)
+{
+	/*
+	 * split a [[ ]] expression into words and operators, terminated
+	 * by a token with a NULL string. quotes are kept in the words
+	 * until they're expanded. the right side of =~ is a single word
+	 * even if it has parentheses or |, like ^(a|b)$.
+	 */
+	struct condtok *t = NULL, *newt;
+	size_t n = 0, size = 0;
+	const char *p = s, *start;
+	char quote;
+	int regex = 0;
+
+	for (;;) {
+		p += strspn(p, " \t\n");
+		if (n + 1 >= size) {
+			size += ARGV_ALLOC_SIZE;
+			if (!(newt = wereallocarray(t, size, sizeof(*t))))
+				goto fail;
+			t = newt;
+		}
+		if (!*p)
+			break;
+
+		start = p;
+		t[n].op = 1;
+		if (!regex && (*p == '(' || *p == ')')) {
+			++p;
+		} else if (!regex && ((p[0] == '&' && p[1] == '&')
+					|| (p[0] == '|' && p[1] == '|'))) {
+			p += 2;
+		} else {
+			t[n].op = 0;
+			for (quote = '\0'; *p; ++p) {
+				if (*p == '\\' && p[1])
+					++p;
+				else if (quote && *p == quote)
+					quote = '\0';
+				else if (quote)
+					continue;
+				else if (*p == '\'' || *p == '"')
+					quote = *p;
+				else if (*p == ' ' || *p == '\t' || *p == '\n')
+					break;
+				else if (!regex && (*p == '(' || *p == ')'
+						|| (p[0] == '&' && p[1] == '&')
+						|| (p[0] == '|' && p[1] == '|')))
+					break;
 			}
-			if (*redir_target == '&') {
-				if (*(redir_target + 1) == '\0') {
-					fputs("syntax error: missing "
-						"redirection target\n",
+			if (quote) {
+				fputs("syntax error: unclosed quotation\n",
 						stderr);
-					return -1;
-				} else if (!strcmp(redir_target, "&-")) {
-					doclose = 1;
-				} else if (wexstrtoint(&info->redirfds[0],
-							redir_target + 1,
-							10) < 0) {
-					/*
-					 * wexstrtoint already prints a
-					 * message on failure
-					 */
-					return -1;
-				}
-			} else {
-				if (flags & O_CREAT) {
-					info->redirfds[0] = open(redir_target,
-							flags,
-							S_IRUSR | S_IWUSR |
-							S_IRGRP | S_IWGRP |
-							S_IROTH | S_IWOTH);
-				} else {
-					info->redirfds[0] = open(redir_target,
-							flags);
-				}
-				if (info->redirfds[0] < 0) {
-					logerr("open '%s':", redir_target);
-					return -1;
-				}
+				goto fail;
 			}
+		}
+		if (!(t[n].s = westrndup(start, (size_t)(p - start))))
+			goto fail;
+		regex = !t[n].op && !strcmp(t[n].s, "=~");
+		++n;
+	}
+	t[n].s = NULL;
+	*toks = t;
+	return 0;
 
-			if (doclose)
-				info->redirfds[2] = target_fd;
-			else
-				info->redirfds[1] = target_fd;
+fail:
+	while (n--)
+		free(t[n].s);
+	free(t);
+	return -1;
+}
 
-			/*
-			 * if this is not the beginning of the argument
-			 * string, e.g:
-			 *
-			 * will be false for 'cmd > file'
-			 * will be true for 'cmd 2>file'
-			 */
-			if (ptr != cmd->argv[i]) {
-				/*
-				 * if xstrtoint fails target_fd will be
-				 * left unchanged
-				 */
-				char c = *ptr;
-				*ptr = '\0';
-				xstrtoint(&info->redirfds[1 + doclose],
-						cmd->argv[i], 10);
-				*ptr = c;
+static char *
+condword(const char *raw, int mode)
+{
+	/*
+	 * expand an operand and remove its quotes. if mode is 1 the word
+	 * is a pattern and if it's 2 a regular expression, and characters
+	 * that were quoted are escaped so they match themselves.
+	 */
+	static const char *const special[] = {
+		"", "*?[]\\", "\\^$.|?*+()[]{}"
+	};
+	char *exp, *buf = NULL;
+	size_t size = 0, len = 0;
+	const char *p;
+	char quote = '\0';
+	int lit, ret;
+
+	if (expand_params(raw, &exp) < 0)
+		return NULL;
+	ret = strappend(&buf, &size, &len, "", 0);
+	for (p = exp; *p && !ret; ++p) {
+		lit = 1;
+		if (quote == '\'') {
+			if (*p == quote) {
+				quote = '\0';
+				continue;
+			}
+		} else if (*p == '\\' && p[1]
+				&& (!quote || strchr("\\\"$", p[1]))) {
+			++p;
+		} else if (quote) {
+			if (*p == quote) {
+				quote = '\0';
+				continue;
 			}
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+			continue;
+		} else {
+			lit = 0;
 		}
+		if (lit && mode && strchr(special[mode], *p))
+			ret = strappend(&buf, &size, &len, "\\", 1);
+		if (!ret)
+			ret = strappend(&buf, &size, &len, p, 1);
 	}
-
-	if (argend > 0) {
-		cmd->argv[argend] = NULL;
-		cmd->argc = argend;
+	free(exp);
+	if (ret < 0) {
+		free(buf);
+		return NULL;
 	}
-	return 0;
+	return buf;
 }
 
 /*
  * ===========================================================================
- * memory allocation functions for commands
+ * parameter expansion functions
  */
 static int
-alloccmd(size_t slots, struct command *cmd)
+expand_array(char **buf, size_t *size, size_t *len, const char *name,
+		int quote)
 {
-	if (!(cmd->argv = wemallocarray(sizeof(char *), slots)))
+	/*
+	 * expand ${NAME[index]}, ${NAME[@]}, ${NAME[*]} and the length
+	 * of an element or of the array with ${#NAME[...]}. @ and * are
+	 * expanded like $@ and $*.
+	 */
+	const char *sub = strchr(name, '[');
+	const char *val;
+	struct arith *a;
+	char *base;
+	char num[21];
+	size_t sublen = strlen(sub), n, i;
+	int count = (*name == '#');
+	int64_t idx;
+	int ret = 0;
+
+	if (sub[sublen - 1] != ']' || sublen < 3) {
+		fprintf(stderr, "syntax error: bad array subscript '%s'\n",
+				sub);
 		return -1;
-	cmd->orig_argv = cmd->argv;
-	if (!(cmd->dynallocinfo = wemallocarray(sizeof(int), slots)))
+	}
+	if (!(base = westrndup(name + count, (size_t)(sub - name - count))))
 		return -1;
-	return 0;
+
+	if (sublen == 3 && (sub[1] == '@' || sub[1] == '*')) {
+		/* only the elements that are set count */
+		varnth(base, 0, &n);
+		if (count) {
+			sprintf(num, "%lu", (unsigned long)(n));
+			ret = strappend(buf, size, len, num, strlen(num));
+		}
+		for (i = 0, idx = 0; i < n && !count && !ret; ++i) {
+			if (!(val = varnth(base, i, &n)))
+				continue;
+			if (idx++)
+				ret = (quote && sub[1] == '@') ?
+					strappend(buf, size, len, "\" \"", 3)
+					: strappend(buf, size, len, " ", 1);
+			if (!ret)
+				ret = expand_value(buf, size, len, val,
+						!!quote);
+		}
+		free(base);
+		return ret;
+	}
+
+	if (!(a = arithcompile(sub + 1, sublen - 2)) || aritheval(a, &idx) < 0) {
+		free(base);
+		return -1;
+	}
+	/* negative indexes count from the end */
+	varitem(base, 0, &n);
+	if (idx < 0)
+		idx += (int64_t)(n);
+	val = (idx >= 0) ? varitem(base, (size_t)(idx), &n) : NULL;
+	if (count) {
+		sprintf(num, "%lu", (unsigned long)(val ? strlen(val) : 0));
+		ret = strappend(buf, size, len, num, strlen(num));
+	} else if (val) {
+		ret = expand_value(buf, size, len, val, !!quote);
+	}
+	free(base);
+	return ret;
 }
 
 static int
-realloccmd(size_t slots, struct command *cmd)
+expand_arith(char **buf, size_t *size, size_t *len, const char *expr,
+		size_t exprlen)
 {
-	char **oldargv = cmd->argv;
-	int *olddynallocinfo = cmd->dynallocinfo;
-	cmd->argv = wereallocarray(cmd->argv, sizeof(char *), slots);
-	cmd->orig_argv = cmd->argv;
-	if (!cmd->argv) {
-		free(oldargv);
+	struct arith *a;
+	int64_t n;
+	char num[21];
+
+	if (!(a = arithcompile(expr, exprlen)) || aritheval(a, &n) < 0)
 		return -1;
+	arithfmt(n, num);
+	return strappend(buf, size, len, num, strlen(num));
+}
+
+static int
+expand_procsubst(const char *s, char **res)
+{
+	/*
+	 * start the process substitutions <(cmd) and >(cmd) at the start
+	 * of words in s and replace them with the /dev/fd/N paths of their
+	 * pipes in a newly allocated copy. *res is NULL if there aren't
+	 * any, which is most of the time.
+	 */
+	const char *p, *end, *start = s;
+	char *buf = NULL;
+	char path[32];
+	size_t size = 0, len = 0;
+	char quote = '\0', endquote;
+	int depth, fd;
+
+	*res = NULL;
+	if (!strstr(s, "<(") && !strstr(s, ">("))
+		return 0;
+	for (p = s; *p; ++p) {
+		if (*p == '\\' && p[1]) {
+			++p;
+			continue;
+		} else if (quote) {
+			if (*p == quote)
+				quote = '\0';
+			continue;
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+			continue;
+		} else if ((*p != '<' && *p != '>') || p[1] != '('
+				|| (p > s && p[-1] != ' ' && p[-1] != '\t')) {
+			continue;
+		}
+
+		/* find the matching ) */
+		endquote = '\0';
+		depth = 0;
+		for (end = p + 2; *end; ++end) {
+			if (*end == '\\' && end[1])
+				++end;
+			else if (endquote && *end == endquote)
+				endquote = '\0';
+			else if (endquote)
+				continue;
+			else if (*end == '\'' || *end == '"')
+				endquote = *end;
+			else if (*end == '(')
+				++depth;
+			else if (*end == ')' && !depth--)
+				break;
+		}
+		if (!*end) {
+			fputs("syntax error: missing ')'\n", stderr);
+			free(buf);
+			return -1;
+		}
+		if (strappend(&buf, &size, &len, start, (size_t)(p - start)) < 0
+				|| (fd = substart(p + 2, (size_t)(end - p - 2),
+						*p == '>')) < 0) {
+			free(buf);
+			return -1;
+		}
+		sprintf(path, "/dev/fd/%d", fd);
+		if (strappend(&buf, &size, &len, path, strlen(path)) < 0) {
+			free(buf);
+			return -1;
+		}
+		start = end + 1;
+		p = end;
 	}
-	cmd->dynallocinfo = wereallocarray(
-			cmd->dynallocinfo, sizeof(int), slots);
-	if (!cmd->dynallocinfo) {
-		free(olddynallocinfo);
+	if (start == s)
+		return 0;
+	if (strappend(&buf, &size, &len, start, strlen(start)) < 0) {
+		free(buf);
 		return -1;
 	}
+	*res = buf;
 	return 0;
 }
 
-static void
-freecmd(const struct command *cmd)
+static int
+expand_param(char **buf, size_t *size, size_t *len, const char *name,
+		size_t namelen, size_t closelen, char quote)
 {
+	/*
+	 * append the value of the parameter that scanparam() found,
+	 * escaped by expand_value()
+	 */
+	const char *val = NULL;
+	char num[32];
 	size_t i;
-	for (i = 0; cmd->orig_argv[i]; ++i)
-		if (cmd->dynallocinfo[i])
-			free(cmd->orig_argv[i]);
-	free(cmd->orig_argv);
-	free(cmd->dynallocinfo);
+	int ret = 0;
+
+	if (closelen == 2) {
+		ret = expand_arith(buf, size, len, name, namelen);
+	} else if (namelen == 1 && strchr("@*", *name)) {
+		for (i = 0; i < curframe->argc && !ret; ++i) {
+			if (i)
+				ret = (quote && *name == '@') ?
+					strappend(buf, size, len, "\" \"", 3)
+					: strappend(buf, size, len, " ", 1);
+			if (!ret)
+				ret = expand_value(buf, size, len,
+						curframe->argv[i], !!quote);
+		}
+	} else if (namelen == 1 && *name == '#') {
+		sprintf(num, "%lu", (unsigned long)(curframe->argc));
+		val = num;
+	} else if (namelen == 1 && *name == '?') {
+		sprintf(num, "%d", lastexit);
+		val = num;
+	} else if (namelen == 1 && *name == '$') {
+		sprintf(num, "%ld", (long)(getpid()));
+		val = num;
+	} else if (isdigit((unsigned char)(*name))) {
+		for (i = 0; i < namelen && isdigit((unsigned char)(name[i]));
+				++i)
+			;
+		if (i == namelen) {
+			unsigned long n = strtoul(name, NULL, 10);
+			if (n == 0)
+				val = argv0;
+			else if (n <= curframe->argc)
+				val = curframe->argv[n - 1];
+		}
+	} else {
+		char *namedup = westrndup(name, namelen);
+		if (!namedup)
+			ret = -1;
+		else if (closelen && strchr(namedup, '['))
+			ret = expand_array(buf, size, len, namedup, quote);
+		else
+			val = varget(namedup);
+		free(namedup);
+	}
+	if (val && !ret)
+		ret = expand_value(buf, size, len, val, !!quote);
+	return ret;
+}
+
+static int
+expand_params(const char *s, char **res)
+{
+	/*
+	 * expand $1 ... $9, ${n}, $#, $@, $*, $?, $$, $NAME, ${NAME},
+	 * ${NAME[index]} and $((expression)) into a newly allocated copy
+	 * of s.
+	 * quoting works the same as in parsecmd(), and the values are
+	 * escaped so that parsecmd() takes them literally, except for
+	 * spaces outside of double quotes which split them into words.
+	 */
+	const char *p, *start = s;
+	const char *name, *nameend;
+	char *buf = NULL;
+	size_t size = 0, len = 0;
+	char quote = '\0';
+	int ret = 0;
+	size_t closelen; /* length of the closing } or )) */
+
+	for (p = s; *p && !ret; ++p) {
+		if (*p == '\\' && p[1]) {
+			++p;
+			continue;
+		} else if (quote) {
+			if (*p == quote)
+				quote = '\0';
+			if (quote != '"' || *p != '$')
+				continue;
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+			continue;
+		} else if (*p != '$') {
+			continue;
+		}
+
+		switch (scanparam(p, &name, &nameend, &closelen)) {
+		case -1:
+			fprintf(stderr, "syntax error: missing '%s'\n",
+					(closelen == 2) ? "))" : "}");
+			free(buf);
+			return -1;
+		case 0:
+			/* just a dollar sign */
+			continue;
+		}
+
+		if (strappend(&buf, &size, &len, start, (size_t)(p - start))
+				< 0) {
+			free(buf);
+			return -1;
+		}
+		ret = expand_param(&buf, &size, &len, name,
+				(size_t)(nameend - name), closelen, quote);
+		start = nameend + closelen;
+		p = start - 1;
+	}
+	if (!ret)
+		ret = strappend(&buf, &size, &len, start, strlen(start));
+	if (ret < 0) {
+		free(buf);
+		return -1;
+	}
+	*res = buf;
+	return 0;
+}
+
+static int
+expand_value(char **buf, size_t *size, size_t *len, const char *val,
+		int quoted)
+{
+	/*
+	 * append val to the buffer, escaping the characters parsecmd(),
+	 * exec() and pipeline() would otherwise treat specially
+	 */
+	const char *special = quoted ? "\\\"" : "\\\"'|";
+	size_t n;
+
+	while (*val) {
+		n = strcspn(val, special);
+		if (strappend(buf, size, len, val, n) < 0)
+			return -1;
+		val += n;
+		if (*val) {
+			if (strappend(buf, size, len, "\\", 1) < 0
+					|| strappend(buf, size, len, val, 1) < 0)
+				return -1;
+			++val;
+		}
+	}
+	return 0;
+}
+
+static int
+scanparam(const char *p, const char **name, const char **nameend,
+		size_t *closelen)
+{
+	/*
+	 * find the name of the parameter that the $ at p starts and the
+	 * length of its closing } or )). returns 0 if it's just a dollar
+	 * sign and -1 if the closing } or )) is missing.
+	 */
+	const char *end;
+	int depth = 0;
+
+	*name = p + 1;
+	*closelen = 0;
+	if ((*name)[0] == '(' && (*name)[1] == '(') {
+		*closelen = 2;
+		for (end = *name += 2; *end; ++end) {
+			if (*end == '(')
+				++depth;
+			else if (*end == ')' && !depth--)
+				break;
+		}
+		if (end[0] != ')' || end[1] != ')')
+			return -1;
+	} else if (**name == '{') {
+		*closelen = 1;
+		if (!(end = strchr(++*name, '}')))
+			return -1;
+	} else if (isdigit((unsigned char)(**name))
+			|| (**name && strchr("#@*?$", **name))) {
+		end = *name + 1;
+	} else if (isalpha((unsigned char)(**name)) || **name == '_') {
+		for (end = *name + 1; isalnum((unsigned char)(*end))
+				|| *end == '_'; ++end)
+			;
+	} else {
+		return 0;
+	}
+	*nameend = end;
+	return 1;
 }
 
 /*
@@ -1236,8 +9623,13 @@ freecmd(const struct command *cmd)
  * pathname expansion functions
  */
 static int
-expand_path(const struct command *cmd, struct command *newcmd)
+expand_path(const struct command *cmd, struct command *newcmd,
+		struct cmdinfo *info)
 {
+	/*
+	 * the arguments that the pattern with the most matches became are
+	 * remembered in info, see runbatches()
+	 */
 	size_t readarg;
 	size_t writearg = 0;
 
@@ -1270,15 +9662,23 @@ expand_path(const struct command *cmd, struct command *newcmd)
 			 */
 			newcmd->dynallocinfo[writearg++] = 0;
 		} else {
-			int g = weglob(cmd->argv[readarg], 0, NULL, &globbuf);
+			int g = weglob(cmd->argv[readarg], GLOB_NOCHECK, NULL,
+					&globbuf);
 			if (g != 0 && g != GLOB_NOMATCH) {
 				newcmd->argc = writearg;
 				freecmd(newcmd);
 				return -1;
 			}
+			if (globbuf.gl_pathc > info->globend
+					- info->globstart) {
+				info->globstart = writearg;
+				info->globend = writearg + globbuf.gl_pathc;
+			}
 			for (i = 0; i < globbuf.gl_pathc; i++) {
 				if (writearg >= currsize) {
-					currsize += ARGV_ALLOC_SIZE;
+					/* a big directory can match a lot */
+					currsize += (currsize > ARGV_ALLOC_SIZE)
+						? currsize : ARGV_ALLOC_SIZE;
 					if (realloccmd(currsize, newcmd)
 							< 0)
 						return -1;
@@ -1311,14 +9711,24 @@ expand_path(const struct command *cmd, struct command *newcmd)
 static char *
 expand_lone_tilde(const char *s)
 {
+	/*
+	 * a copy, getpwnam() keeps what it returns in the same place for
+	 * every thread
+	 */
+	struct passwd *pw;
+	const char *dir;
+	char *copy = NULL;
+
 	if (s[1] == '\0') {
-		return getenv("HOME");
-	} else {
-		struct passwd *pw = getpwnam(s + 1);
-		if (!pw)
-			return NULL;
-		return pw->pw_dir;
+		if ((dir = envget("HOME")))
+			copy = westrdup(dir);
+		return copy;
 	}
+	proclock();
+	if ((pw = getpwnam(s + 1)))
+		copy = westrdup(pw->pw_dir);
+	procunlock();
+	return copy;
 }
 
 static char *
@@ -1328,7 +9738,7 @@ expand_tilde(const char *s, int *dynalloc)
 	if (s[0] != '~')
 		return NULL;
 	if (!(tail = strpbrk(s, "/ "))) {
-		*dynalloc = 0;
+		*dynalloc = 1;
 		return expand_lone_tilde(s);
 	} else {
 		char *sdup = westrndup(s, (size_t)(tail - s));
@@ -1342,10 +9752,13 @@ expand_tilde(const char *s, int *dynalloc)
 		if (!exp)
 			return NULL;
 		explen = strlen(exp);
-		if (!(result = wemalloc(explen + taillen + 1)))
+		if (!(result = wemalloc(explen + taillen + 1))) {
+			free(exp);
 			return NULL;
+		}
 		memcpy(result, exp, explen);
 		memcpy(result + explen, tail, taillen + 1);
+		free(exp);
 		*dynalloc = 1;
 		return result;
 	}
@@ -1355,6 +9768,20 @@ expand_tilde(const char *s, int *dynalloc)
  * ===========================================================================
  * option parsing functions
  */
+static int
+optbatchjobs(const char *n)
+{
+	/* how many batches set -o autobatch runs at the same time */
+	int jobs;
+
+	if (xstrtoint(&jobs, n, 10) < 0 || jobs < 1 || jobs > 1024) {
+		logerr("invalid number of batch jobs '%s'", n);
+		return -1;
+	}
+	batchjobs = jobs;
+	return 0;
+}
+
 static void
 optcmdlineset(int initialized, const char *arg0, char *arg1, char **cmdline)
 {
@@ -1373,63 +9800,107 @@ optcmdlineset(int initialized, const char *arg0, char *arg1, char **cmdline)
 }
 
 static void
-optlist(int plus)
+optlist(int plus, struct sink *out)
 {
 	if (plus) {
-		printf("set %co clobber\n",
+		sinkprintf(out, "set %co autobatch\n",
+				(opts & OPT_AUTOBATCH) ? '-' : '+');
+		sinkprintf(out, "set -o batchjobs=%d\n", batchjobs);
+		sinkprintf(out, "set %co clobber\n",
 				(opts & OPT_CLOBBER) ? '-' : '+');
-		printf("set %co cmdline\n",
+		sinkprintf(out, "set %co cmdline\n",
 				(opts & OPT_CMDLINE) ? '-' : '+');
-		printf("set %co exec\n",
+		sinkprintf(out, "set %co exec\n",
 				(opts & OPT_EXEC) ? '-' : '+');
-		printf("set %co glob\n",
+		sinkprintf(out, "set %co glob\n",
 				(opts & OPT_GLOB) ? '-' : '+');
-		printf("set %co ignoreeof\n",
+		sinkprintf(out, "set %co ignoreeof\n",
 				(opts & OPT_IGNOREEOF) ? '-' : '+');
-		printf("set %co pipefail\n",
+		sinkprintf(out, "set -o pipebuf=%d\n", pipebuf);
+		sinkprintf(out, "set %co pipefail\n",
 				(opts & OPT_PIPEFAIL) ? '-' : '+');
-		printf("set %co stdin\n",
+		sinkprintf(out, "set -o 'prompt=%s'\n",
+				promptfmt ? promptfmt : defaultprompt);
+		sinkprintf(out, "set %co stdin\n",
 				(opts & OPT_STDIN) ? '-' : '+');
-		printf("set %co verbose\n",
+		sinkprintf(out, "set -o 'tracefile=%s'\n",
+				tracepath ? tracepath : "");
+		sinkprintf(out, "set %co verbose\n",
 				(opts & OPT_VERBOSE) ? '-' : '+');
+		sinkprintf(out, "set %co xtrace\n",
+				(opts & OPT_XTRACE) ? '-' : '+');
+		sinkprintf(out, "set -o xtracebuf=%lu\n",
+				(unsigned long)(tracesize));
 	} else {
-		printf("clobber    %s\n",
+		sinkprintf(out, "autobatch  %s\n",
+				(opts & OPT_AUTOBATCH) ? "on" : "off");
+		sinkprintf(out, "batchjobs  %d\n", batchjobs);
+		sinkprintf(out, "clobber    %s\n",
 				(opts & OPT_CLOBBER) ? "on" : "off");
-		printf("cmdline    %s\n",
+		sinkprintf(out, "cmdline    %s\n",
 				(opts & OPT_CMDLINE) ? "on" : "off");
-		printf("exec       %s\n",
+		sinkprintf(out, "exec       %s\n",
 				(opts & OPT_EXEC) ? "on" : "off");
-		printf("glob       %s\n",
+		sinkprintf(out, "glob       %s\n",
 				(opts & OPT_GLOB) ? "on" : "off");
-		printf("ignoreeof  %s\n",
+		sinkprintf(out, "ignoreeof  %s\n",
 				(opts & OPT_IGNOREEOF) ? "on" : "off");
-		printf("pipefail   %s\n",
+		if (pipebuf)
+			sinkprintf(out, "pipebuf    %d\n", pipebuf);
+		else
+			sinkprintf(out, "pipebuf    default\n");
+		sinkprintf(out, "pipefail   %s\n",
 				(opts & OPT_PIPEFAIL) ? "on" : "off");
-		printf("stdin      %s\n",
+		sinkprintf(out, "prompt     %s\n",
+				promptfmt ? promptfmt : defaultprompt);
+		sinkprintf(out, "stdin      %s\n",
 				(opts & OPT_STDIN) ? "on" : "off");
-		printf("verbose    %s\n",
+		sinkprintf(out, "tracefile  %s\n",
+				tracepath ? tracepath : "off");
+		sinkprintf(out, "verbose    %s\n",
 				(opts & OPT_VERBOSE) ? "on" : "off");
+		sinkprintf(out, "xtrace     %s\n",
+				(opts & OPT_XTRACE) ? "on" : "off");
+		if (tracering)
+			sinkprintf(out, "xtracebuf  %lu\n",
+					(unsigned long)(tracesize));
+		else
+			sinkprintf(out, "xtracebuf  off\n");
 	}
 }
 
 static int
-optparse(int initialized, int argc, char *argv[], char **cmdline, FILE **input)
+optparse(int initialized, int argc, char *argv[], char **cmdline, FILE **input,
+		struct sink *out)
 {
 	/* used in main() and the set builtin. */
 	const char *curr;
 	int nomoreoptions = 0;
 	int plus;
+	int fd;
 	int i; /* since argc is an int let's make this an int too */
 
 	for (i = 1; i < argc; ++i) {
 		if (!initialized && (nomoreoptions || (argv[i][0] != '-'
 					&& argv[i][0] != '+'))) {
 			opts &= ~OPT_STDIN;
-			*input = fopen(argv[i], "r");
-			if (!(*input)) {
-				logerr("fopen '%s':", argv[i]);
+			/* out of the way of the fds the script uses */
+			if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0) {
+				logerr("open '%s':", argv[i]);
+				return -1;
+			}
+			if (fd < SHELL_FD_BASE && redirmove(&fd) < 0) {
+				close(fd);
+				return -1;
+			}
+			if (!(*input = fdopen(fd, "r"))) {
+				logerr("fdopen '%s':", argv[i]);
+				close(fd);
 				return -1;
 			}
+			/* the rest are arguments for the script */
+			topframe.argv = argv + i + 1;
+			topframe.argc = (size_t)(argc - i - 1);
 			break;
 		} else if (!nomoreoptions && argv[i][0] == '-') {
 			if (argv[i][1] == '-' && !argv[i][2]) {
@@ -1456,7 +9927,14 @@ optparse(int initialized, int argc, char *argv[], char **cmdline, FILE **input)
 						opt += 2;
 					}
 
-					if (!strcmp(opt, "clobber")) {
+					if (!strcmp(opt, "autobatch")) {
+						opttoggle(enable,
+							OPT_AUTOBATCH);
+					} else if (!strncmp(opt, "batchjobs=",
+								10)) {
+						if (optbatchjobs(opt + 10) < 0)
+							return -1;
+					} else if (!strcmp(opt, "clobber")) {
 						opttoggle(enable,
 							OPT_CLOBBER);
 					} else if (!strcmp(opt, "cmdline")
@@ -1487,11 +9965,28 @@ optparse(int initialized, int argc, char *argv[], char **cmdline, FILE **input)
 								)) {
 						opttoggle(enable,
 							OPT_PIPEFAIL);
+					} else if (!strncmp(opt, "pipebuf=",
+								8)) {
+						if (optpipebuf(opt + 8) < 0)
+							return -1;
+					} else if (!strncmp(opt, "prompt=", 7)) {
+						promptset(opt + 7);
 					} else if (!strcmp(opt, "stdin")) {
 						opttoggle(enable, OPT_STDIN);
+					} else if (!strncmp(opt, "tracefile=",
+								10)) {
+						if (opttracefile(opt + 10) < 0)
+							return -1;
 					} else if (!strcmp(opt, "verbose")) {
 						opttoggle(enable,
 							OPT_VERBOSE);
+					} else if (!strcmp(opt, "xtrace")) {
+						opttoggle(enable,
+							OPT_XTRACE);
+					} else if (!strncmp(opt, "xtracebuf=",
+								10)) {
+						if (optxtracebuf(opt + 10) < 0)
+							return -1;
 					} else {
 						fprintf(stderr, "%s: "
 							"unrecognized "
@@ -1500,7 +9995,7 @@ optparse(int initialized, int argc, char *argv[], char **cmdline, FILE **input)
 					}
 				} else {
 					if (initialized) {
-						optlist(plus);
+						optlist(plus, out);
 					} else {
 						fprintf(stderr, "%s: "
 							"missing argument "
@@ -1550,8 +10045,11 @@ optparse(int initialized, int argc, char *argv[], char **cmdline, FILE **input)
 			case 'v':
 				opttoggle(!plus, OPT_VERBOSE);
 				break;
+			case 'x':
+				opttoggle(!plus, OPT_XTRACE);
+				break;
 			default:
-				fprintf(stderr, "usage: %s [+-Cfsv] "
+				fprintf(stderr, "usage: %s [+-Cfsvx] "
 						"[+-c cmdline] "
 						"[+-o option]\n", argv[0]);
 				return -1;
@@ -1565,19 +10063,274 @@ optparse(int initialized, int argc, char *argv[], char **cmdline, FILE **input)
 	return 0;
 }
 
-static void
-opttoggle(int enable, int opt)
+static int
+optpipebuf(const char *size)
+{
+	/*
+	 * set the size of the buffer of pipes between commands, in bytes
+	 * or with a k or m suffix. the kernel rounds it up, so the size
+	 * that's remembered (and shown by set -o) is what it gave a test
+	 * pipe. 0 goes back to the default.
+	 */
+	unsigned long n;
+#if defined(F_SETPIPE_SZ)
+	int fds[2];
+	int got;
+#endif /* F_SETPIPE_SZ */
+
+	if (optsize(size, &n) < 0 || n > INT_MAX) {
+		logerr("invalid pipe buffer size '%s'", size);
+		return -1;
+	}
+	if (n == 0) {
+		pipebuf = 0;
+		return 0;
+	}
+
+#if defined(F_SETPIPE_SZ)
+	if (pipe(fds) < 0) {
+		logerr("pipe:");
+		return -1;
+	}
+	got = fcntl(fds[1], F_SETPIPE_SZ, (int)(n));
+	if (got < 0)
+		logerr("can't make pipe buffers %lu bytes:", n);
+	weclose(fds[0]);
+	weclose(fds[1]);
+	if (got < 0)
+		return -1;
+	pipebuf = got;
+	return 0;
+#else
+	logerr("pipe buffer sizes can't be changed on this system");
+	return -1;
+#endif /* F_SETPIPE_SZ */
+}
+
+static int
+optsize(const char *s, unsigned long *n)
+{
+	/* parse a size in bytes, or with a k or m suffix */
+	char *end;
+
+	errno = 0;
+	*n = strtoul(s, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		*n *= 1024;
+		++end;
+	} else if (*end == 'm' || *end == 'M') {
+		*n *= 1024 * 1024;
+		++end;
+	}
+	if (end == s || *end || errno || *s == '-')
+		return -1;
+	return 0;
+}
+
+static void
+opttoggle(int enable, int opt)
+{
+	if (enable)
+		opts |= opt;
+	else
+		opts &= ~opt;
+}
+
+static int
+opttracefile(const char *path)
+{
+	/*
+	 * write a timeline of what the shell does to path, see tracespan().
+	 * an empty path stops it.
+	 */
+	char *newpath = NULL;
+	int fd = -1;
+
+	if (*path) {
+		if (!(newpath = westrdup(path)))
+			return -1;
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND
+						| O_CLOEXEC, 0666)) < 0) {
+			logerr("open '%s':", path);
+			free(newpath);
+			return -1;
+		}
+		if (fd < SHELL_FD_BASE && redirmove(&fd) < 0) {
+			close(fd);
+			free(newpath);
+			return -1;
+		}
+		if (write(fd, "[\n", 2) < 0) {
+			logerr("write '%s':", path);
+			close(fd);
+			free(newpath);
+			return -1;
+		}
+	}
+	if (tracefd >= 0)
+		close(tracefd);
+	free(tracepath);
+	tracefd = fd;
+	tracepath = newpath;
+	return 0;
+}
+
+static int
+optxtracebuf(const char *size)
 {
-	if (enable)
-		opts |= opt;
-	else
-		opts &= ~opt;
+	/*
+	 * keep the records of set -x in a buffer of this size instead of
+	 * writing them to stderr. they're shown by the tracedump builtin
+	 * and when the shell exits with a non-zero status. 0 goes back to
+	 * stderr.
+	 */
+	unsigned long n;
+	char *ring = NULL;
+
+	if (optsize(size, &n) < 0 || n > INT_MAX) {
+		logerr("invalid trace buffer size '%s'", size);
+		return -1;
+	}
+	if (n && !(ring = wemalloc(n)))
+		return -1;
+	free(tracering);
+	tracering = ring;
+	tracesize = n;
+	tracepos = 0;
+	tracewrapped = 0;
+	return 0;
 }
 
 /*
  * ===========================================================================
  * functions used by builtins
  */
+static char *
+cachedir(void)
+{
+	/* where the cache builtin keeps its entries, created if needed */
+	const char *base;
+	char *dir;
+	size_t len;
+
+	if ((base = envget("SUSHI_CACHE_DIR")) && *base) {
+		if (!(dir = westrdup(base)))
+			return NULL;
+	} else if ((base = envget("XDG_CACHE_HOME")) && *base) {
+		if (!(dir = wemalloc(strlen(base) + 8)))
+			return NULL;
+		sprintf(dir, "%s/sushi", base);
+	} else if ((base = envget("HOME")) && *base) {
+		if (!(dir = wemalloc(strlen(base) + 16)))
+			return NULL;
+		/* ~/.cache might not be there yet either */
+		sprintf(dir, "%s/.cache", base);
+		mkdir(dir, 0700);
+		strcat(dir, "/sushi");
+	} else {
+		logerr("$HOME is not set");
+		return NULL;
+	}
+	len = strlen(dir);
+	while (len > 1 && dir[len - 1] == '/')
+		dir[--len] = '\0';
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		logerr("mkdir '%s':", dir);
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+static int
+cachetee(int out, int err, int outfile, int errfile)
+{
+	/*
+	 * copy what a command writes to the pipes out and err to the
+	 * shell's stdout and stderr as it comes, and to outfile and
+	 * errfile. returns -1 if the files didn't get all of it.
+	 */
+	struct pollfd pfds[2];
+	char buf[8192];
+	ssize_t n, w, off;
+	int ret = 0, i;
+
+	pfds[0].fd = out;
+	pfds[1].fd = err;
+	pfds[0].events = pfds[1].events = POLLIN;
+	fflush(stdout);
+	while (pfds[0].fd >= 0 || pfds[1].fd >= 0) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			logerr("poll:");
+			return -1;
+		}
+		for (i = 0; i < 2; ++i) {
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+			if ((n = read(pfds[i].fd, buf, sizeof(buf))) < 0
+					&& errno == EINTR)
+				continue;
+			if (n <= 0) {
+				/* poll() ignores negative fds */
+				pfds[i].fd = -1;
+				continue;
+			}
+			for (off = 0; off < n; off += w)
+				if ((w = write(i ? STDERR_FILENO
+							: stdoutfd(),
+							buf + off,
+							(size_t)(n - off))) <= 0)
+					break;
+			if (write(i ? errfile : outfile, buf, (size_t)(n))
+					!= n)
+				ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void
+coprocclose(int fd)
+{
+	/*
+	 * close the shell's ends of the coprocesses' pipes, or forget fd if
+	 * it's one of them and was closed or replaced, with fd < 0 closing
+	 * all of them
+	 */
+	size_t i, j;
+
+	for (i = 0; i < ncoprocs; ++i) {
+		for (j = 0; j < 2; ++j) {
+			if (coprocs[i].fds[j] < 0
+					|| (fd >= 0 && coprocs[i].fds[j] != fd))
+				continue;
+			if (fd < 0)
+				close(coprocs[i].fds[j]);
+			coprocs[i].fds[j] = -1;
+		}
+	}
+}
+
+static void
+coprocreap(void)
+{
+	/* note the status of the coprocesses that have exited */
+	int wstatus;
+	size_t i;
+
+	for (i = 0; i < ncoprocs; ++i) {
+		if (coprocs[i].status >= 0
+				|| waitpid(coprocs[i].pid, &wstatus, WNOHANG)
+				<= 0)
+			continue;
+		coprocs[i].status = WIFSIGNALED(wstatus)
+			? SIGNAL_EXITSTATUS + WTERMSIG(wstatus)
+			: WEXITSTATUS(wstatus);
+	}
+}
+
 static int
 executable(int dirfd, const char *name)
 {
@@ -1588,15 +10341,326 @@ executable(int dirfd, const char *name)
 	return faccessat(dirfd, name, X_OK, AT_EACCESS) == 0;
 }
 
+#if defined(ENABLE_LOADABLE)
+static struct loaded *
+loadedfind(const char *name)
+{
+	struct loaded *lb = NULL;
+	size_t i;
+
+	proclock();
+	for (i = 0; i < nloaded && !lb; ++i)
+		if (!strcmp(loadedbuiltins[i]->name, name))
+			lb = loadedbuiltins[i];
+	procunlock();
+	return lb;
+}
+
+static int
+loadedrun(const struct loaded *lb, const struct command *cmd,
+		const struct cmdinfo *info)
+{
+	/*
+	 * run a builtin added with enable -f. it's given the descriptors
+	 * its redirections point to instead of having them moved into
+	 * place, so that it costs no more than the call.
+	 */
+	struct sushi_builtin_env env;
+
+	if (info->noutfds)
+		logerr("only the first output redirection is used");
+	env.abi = SUSHI_ABI_VERSION;
+	env.in = redirresolve(info, info->nredirs, STDIN_FILENO);
+	env.out = redirresolve(info, info->nredirs, STDOUT_FILENO);
+	if (env.out == STDOUT_FILENO)
+		env.out = stdoutfd();
+	env.err = redirresolve(info, info->nredirs, STDERR_FILENO);
+	env.getvar = varget;
+	env.setvar = varset;
+	env.unsetvar = loadedunset;
+	/* what was printed before has to come first */
+	fflush(stdout);
+	return lb->fn((int)(cmd->argc), cmd->argv, &env);
+}
+
+static int
+loadedunset(const char *name)
+{
+	varunset(name);
+	if (envunset(name) < 0)
+		return -1;
+	return 0;
+}
+#endif /* ENABLE_LOADABLE */
+
+static int
+readassign(char *line, int raw, char *const *names, size_t n,
+		const char *ifs)
+{
+	/*
+	 * split a line read by the read builtin at the characters in ifs
+	 * and set the variables in names to the fields, the last one gets
+	 * the rest of the line. whitespace in ifs is trimmed around the
+	 * fields, and unless raw a backslash makes the next character
+	 * part of a field. line is changed in place.
+	 */
+	char *p = line, *w, *start, *lastlit;
+	size_t i;
+	char c;
+
+	for (i = 0; i < n; ++i) {
+		while (*p && strchr(ifs, *p) && isspace((unsigned char)(*p)))
+			++p;
+		start = w = lastlit = p;
+		while (*p) {
+			if (!raw && *p == '\\') {
+				if (p[1])
+					*w++ = *++p;
+				++p;
+				lastlit = w;
+				continue;
+			}
+			if (i + 1 < n && strchr(ifs, *p))
+				break;
+			*w++ = *p++;
+			if (!strchr(ifs, w[-1])
+					|| !isspace((unsigned char)(w[-1])))
+				lastlit = w;
+		}
+
+		c = *p;
+		if (i + 1 < n) {
+			*w = '\0';
+			if (c)
+				++p;
+			/* a separator that isn't a space can have some around */
+			while (*p && strchr(ifs, *p)
+					&& isspace((unsigned char)(*p)))
+				++p;
+			if (c && isspace((unsigned char)(c)) && *p
+					&& strchr(ifs, *p))
+				++p;
+		} else {
+			*lastlit = '\0';
+		}
+		if (varset(names[i], start) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+readfd(int fd, int delim, long timeout, char **buf, size_t *size,
+		size_t *len)
+{
+	/*
+	 * append a line from fd to *buf, without the delimiter. returns 1
+	 * if a whole line was read, 0 at the end of the input, -1 on error
+	 * and -2 if timeout milliseconds passed first (unless it's -1).
+	 *
+	 * if fd can be seeked in, it's read in chunks and the offset is
+	 * moved back to right after the line, so that the next command
+	 * reading from it starts there.
+	 */
+	struct timespec now, deadline;
+	struct pollfd pfd;
+	size_t chunk;
+	ssize_t r;
+	char *nl;
+	long left;
+
+	chunk = (lseek(fd, 0, SEEK_CUR) < 0) ? 1 : READ_CHUNK_SIZE;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	if (strappend(buf, size, len, "", 0) < 0)
+		return -1;
+
+	for (;;) {
+		if (timeout >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = (long)(deadline.tv_sec - now.tv_sec) * 1000
+				+ (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			r = (left > 0) ? poll(&pfd, 1, (int)(left)) : 0;
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0) {
+				logerr("poll:");
+				return -1;
+			}
+			if (r == 0)
+				return -2;
+		}
+		if (*len + chunk + 1 > *size) {
+			char *newbuf;
+			size_t newsize = *size * 2 + chunk;
+			if (!(newbuf = werealloc(*buf, newsize)))
+				return -1;
+			*buf = newbuf;
+			*size = newsize;
+		}
+		if ((r = read(fd, *buf + *len, chunk)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logerr("read:");
+			return -1;
+		}
+		if (r == 0) {
+			(*buf)[*len] = '\0';
+			return 0;
+		}
+		if ((nl = memchr(*buf + *len, delim, (size_t)(r)))) {
+			r -= nl + 1 - (*buf + *len);
+			if (r && lseek(fd, -(off_t)(r), SEEK_CUR) < 0) {
+				logerr("lseek:");
+				return -1;
+			}
+			*len = (size_t)(nl - *buf);
+			(*buf)[*len] = '\0';
+			return 1;
+		}
+		*len += (size_t)(r);
+	}
+}
+
+static int
+readtimeout(const char *s, long *ms)
+{
+	/*
+	 * parse a timeout in seconds, which can have a fraction and an
+	 * s, m, h or d suffix for seconds, minutes, hours or days
+	 */
+	char *end;
+	double sec;
+
+	errno = 0;
+	sec = strtod(s, &end);
+	if (end != s && *end && !end[1] && strchr("smhd", *end)) {
+		sec *= (*end == 'd') ? 86400 : (*end == 'h') ? 3600
+			: (*end == 'm') ? 60 : 1;
+		++end;
+	}
+	if (end == s || *end || errno || sec < 0 || sec > INT_MAX / 1000) {
+		logerr("invalid timeout '%s'", s);
+		return -1;
+	}
+	*ms = (long)(sec * 1000);
+	return 0;
+}
+
+static int
+sinkflush(struct sink *s)
+{
+	/* write out what's left, returns -1 if anything couldn't be */
+	ssize_t n;
+	size_t off = 0;
+
+	while (!s->failed && off < s->len) {
+		if ((n = write(s->fd, s->buf + off, s->len - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logerr("write:");
+			s->failed = 1;
+			break;
+		}
+		off += (size_t)(n);
+	}
+	s->len = 0;
+	return s->failed ? -1 : 0;
+}
+
+static void
+sinkopen(struct sink *s, int fd)
+{
+	s->fd = fd;
+	s->failed = 0;
+	s->len = 0;
+	/* what was printed before has to come first */
+	fflush(stdout);
+}
+
+static void
+sinkprintf(struct sink *s, const char *fmt, ...)
+{
+	/*
+	 * a printf() that writes to a sink. C89 has no vsnprintf(), so it
+	 * only knows %c, %d, %ld, %lu, %s and %%, which is all builtins
+	 * print.
+	 */
+	va_list ap;
+	const char *p;
+	char num[32], c;
+
+	va_start(ap, fmt);
+	for (; *fmt; ++fmt) {
+		for (p = fmt; *fmt && *fmt != '%'; ++fmt)
+			;
+		sinkwrite(s, p, (size_t)(fmt - p));
+		if (!*fmt)
+			break;
+		switch (*++fmt) {
+		case 'c':
+			c = (char)(va_arg(ap, int));
+			sinkwrite(s, &c, 1);
+			continue;
+		case 'd':
+			sprintf(num, "%d", va_arg(ap, int));
+			break;
+		case 'l':
+			if (*++fmt == 'd')
+				sprintf(num, "%ld", va_arg(ap, long));
+			else
+				sprintf(num, "%lu", va_arg(ap, unsigned long));
+			break;
+		case 's':
+			p = va_arg(ap, const char *);
+			sinkwrite(s, p, strlen(p));
+			continue;
+		default:
+			sinkwrite(s, fmt, 1);
+			continue;
+		}
+		sinkwrite(s, num, strlen(num));
+	}
+	va_end(ap);
+}
+
+static void
+sinkwrite(struct sink *s, const char *p, size_t n)
+{
+	size_t chunk;
+
+	while (n && !s->failed) {
+		if (s->len == sizeof(s->buf) && sinkflush(s) < 0)
+			return;
+		chunk = sizeof(s->buf) - s->len;
+		if (chunk > n)
+			chunk = n;
+		memcpy(s->buf + s->len, p, chunk);
+		s->len += chunk;
+		p += chunk;
+		n -= chunk;
+	}
+}
+
 static int
-which(const char *pathenv, const char *name)
+which(const char *pathenv, const char *name, struct sink *out)
 {
 	char *path, *searchdir;
 	size_t i, l;
 	int dirfd, found = 0;
 	if (strchr(name, '/')) {
 		if ((found = executable(AT_FDCWD, name))) {
-			printf("%s: an external command at %s\n", name, name);
+			sinkprintf(out, "%s: an external command at %s\n",
+					name, name);
 		}
 		return found;
 	}
@@ -1611,13 +10675,13 @@ which(const char *pathenv, const char *name)
 		if ((dirfd = open(searchdir, O_RDONLY)) >= 0) {
 			if ((found = executable(dirfd, name))) {
 				if (i && path[i - 1] != '/')
-					printf("%s: an external command at "
-							"%s/%s\n", name,
-							searchdir, name);
+					sinkprintf(out, "%s: an external "
+							"command at %s/%s\n",
+							name, searchdir, name);
 				else
-					printf("%s: an external command at "
-							"%s%s\n", name,
-							searchdir, name);
+					sinkprintf(out, "%s: an external "
+							"command at %s%s\n",
+							name, searchdir, name);
 			}
 			close(dirfd);
 			if (found)
@@ -1633,40 +10697,200 @@ which(const char *pathenv, const char *name)
  * ===========================================================================
  * utility functions
  */
+#if !defined(SUSHI_LIBRARY)
+static int
+atend(FILE *f)
+{
+	/* check if there's nothing but blank space left to read in f */
+	int c;
+
+	while ((c = getc(f)) != EOF && isspace(c))
+		;
+	if (c == EOF)
+		return 1;
+	ungetc(c, f);
+	return 0;
+}
+#endif /* !SUSHI_LIBRARY */
+
+static int
+copyfd(int from, int to)
+{
+	/* copy what's left of from to to */
+	char buf[8192];
+	ssize_t n, w, off;
+
+	while ((n = read(from, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		for (off = 0; off < n; off += w) {
+			if ((w = write(to, buf + off, (size_t)(n - off))) < 0
+					&& errno != EINTR)
+				return -1;
+			if (w < 0)
+				w = 0;
+		}
+	}
+	return 0;
+}
+
+static uint64_t
+hash64(const char *s, size_t len, uint64_t h)
+{
+	/*
+	 * 64-bit FNV-1a, for keys that end up on disk where djb2 would
+	 * collide too easily. h is 0 to start or the hash of what came
+	 * before s.
+	 */
+	if (!h)
+		h = ((uint64_t)(0xcbf29ce4) << 32) | 0x84222325;
+	while (len--)
+		h = (h ^ (unsigned char)(*s++))
+			* (((uint64_t)(1) << 40) + 0x1b3);
+	return h;
+}
+
+static char *
+delimit(char *str, char delim)
+{
+	/*
+	 * split str at delim with an arbitrary amount of spaces
+	 * before and after delim, e.g:
+	 *
+	 * char s[] = "echo abcd | rev";
+	 * char *tail = delimit(s, '|');
+	 * printf("pipe '%s' into '%s'\n", s, tail);
+	 *
+	 * will output "pipe 'echo abcd' into 'rev'".
+	 *
+	 * if delim is not found in str, NULL is returned and str
+	 * is left unchanged.
+	 */
+	char *ptr, *space, *tail;
+	if (!(ptr = findunquoted(str, delim)))
+		return NULL;
+	*ptr = '\0';
+	space = ptr - 1;
+
+	/* skip over any leading spaces in the head */
+	while (*space == ' ')
+		--space;
+
+	*(space + 1) = '\0';
+	tail = ptr + 1;
+
+	/* skip over any trailing spaces in the tail */
+	while (*tail == ' ')
+		++tail;
+
+	return tail;
+}
+
+static const char *
+envget(const char *name)
+{
+	/*
+	 * getenv(), setenv() and unsetenv() for the shell itself, which
+	 * keep other threads of the library from changing the environment
+	 * meanwhile, see proclock()
+	 */
+	const char *val;
+
+	proclock();
+	val = getenv(name);
+	procunlock();
+	return val;
+}
+
+static int
+envset(const char *name, const char *val)
+{
+	int ret;
+
+	proclock();
+	ret = setenv(name, val, 1);
+	procunlock();
+	return ret;
+}
+
+static int
+envunset(const char *name)
+{
+	int ret = 0;
+
+	proclock();
+	if (getenv(name))
+		ret = unsetenv(name);
+	procunlock();
+	return ret;
+}
+
 static char *
-delimit(char *str, char delim)
+findunquoted(char *s, char c)
 {
 	/*
-	 * split str at delim with an arbitrary amount of spaces
-	 * before and after delim, e.g:
-	 *
-	 * char s[] = "echo abcd | rev";
-	 * char *tail = delimit(s, '|');
-	 * printf("pipe '%s' into '%s'\n", s, tail);
-	 *
-	 * will output "pipe 'echo abcd' into 'rev'".
-	 *
-	 * if delim is not found in str, NULL is returned and str
-	 * is left unchanged.
+	 * strchr(3) that skips over quoted and backslash-escaped
+	 * characters. a '|' right after a '>' is skipped too, since it's
+	 * part of the >| redirection operator.
 	 */
-	char *ptr, *space, *tail;
-	if (!(ptr = strchr(str, delim)))
-		return NULL;
-	*ptr = '\0';
-	space = ptr - 1;
+	char quote = '\0';
+	char *p;
+
+	for (p = s; *p; ++p) {
+		if (*p == '\\' && p[1])
+			++p;
+		else if (quote && *p == quote)
+			quote = '\0';
+		else if (quote)
+			continue;
+		else if (*p == '\'' || *p == '"')
+			quote = *p;
+		else if (*p == c && !(c == '|' && p > s && p[-1] == '>'))
+			return p;
+	}
+	return NULL;
+}
 
-	/* skip over any leading spaces in the head */
-	while (*space == ' ')
-		--space;
+static int
+isclosing(const char *p)
+{
+	/* check if p starts with a keyword that ends a list of commands */
+	static const char *const kws[] = {
+		"}", ")", "then", "elif", "else", "fi", "do", "done"
+	};
+	size_t i;
 
-	*(space + 1) = '\0';
-	tail = ptr + 1;
+	for (i = 0; i < LEN(kws); ++i)
+		if (iskeyword(p, kws[i]))
+			return 1;
+	return 0;
+}
 
-	/* skip over any trailing spaces in the tail */
-	while (*tail == ' ')
-		++tail;
+static int
+iscompound(const char *p)
+{
+	/* check if p starts a compound command that can be piped */
+	static const char *const kws[] = {
+		"{", "if", "while", "until", "for"
+	};
+	size_t i;
 
-	return tail;
+	if (*p == '(')
+		return 1;
+	for (i = 0; i < LEN(kws); ++i)
+		if (iskeyword(p, kws[i]))
+			return 1;
+	return 0;
+}
+
+static int
+iskeyword(const char *p, const char *kw)
+{
+	/* check if p starts with the word kw */
+	size_t l = strlen(kw);
+	return !strncmp(p, kw, l) && (!p[l] || strchr(" \t\n;&|()", p[l]));
 }
 
 static char *
@@ -1695,28 +10919,334 @@ popchar(char *ptr)
 	*(ptr + l) = '\0';
 }
 
+static void
+proclock(void)
+{
+	/*
+	 * in the library, keep other threads from changing the process's
+	 * descriptors, working directory, environment and SIGCHLD action
+	 * until procunlock(), and from forking while they're changed. a
+	 * thread can take it again while it holds it.
+	 */
+#if defined(SUSHI_LIBRARY)
+	if (!proclocked++)
+		pthread_mutex_lock(&procmutex);
+#endif /* SUSHI_LIBRARY */
+}
+
+static void
+procunlock(void)
+{
+#if defined(SUSHI_LIBRARY)
+	if (!--proclocked)
+		pthread_mutex_unlock(&procmutex);
+#endif /* SUSHI_LIBRARY */
+}
+
 static void
 report(pid_t pid)
 {
 	if (pid > 0) {
-		int wstatus, exitstatus = 0;
+		int wstatus;
 		waitpid(pid, &wstatus, 0);
+		reportstatus(wstatus);
+	}
+}
+
+static void
+reportstatus(int wstatus)
+{
+	int exitstatus = 0;
+
+	if (WIFSIGNALED(wstatus)) {
+		char *sigstr;
+		exitstatus = WTERMSIG(wstatus) + SIGNAL_EXITSTATUS;
+		if ((sigstr = optstrsignal(WTERMSIG(wstatus))))
+			fprintf(stderr, "%s\n", sigstr);
+	} else if (WIFEXITED(wstatus)) {
+		exitstatus = WEXITSTATUS(wstatus);
+	}
+
+	laststatus = exitstatus;
+	if (exitstatus > 0)
+		lastfail = exitstatus;
+}
+
+static int
+strappend(char **buf, size_t *size, size_t *len, const char *s, size_t n)
+{
+	if (*len + n + 1 > *size) {
+		char *newbuf;
+		size_t newsize = *size ? *size : 64;
+		while (*len + n + 1 > newsize)
+			newsize *= 2;
+		if (!(newbuf = werealloc(*buf, newsize)))
+			return -1;
+		*buf = newbuf;
+		*size = newsize;
+	}
+	memcpy(*buf + *len, s, n);
+	*len += n;
+	(*buf)[*len] = '\0';
+	return 0;
+}
+
+static const char *
+scancmd(const char *p, int stage)
+{
+	/*
+	 * find the end of the pipeline starting at p: an unquoted
+	 * semicolon, newline, comment, && or || outside of parentheses,
+	 * a ) that closes a subshell, a | before a compound command or
+	 * at the end of the line, or the end of the string. if stage is
+	 * 1, any | ends it, as after a compound command. quotes don't
+	 * continue onto the next line.
+	 */
+	const char *start = p;
+	char quote = '\0';
+	int depth = 0;
+
+	for (; *p && *p != '\n'; ++p) {
+		if (*p == '\\' && p[1] && p[1] != '\n')
+			++p;
+		else if (quote && *p == quote)
+			quote = '\0';
+		else if (quote)
+			continue;
+		else if (*p == '\'' || *p == '"')
+			quote = *p;
+		else if (depth)
+			/* inside $(( )) or a process substitution */
+			depth += (*p == '(') - (*p == ')');
+		else if (*p == ';' || (*p == '#' && p > start
+					&& (p[-1] == ' ' || p[-1] == '\t')))
+			break;
+		else if ((p[0] == '&' && p[1] == '&')
+				|| (p[0] == '|' && p[1] == '|'))
+			break;
+		else if (*p == '|' && (p == start || p[-1] != '>')
+				&& (stage || iscompound(skipblank(p + 1))
+					|| !*skipblank(p + 1)
+					|| *skipblank(p + 1) == '\n'))
+			break;
+		else if (*p == '(')
+			++depth;
+		else if (*p == ')' && !depth--)
+			break;
+	}
+	return p;
+}
+
+static void
+shellexit(int status)
+{
+	/*
+	 * a forked copy of the shell shares the offset of the script
+	 * it's reading with its parent, and the stdio cleanup done by
+	 * exit() would seek it back to what the copy has buffered
+	 */
+	if (forked) {
+		fflush(stdout);
+		_exit(status);
+	}
+#if defined(SUSHI_LIBRARY)
+	/* stop everything up to sushi_eval() like the return builtin does */
+	exitcode = status;
+	exiting = returning = 1;
+#else
+	if (status && tracering) {
+		struct sink out;
+		fputs("trace of the last commands:\n", stderr);
+		sinkopen(&out, STDERR_FILENO);
+		xtracedump(&out);
+		sinkflush(&out);
+	}
+	exit(status);
+#endif /* SUSHI_LIBRARY */
+}
+
+static pid_t
+shellfork(void)
+{
+	/*
+	 * fork() a child that starts with the shell's stdout, which is the
+	 * output of sushi_eval() in the library, and without the parent's
+	 * SIGCHLD pipes. the child is a process of its own, so it never
+	 * gives up proclock(). stdout is flushed with no other thread
+	 * between, or what the program using the library had buffered would
+	 * be written again, by the child, to wherever its stdout goes.
+	 */
+	pid_t pid;
+
+	proclock();
+	flockfile(stdout);
+	fflush(stdout);
+	pid = fork();
+	funlockfile(stdout);
+	if (pid != 0) {
+		procunlock();
+		return pid;
+	}
+	sigchldreset();
+	if (evalout >= 0) {
+		if (dup2(evalout, STDOUT_FILENO) < 0) {
+			logerr("dup2:");
+			_exit(MISC_FAILURE_STATUS);
+		}
+		evalout = -1;
+	}
+	return 0;
+}
+
+static void
+sigchld(int sig)
+{
+	/* wake up timedwait() and forreap(), in each thread waiting */
+	int olderrno = errno;
+	int i;
+	(void)(sig);
+	for (i = 0; i < nsigchld; ++i)
+		if (write(sigchldpipes[i][1], "", 1) < 0)
+			errno = olderrno;
+	errno = olderrno;
+}
+
+static void
+sigchldclose(int fd)
+{
+	/* undo sigchldopen() */
+	int i;
+
+	proclock();
+	for (i = 0; i < nsigchld; ++i)
+		if (sigchldpipes[i][0] == fd)
+			sigchldbusy[i] = 0;
+	if (!--sigchldusers)
+		sigaction(SIGCHLD, &sigchldold, NULL);
+	procunlock();
+}
 
-		if (WIFSIGNALED(wstatus)) {
-			char *sigstr;
-			exitstatus = WTERMSIG(wstatus) + SIGNAL_EXITSTATUS;
-			if ((sigstr = optstrsignal(WTERMSIG(wstatus))))
-				fprintf(stderr, "%s\n", sigstr);
-		} else if (WIFEXITED(wstatus)) {
-			exitstatus = WEXITSTATUS(wstatus);
+static int
+sigchldopen(void)
+{
+	/*
+	 * make SIGCHLD write to a pipe and return its read end, so that
+	 * poll() on it waits for any child. each thread waiting at once
+	 * gets a pipe of its own. they're kept for the next ones instead
+	 * of being closed, the handler could be writing to them.
+	 */
+	struct sigaction sa;
+	char c;
+	int i, fd = -1;
+
+	proclock();
+	for (i = 0; i < nsigchld && sigchldbusy[i]; ++i)
+		;
+	if (i == (int)(LEN(sigchldpipes))) {
+		logerr("too many threads waiting for children");
+		goto end;
+	}
+	if (i == nsigchld) {
+		if (pipe(sigchldpipes[i]) < 0) {
+			logerr("pipe:");
+			goto end;
 		}
+		fcntl(sigchldpipes[i][0], F_SETFD, FD_CLOEXEC);
+		fcntl(sigchldpipes[i][1], F_SETFD, FD_CLOEXEC);
+		fcntl(sigchldpipes[i][0], F_SETFL, O_NONBLOCK);
+		fcntl(sigchldpipes[i][1], F_SETFL, O_NONBLOCK);
+		++nsigchld;
+	}
+	/* what was written for the one before */
+	while (read(sigchldpipes[i][0], &c, 1) > 0)
+		;
+	sigchldbusy[i] = 1;
+	fd = sigchldpipes[i][0];
+	if (!sigchldusers++) {
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sa.sa_handler = sigchld;
+		sigaction(SIGCHLD, &sa, &sigchldold);
+	}
+
+end:
+	procunlock();
+	return fd;
+}
 
-		laststatus = exitstatus;
-		if (exitstatus > 0)
-			lastfail = exitstatus;
+static void
+sigchldreset(void)
+{
+	/*
+	 * in a forked child, drop the parent's SIGCHLD pipes, which are
+	 * still the parent's to read
+	 */
+	int i, n = nsigchld;
+
+	if (sigchldusers)
+		sigaction(SIGCHLD, &sigchldold, NULL);
+	sigchldusers = 0;
+	nsigchld = 0;
+	for (i = 0; i < n; ++i) {
+		close(sigchldpipes[i][0]);
+		close(sigchldpipes[i][1]);
+		sigchldbusy[i] = 0;
 	}
 }
 
+static const char *
+skipblank(const char *p)
+{
+	/* skip over spaces, tabs and a comment */
+	p += strspn(p, " \t");
+	if (*p == '#')
+		p += strcspn(p, "\n");
+	return p;
+}
+
+static int
+statracy(const struct stat *st)
+{
+	/*
+	 * check if a file changed so recently that it could be changed
+	 * again without its mtime and ctime changing, on file systems
+	 * that only keep them in whole seconds
+	 */
+	time_t now = time(NULL);
+	return st->st_mtime >= now || st->st_ctime >= now;
+}
+
+static int
+stdoutfd(void)
+{
+	/*
+	 * where the shell's own standard output goes. sushi_eval() sets
+	 * evalout to its capture, which every command gets as its stdout
+	 * instead of the process's, and a redirection of stdout for a
+	 * builtin, a function or a group overrides.
+	 */
+	return (evalout >= 0) ? evalout : STDOUT_FILENO;
+}
+
+static size_t
+strhash(const char *s, size_t len)
+{
+	/* djb2 */
+	size_t h = 5381;
+	while (len--)
+		h = h * 33 + (unsigned char)(*s++);
+	return h;
+}
+
+static int
+syntaxerr(const char *p)
+{
+	/* report an unexpected word at p */
+	fprintf(stderr, "syntax error: unexpected '%.*s'\n",
+			(int)(strcspn(p, " \t\n;")), p);
+	return -1;
+}
+
 static int
 xstrtoint(int *res, const char *s, int base)
 {
@@ -1738,27 +11268,6 @@ xstrtoint(int *res, const char *s, int base)
  * ===========================================================================
  * error checking functions
  */
-static int
-wexasprintf(char **strp, const char *fmt, ...)
-{
-	va_list ap, ap2;
-	int sz, ret;
-
-	va_start(ap, fmt);
-	va_start(ap2, fmt);
-
-	errno = 0;
-	sz = vsnprintf(NULL, 0, fmt, ap2);
-	va_end(ap2);
-
-	if (sz < 0 || !(*strp = wemalloc((size_t)(sz) + 1)))
-		return -1;
-	ret = vsprintf(*strp, fmt, ap);
-	va_end(ap);
-
-	return ret;
-}
-
 static int
 weclose(int fd)
 {
@@ -1906,6 +11415,261 @@ vlogerr(const char *fmt, va_list ap)
 	}
 }
 
+#if defined(SUSHI_LIBRARY)
+/*
+ * ===========================================================================
+ * library functions
+ */
+static void
+ctxinit(void)
+{
+	/* what the library sets up once for the whole process */
+	clock_gettime(CLOCK_MONOTONIC, &shellstart);
+	/* without it, what a thread cached is kept when it ends */
+	if (pthread_key_create(&ctxkey, ctxthreadend) != 0)
+		ctxkeyfailed = 1;
+}
+
+static void
+ctxswap(struct sushi *sh)
+{
+	/*
+	 * exchange the state of the shell with the context's, so that it
+	 * runs with the context's. doing it again puts it back.
+	 */
+	swapmem(&opts, &sh->opts, sizeof(opts));
+	swapmem(&laststatus, &sh->laststatus, sizeof(laststatus));
+	swapmem(&lastfail, &sh->lastfail, sizeof(lastfail));
+	swapmem(&lastexit, &sh->lastexit, sizeof(lastexit));
+	swapmem(&pipestatus, &sh->pipestatus, sizeof(pipestatus));
+	swapmem(&npipestatus, &sh->npipestatus, sizeof(npipestatus));
+	swapmem(&lastduration, &sh->lastduration, sizeof(lastduration));
+	swapmem(&pipebuf, &sh->pipebuf, sizeof(pipebuf));
+	swapmem(&batchjobs, &sh->batchjobs, sizeof(batchjobs));
+	swapmem(&promptfmt, &sh->promptfmt, sizeof(promptfmt));
+	swapmem(&topframe, &sh->topframe, sizeof(topframe));
+	swapmem(functions, sh->functions, sizeof(functions));
+	swapmem(variables, sh->variables, sizeof(variables));
+	swapmem(&sourcecache, &sh->sourcecache, sizeof(sourcecache));
+	swapmem(&coprocs, &sh->coprocs, sizeof(coprocs));
+	swapmem(&ncoprocs, &sh->ncoprocs, sizeof(ncoprocs));
+	swapmem(&tracering, &sh->tracering, sizeof(tracering));
+	swapmem(&tracesize, &sh->tracesize, sizeof(tracesize));
+	swapmem(&tracepos, &sh->tracepos, sizeof(tracepos));
+	swapmem(&tracewrapped, &sh->tracewrapped, sizeof(tracewrapped));
+	swapmem(&tracefd, &sh->tracefd, sizeof(tracefd));
+	swapmem(&tracepath, &sh->tracepath, sizeof(tracepath));
+}
+
+static void
+ctxthreadend(void *p)
+{
+	/*
+	 * free what a thread that ran contexts keeps for itself when it
+	 * ends, the rest of its state belongs to the contexts
+	 */
+	size_t i;
+
+	(void)(p);
+	for (i = 0; i < LEN(arithcache); ++i) {
+		free(arithcache[i].text);
+		arithfree(arithcache[i].tree);
+	}
+	for (i = 0; i < LEN(condcache); ++i) {
+		free(condcache[i].text);
+		condfree(condcache[i].tree);
+	}
+	for (i = 0; i < LEN(regexcache); ++i) {
+		if (regexcache[i].pattern) {
+			free(regexcache[i].pattern);
+			regfree(&regexcache[i].re);
+		}
+	}
+	free(redirsaves);
+	free(substs);
+	free(groups);
+}
+
+static void
+swapmem(void *a, void *b, size_t n)
+{
+	unsigned char *p = a, *q = b, c;
+
+	while (n--) {
+		c = *p;
+		*p++ = *q;
+		*q++ = c;
+	}
+}
+
+int
+sushi_eval(struct sushi *sh, const char *line, int *status, char **out)
+{
+	/*
+	 * the context's state is swapped into this thread's, so contexts
+	 * run at once on different threads, and only what changes the
+	 * process's descriptors, directory or environment waits for the
+	 * others, see proclock().
+	 *
+	 * the output is captured by giving each command a tmpfile() as its
+	 * stdout instead of the process's, see stdoutfd(). not a pipe,
+	 * nothing would read it while the commands fill it.
+	 */
+	FILE *capture = NULL;
+	char buf[BUFSIZ];
+	size_t len = 0, size = 0;
+	ssize_t n;
+	int ret = 0;
+
+	if (out)
+		*out = NULL;
+	pthread_mutex_lock(&sh->lock);
+	ctxswap(sh);
+	if (!ctxkeyfailed)
+		pthread_setspecific(ctxkey, &ctxkey);
+	if (!argv0)
+		argv0 = "sushi";
+	curframe = &topframe;
+	if (out) {
+		/* out of the way of redirections like exec 3>file */
+		if (!(capture = tmpfile())) {
+			logerr("tmpfile:");
+			ret = -1;
+			goto end;
+		}
+		if ((evalout = fcntl(fileno(capture), F_DUPFD_CLOEXEC,
+						SHELL_FD_BASE)) < 0) {
+			logerr("fcntl:");
+			ret = -1;
+			goto end;
+		}
+	}
+
+	if (takecmd(line, 0) > 0) {
+		fputs("syntax error: unexpected end of input\n", stderr);
+		ret = -1;
+	}
+	*status = exiting ? exitcode : laststatus;
+	exiting = returning = 0;
+
+	/* the output, or an empty string if there was none */
+	if (capture) {
+		lseek(evalout, 0, SEEK_SET);
+		if (strappend(out, &size, &len, "", 0) < 0)
+			ret = -1;
+		while (ret == 0 && (n = read(evalout, buf, sizeof(buf))) != 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				logerr("read:");
+				ret = -1;
+			} else if (strappend(out, &size, &len, buf,
+						(size_t)(n)) < 0) {
+				ret = -1;
+			}
+		}
+		if (ret < 0) {
+			free(*out);
+			*out = NULL;
+		}
+	}
+
+end:
+	if (evalout >= 0)
+		close(evalout);
+	evalout = -1;
+	if (capture)
+		fclose(capture);
+	ctxswap(sh);
+	pthread_mutex_unlock(&sh->lock);
+	return ret;
+}
+
+void
+sushi_free(struct sushi *sh)
+{
+	struct function *fn;
+	struct sourced *src;
+	struct var *v;
+	size_t i;
+
+	if (!sh)
+		return;
+	for (i = 0; i < LEN(sh->functions); ++i) {
+		while ((fn = sh->functions[i])) {
+			sh->functions[i] = fn->next;
+			funcrelease(fn);
+		}
+	}
+	for (i = 0; i < LEN(sh->variables); ++i) {
+		while ((v = sh->variables[i])) {
+			sh->variables[i] = v->next;
+			varfree(v);
+		}
+	}
+	while ((src = sh->sourcecache)) {
+		sh->sourcecache = src->next;
+		sourcerelease(src);
+	}
+	/* coprocesses still running see the end of their input */
+	for (i = 0; i < sh->ncoprocs; ++i) {
+		if (sh->coprocs[i].fds[0] >= 0)
+			close(sh->coprocs[i].fds[0]);
+		if (sh->coprocs[i].fds[1] >= 0)
+			close(sh->coprocs[i].fds[1]);
+		free(sh->coprocs[i].name);
+	}
+	free(sh->coprocs);
+	if (sh->tracefd >= 0)
+		close(sh->tracefd);
+	free(sh->tracepath);
+	free(sh->tracering);
+	free(sh->pipestatus);
+	free(sh->promptfmt);
+	pthread_mutex_destroy(&sh->lock);
+	free(sh);
+}
+
+struct sushi *
+sushi_new(void)
+{
+	struct sushi *sh;
+	size_t i;
+
+	if (!(sh = wemalloc(sizeof(*sh))))
+		return NULL;
+	/* the defaults of a shell running a script */
+	sh->opts = OPT_EXEC | OPT_GLOB;
+	sh->laststatus = sh->lastfail = sh->lastexit = 0;
+	sh->pipestatus = NULL;
+	sh->npipestatus = 0;
+	sh->lastduration = -1;
+	sh->pipebuf = 0;
+	sh->batchjobs = 1;
+	sh->promptfmt = NULL;
+	sh->topframe.argv = NULL;
+	sh->topframe.argc = 0;
+	sh->topframe.prev = NULL;
+	for (i = 0; i < LEN(sh->functions); ++i)
+		sh->functions[i] = NULL;
+	for (i = 0; i < LEN(sh->variables); ++i)
+		sh->variables[i] = NULL;
+	sh->sourcecache = NULL;
+	sh->coprocs = NULL;
+	sh->ncoprocs = 0;
+	sh->tracering = NULL;
+	sh->tracesize = sh->tracepos = 0;
+	sh->tracewrapped = 0;
+	sh->tracefd = -1;
+	sh->tracepath = NULL;
+	if (pthread_mutex_init(&sh->lock, NULL) != 0) {
+		free(sh);
+		return NULL;
+	}
+	pthread_once(&ctxonce, ctxinit);
+	return sh;
+}
+#else
 /*
  * ===========================================================================
  * the main() function
@@ -1914,14 +11678,32 @@ int
 main(int argc, char *argv[])
 {
 	int interactive = 0;
+	size_t i;
 	char *cmdline = NULL;
 	FILE *input = stdin;
 	if (!argc)
 		return 1;
 	argv0 = argv[0];
+	clock_gettime(CLOCK_MONOTONIC, &shellstart);
+
+	/* a snapshot is only valid for the environment it was made in */
+	for (i = 0; environ[i]; ++i)
+		;
+	if ((startenv = wemallocarray(i + 1, sizeof(char *)))) {
+		for (i = 0; environ[i]; ++i)
+			if (!(startenv[i] = westrdup(environ[i])))
+				break;
+		startenv[i] = NULL;
+	}
 
 #if defined(ENABLE_PLEDGE)
+#if defined(ENABLE_LOADABLE)
+	/* dlopen() maps libraries executable */
+	if (pledge("stdio rpath wpath cpath tty proc exec prot_exec",
+				NULL) < 0) {
+#else
 	if (pledge("stdio rpath wpath cpath tty proc exec", NULL) < 0) {
+#endif /* ENABLE_LOADABLE */
 		logerr("pledge:");
 		return 1;
 	}
@@ -1941,20 +11723,68 @@ main(int argc, char *argv[])
 
 		/* make the shell interactive */
 		interactive = 1;
-		term = STDOUT_FILENO;
+
+		/*
+		 * keep a descriptor of our own for the terminal, stdout can
+		 * be redirected while a { } group or a function runs
+		 */
+		if ((term = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC,
+						SHELL_FD_BASE)) < 0)
+			term = STDOUT_FILENO;
 		shell_pgid = getpgrp();
 	}
 
-	if (optparse(0, argc, argv, &cmdline, &input) < 0)
+	if (optparse(0, argc, argv, &cmdline, &input, NULL) < 0)
 		return 1;	
+	startopts = opts;
+
+	/*
+	 * read ~/.sushi_profile if this is a login shell and ~/.sushirc if
+	 * the shell is interactive
+	 */
+	if (argv[0][0] == '-' || (interactive && (opts & OPT_STDIN))) {
+		const char *home = getenv("HOME");
+		char *rc;
+		int loaded = 0;
+		if (home && argv[0][0] == '-'
+				&& (rc = wemalloc(strlen(home) + 16))) {
+			sprintf(rc, "%s/.sushi_profile", home);
+			sourcefile(rc, 0);
+			free(rc);
+		}
+		/* loading a snapshot of what it did is faster */
+		if (home && interactive && (opts & OPT_STDIN)
+				&& (rc = snappath())) {
+			loaded = (snapload(rc) == 1);
+			free(rc);
+		}
+		if (home && interactive && (opts & OPT_STDIN) && !loaded
+				&& (rc = wemalloc(strlen(home) + 16))) {
+			sprintf(rc, "%s/.sushirc", home);
+			sourcefile(rc, 0);
+			free(rc);
+		}
+	}
 	if (cmdline) {
-		takecmd(cmdline);
+		if (takecmd(cmdline, 1) > 0)
+			fputs("syntax error: unexpected end of input\n", stderr);
 	} else {
 		char *line = NULL;
-		size_t lsize = 0;
+		char *script = NULL; /* lines of an unfinished command */
+		size_t lsize = 0, scriptsize = 0, scriptlen = 0;
+		struct timespec start, end;
+		int more;
 		for (;;) {
-			if (interactive && (opts & OPT_STDIN))
-				fputs(prompt, stderr);
+			if (interactive && (opts & OPT_STDIN) && scriptlen) {
+				fputs(contprompt, stderr);
+			} else if (interactive && (opts & OPT_STDIN)) {
+				/* don't leave finished coprocesses as zombies */
+				coprocreap();
+				promptrefresh();
+				if (promptrender(&prompt, &promptsize) == 0)
+					fputs(prompt, stderr);
+				promptwait(input);
+			}
 			errno = 0;
 			if (getline(&line, &lsize, input) < 0) {
 				if (!errno && interactive
@@ -1969,9 +11799,44 @@ main(int argc, char *argv[])
 					break;
 				}
 			}
-			takecmd(line);
+			if (scriptlen && strappend(&script, &scriptsize,
+						&scriptlen, line,
+						strlen(line)) < 0) {
+				scriptlen = 0;
+				continue;
+			}
+			if (interactive)
+				clock_gettime(CLOCK_MONOTONIC, &start);
+			/*
+			 * the last command of a script doesn't need a fork,
+			 * but only look ahead in a file, reading more from
+			 * a pipe or a terminal could wait forever
+			 */
+			more = takecmd(scriptlen ? script : line,
+					input != stdin && atend(input));
+			if (more) {
+				/* keep the line and wait for the rest */
+				if (!scriptlen && strappend(&script,
+							&scriptsize,
+							&scriptlen, line,
+							strlen(line)) < 0)
+					scriptlen = 0;
+				continue;
+			}
+			scriptlen = 0;
+			if (interactive && line[0] && line[0] != '\n') {
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				lastduration = (long)(end.tv_sec - start.tv_sec)
+					* 1000 + (end.tv_nsec - start.tv_nsec)
+					/ 1000000;
+			}
 		}
+		if (scriptlen)
+			fputs("syntax error: unexpected end of file\n", stderr);
 		free(line);
+		free(script);
 	}
-	return 0;
+	shellexit(lastexit);
+	return lastexit;
 }
+#endif /* SUSHI_LIBRARY */
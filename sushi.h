@@ -0,0 +1,157 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+/*
+ * what sushi offers C programs: builtins loaded into the shell at
+ * runtime, and libsushi, the shell as a library.
+ */
+#ifndef SUSHI_H
+#define SUSHI_H
+
+/*
+ * ===========================================================================
+ * loadable builtins
+ *
+ * builtins are loaded into the shell at runtime with
+ *
+ * enable -f ./libmybuiltins.so name ...
+ *
+ * which needs a shell built with ENABLE_LOADABLE. a library of builtins
+ * defines SUSHI_ABI once, and every builtin name as a function called
+ * sushi_builtin_name, e.g:
+ *
+ * #include <string.h>
+ * #include <unistd.h>
+ * #include "sushi.h"
+ *
+ * SUSHI_ABI;
+ *
+ * int
+ * sushi_builtin_hello(int argc, char *argv[],
+ *		const struct sushi_builtin_env *env)
+ * {
+ *	const char *who = (argc > 1) ? argv[1] : env->getvar("USER");
+ *
+ *	if (!who)
+ *		return 1;
+ *	write(env->out, "hello ", 6);
+ *	write(env->out, who, strlen(who));
+ *	write(env->out, "\n", 1);
+ *	return env->setvar("GREETED", who) < 0;
+ * }
+ *
+ * built with cc -shared -fPIC -o libmybuiltins.so mybuiltins.c. the
+ * builtin runs in the shell process, so it has to return instead of
+ * exiting and shouldn't change the shell's own descriptors, it gets the
+ * ones its redirections point to instead. what it returns is its exit
+ * status.
+ *
+ * the shell only loads libraries built for its SUSHI_ABI_VERSION. it's
+ * raised whenever something here changes in a way that isn't
+ * compatible, and fields are only ever added at the end of
+ * struct sushi_builtin_env.
+ */
+#define SUSHI_ABI_VERSION 1
+
+struct sushi_builtin_env {
+	int abi;            /* the shell's SUSHI_ABI_VERSION */
+
+	/* standard input, output and error, -1 if they're closed */
+	int in;
+	int out;
+	int err;
+
+	/*
+	 * the shell's variables, and those in the environment. the string
+	 * getvar() returns is only valid until the variable changes.
+	 * setvar() and unsetvar() return -1 on failure and 0 otherwise.
+	 */
+	const char *(*getvar)(const char *name);
+	int (*setvar)(const char *name, const char *val);
+	int (*unsetvar)(const char *name);
+};
+
+typedef int sushi_builtin(int argc, char *argv[],
+		const struct sushi_builtin_env *env);
+
+/* the ABI version a library was built for */
+#define SUSHI_ABI const int sushi_abi = SUSHI_ABI_VERSION
+
+/*
+ * ===========================================================================
+ * libsushi
+ *
+ * make libsushi.a builds the shell as a library, for running command
+ * lines from a program without starting /bin/sh for each like system()
+ * and popen() do, e.g:
+ *
+ * struct sushi *sh = sushi_new();
+ * char *out;
+ * int status;
+ *
+ * sushi_eval(sh, "x=$(( 6 * 7 ))", &status, NULL);
+ * if (sushi_eval(sh, "ls /etc | wc -l; echo $x", &status, &out) == 0)
+ *	printf("%d: %s", status, out);
+ * free(out);
+ * sushi_free(sh);
+ *
+ * each struct sushi has its own variables, functions, options, exit
+ * statuses, coprocesses, traces (set -x buffer and -o tracefile) and
+ * cache of sourced files. a context can be used from any thread, one
+ * command line at a time, and contexts on different threads run at
+ * once. the working directory, the environment (and so exported
+ * variables) and the file descriptors belong to the whole process
+ * though: while a builtin, function or group has redirections of its
+ * own, or the environment changes, the others wait before they start a
+ * command or redirect anything. up to 16 threads at once can wait for
+ * the commands of a for -j loop. exit and exec only end the command
+ * line they're in, exec runs the command instead of replacing the
+ * program.
+ *
+ * capturing the output hands each command the capture as its standard
+ * output, fd 1 stays the program's. only while a builtin, function or
+ * group redirects its own stdout, as in f >file, does fd 1 point
+ * elsewhere, and exec >file points it there for the whole program.
+ */
+struct sushi;
+
+/* NULL if it couldn't be allocated */
+struct sushi *sushi_new(void);
+
+/*
+ * run the commands in line and set *status to the exit status of the
+ * last one, as $? would be. if out isn't NULL, what they write to their
+ * standard output is kept instead, and *out is set to it, a string to
+ * be freed. returns -1 if line isn't complete (e.g an if without a fi)
+ * or it couldn't be run, 0 otherwise.
+ */
+int sushi_eval(struct sushi *sh, const char *line, int *status,
+		char **out);
+
+void sushi_free(struct sushi *sh);
+
+#endif /* SUSHI_H */